@@ -0,0 +1,897 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Based on the command helpers of mmc_cmds.c, field firmware update
+ * support Copyright (c) 2016 SanDisk Corp.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmc.h"
+#include "libmmc.h"
+
+#define RPMB_MULTI_CMD_MAX_CMDS 3
+
+/* Busy timeouts the kernel uses where EXT_CSD gives none (drivers/mmc/core) */
+#define DEFAULT_CMD6_TIMEOUT_MS		500
+#define MIN_PART_SWITCH_TIME_MS		300
+#define SANITIZE_TIMEOUT_MS		(240 * 1000)
+#define BKOPS_TIMEOUT_MS		(120 * 1000)
+#define CACHE_FLUSH_TIMEOUT_MS		(30 * 1000)
+#define LEGACY_ERASE_TIMEOUT_MS		(300 * 255 * 255)
+
+/* EXT_CSD fields only used for the timeouts */
+#define EXT_CSD_POWER_OFF_NOTIFICATION	34
+#define EXT_CSD_SEC_TRIM_MULT		229
+#define EXT_CSD_SEC_ERASE_MULT		230
+#define EXT_CSD_TRIM_MULT		232
+#define EXT_CSD_POWER_OFF_LONG_TIME	247
+
+#define EXT_CSD_POWER_OFF_LONG		3
+
+#define ERASE_ARG_SECURE		0x80000000
+#define ERASE_ARG_TRIM_OR_DISCARD	0x00008003
+
+struct mmc_dev {
+	int fd;
+	char *path;
+	bool cache_ext_csd;
+	bool have_ext_csd;
+	unsigned long ext_csd_gen;
+	__u8 ext_csd[512];
+	unsigned int poll_ms;
+	mmc_trace_t trace_fn;
+	void *trace_priv;
+};
+
+/*
+ * Bumped by every command that may change card state, on any handle and
+ * from any thread, so an EXT_CSD snapshot is only reused while nothing was
+ * sent to a card since. Only accessed atomically.
+ */
+static unsigned long card_gen = 1;
+
+static void note_cmd(const struct mmc_ioc_cmd *cmd)
+{
+	switch (cmd->opcode) {
+	case MMC_SEND_EXT_CSD:
+	case MMC_SEND_CSD:
+	case MMC_SEND_CID:
+	case MMC_SEND_STATUS:
+	case MMC_SEND_WRITE_PROT:
+	case MMC_SEND_WRITE_PROT_TYPE:
+		break;
+	default:
+		__sync_fetch_and_add(&card_gen, 1);
+	}
+}
+
+void mmc_dev_set_trace(struct mmc_dev *dev, mmc_trace_t fn, void *priv)
+{
+	dev->trace_fn = fn;
+	dev->trace_priv = priv;
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Every command reaches the card through here */
+static int submit(struct mmc_dev *dev, unsigned long request, void *arg,
+		  struct mmc_ioc_cmd *cmds, unsigned int ncmds)
+{
+	__u64 start = 0;
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < ncmds; i++)
+		note_cmd(&cmds[i]);
+
+	if (dev->trace_fn)
+		start = now_ns();
+
+	if (ioctl(dev->fd, request, arg))
+		ret = -errno;
+
+	if (dev->trace_fn)
+		dev->trace_fn(dev, cmds, ncmds, ret, start, now_ns() - start,
+			      dev->trace_priv);
+
+	return ret;
+}
+
+static inline __u32 per_byte_htole32(const __u8 *arr)
+{
+	return arr[0] | arr[1] << 8 | arr[2] << 16 | arr[3] << 24;
+}
+
+int mmc_dev_open(const char *path, int flags, struct mmc_dev **devp)
+{
+	struct mmc_dev *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+
+	dev->path = strdup(path);
+	if (!dev->path) {
+		free(dev);
+		return -ENOMEM;
+	}
+
+	dev->fd = open(path, flags);
+	if (dev->fd < 0) {
+		int err = -errno;
+
+		free(dev->path);
+		free(dev);
+		return err;
+	}
+
+	*devp = dev;
+	return 0;
+}
+
+void mmc_dev_close(struct mmc_dev *dev)
+{
+	if (!dev)
+		return;
+
+	close(dev->fd);
+	free(dev->path);
+	free(dev);
+}
+
+int mmc_dev_fd(struct mmc_dev *dev)
+{
+	return dev->fd;
+}
+
+const char *mmc_dev_path(struct mmc_dev *dev)
+{
+	return dev->path;
+}
+
+void mmc_dev_cache_extcsd(struct mmc_dev *dev, bool on)
+{
+	dev->cache_ext_csd = on;
+	dev->ext_csd_gen = 0;
+}
+
+void mmc_dev_poll_busy(struct mmc_dev *dev, unsigned int poll_ms)
+{
+	dev->poll_ms = poll_ms;
+}
+
+int mmc_cmd(struct mmc_dev *dev, struct mmc_ioc_cmd *cmd)
+{
+	return submit(dev, MMC_IOC_CMD, cmd, cmd, 1);
+}
+
+int mmc_multi_cmd(struct mmc_dev *dev, struct mmc_ioc_multi_cmd *multi_cmd)
+{
+	return submit(dev, MMC_IOC_MULTI_CMD, multi_cmd, multi_cmd->cmds,
+		      multi_cmd->num_of_cmds);
+}
+
+void mmc_fill_switch_cmd(struct mmc_ioc_cmd *cmd, __u8 index, __u8 value)
+{
+	cmd->opcode = MMC_SWITCH;
+	cmd->write_flag = 1;
+	cmd->arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) |
+		   (value << 8) | EXT_CSD_CMD_SET_NORMAL;
+	cmd->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+}
+
+int mmc_read_extcsd(struct mmc_dev *dev, __u8 *ext_csd)
+{
+	struct mmc_ioc_cmd idata;
+	/* Sampled before CMD8, so a command sent meanwhile invalidates it */
+	unsigned long gen = __sync_fetch_and_add(&card_gen, 0);
+	int ret;
+
+	if (dev->cache_ext_csd && dev->ext_csd_gen == gen) {
+		memcpy(ext_csd, dev->ext_csd, sizeof(dev->ext_csd));
+		return 0;
+	}
+
+	memset(&idata, 0, sizeof(idata));
+	memset(ext_csd, 0, sizeof(__u8) * 512);
+	idata.write_flag = 0;
+	idata.opcode = MMC_SEND_EXT_CSD;
+	idata.arg = 0;
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	idata.blksz = 512;
+	idata.blocks = 1;
+	mmc_ioc_cmd_set_data(idata, ext_csd);
+
+	ret = mmc_cmd(dev, &idata);
+	if (!ret) {
+		/* Also kept for the timing fields, see timing_ext_csd() */
+		memcpy(dev->ext_csd, ext_csd, sizeof(dev->ext_csd));
+		dev->have_ext_csd = true;
+		dev->ext_csd_gen = gen;
+	}
+
+	return ret;
+}
+
+/*
+ * The EXT_CSD the busy timeouts are derived from. Its timing fields don't
+ * change at runtime, so any copy read through this handle will do. Without
+ * one, the kernel's own busy timeout applies, and the card is only asked
+ * when polling busy needs a bound. Returns NULL if there is none, or it
+ * can't be read, e.g. on the RPMB device; the kernel defaults apply then.
+ */
+static const __u8 *timing_ext_csd(struct mmc_dev *dev)
+{
+	__u8 ext_csd[512];
+
+	if (dev->have_ext_csd)
+		return dev->ext_csd;
+	if (!dev->poll_ms || mmc_read_extcsd(dev, ext_csd))
+		return NULL;
+
+	return dev->ext_csd;
+}
+
+unsigned int mmc_switch_timeout(const __u8 *ext_csd, __u8 index, __u8 value)
+{
+	unsigned int generic_ms = 0, part_ms;
+
+	if (ext_csd[EXT_CSD_REV] >= 6)
+		generic_ms = ext_csd[EXT_CSD_GENERIC_CMD6_TIME] * 10;
+	if (!generic_ms)
+		generic_ms = DEFAULT_CMD6_TIMEOUT_MS;
+
+	switch (index) {
+	case EXT_CSD_PART_CONFIG:
+		/* Some cards report too low a value, as the kernel notes */
+		part_ms = ext_csd[EXT_CSD_PART_SWITCH_TIME] * 10;
+		if (ext_csd[EXT_CSD_REV] < 5 || !part_ms)
+			return generic_ms;
+		return part_ms > MIN_PART_SWITCH_TIME_MS ?
+		       part_ms : MIN_PART_SWITCH_TIME_MS;
+	case EXT_CSD_POWER_OFF_NOTIFICATION:
+		if (value == EXT_CSD_POWER_OFF_LONG &&
+		    ext_csd[EXT_CSD_POWER_OFF_LONG_TIME])
+			return ext_csd[EXT_CSD_POWER_OFF_LONG_TIME] * 10;
+		return generic_ms;
+	case EXT_CSD_SANITIZE_START:
+		return SANITIZE_TIMEOUT_MS;
+	case EXT_CSD_BKOPS_START:
+		return BKOPS_TIMEOUT_MS;
+	case EXT_CSD_FLUSH_CACHE:
+		return CACHE_FLUSH_TIMEOUT_MS;
+	default:
+		return generic_ms;
+	}
+}
+
+unsigned int mmc_erase_timeout(const __u8 *ext_csd, __u32 arg, __u32 start,
+			       __u32 end)
+{
+	unsigned int grp_blks = ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] * 1024;
+	__u64 unit_ms, groups;
+	__u32 sectors;
+
+	if (arg & ERASE_ARG_TRIM_OR_DISCARD)
+		unit_ms = ext_csd[EXT_CSD_TRIM_MULT] * 300;
+	else if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 1)
+		unit_ms = ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT] * 300;
+	else
+		unit_ms = 0;	/* timing is in the CSD, not read here */
+
+	if (arg & ERASE_ARG_SECURE) {
+		if (arg & ERASE_ARG_TRIM_OR_DISCARD)
+			unit_ms *= ext_csd[EXT_CSD_SEC_TRIM_MULT];
+		else
+			unit_ms *= ext_csd[EXT_CSD_SEC_ERASE_MULT];
+	}
+
+	if (!unit_ms || !grp_blks || end < start)
+		return LEGACY_ERASE_TIMEOUT_MS;
+
+	/* Cards up to 2 GiB are byte addressed, as the kernel decides it */
+	sectors = ext_csd[EXT_CSD_SEC_COUNT_0] |
+		  ext_csd[EXT_CSD_SEC_COUNT_1] << 8 |
+		  ext_csd[EXT_CSD_SEC_COUNT_2] << 16 |
+		  (__u32)ext_csd[EXT_CSD_SEC_COUNT_3] << 24;
+	if (sectors <= (2u * 1024 * 1024 * 1024) / 512) {
+		start /= 512;
+		end /= 512;
+	}
+
+	/* Like the kernel, charge every erase group the range touches */
+	groups = end / grp_blks - start / grp_blks + 1;
+	if (unit_ms * groups > UINT_MAX)
+		return UINT_MAX;
+
+	return unit_ms * groups;
+}
+
+int mmc_wait_busy(struct mmc_dev *dev, unsigned int timeout_ms,
+		  unsigned int poll_ms, __u32 *response)
+{
+	__u64 deadline = now_ns() + timeout_ms * 1000000ull;
+	int ret;
+
+	for (;;) {
+		ret = mmc_send_status(dev, response);
+		if (ret)
+			return ret;
+		if (R1_CURRENT_STATE(*response) != R1_STATE_PRG &&
+		    (*response & R1_READY_FOR_DATA))
+			return 0;
+		if (now_ns() >= deadline)
+			return -ETIMEDOUT;
+		usleep(poll_ms * 1000);
+	}
+}
+
+/*
+ * Sends the R1b command @cmds[@ncmds - 1] (after the others, if any) with a
+ * @timeout_ms busy timeout. With busy polling enabled on @dev the kernel
+ * doesn't wait for busy and the card is polled with CMD13 instead. Without
+ * a bound to poll against (a 0 @timeout_ms), the kernel waits with its
+ * default timeout as usual.
+ */
+static int busy_cmd(struct mmc_dev *dev, struct mmc_ioc_multi_cmd *multi_cmd,
+		    struct mmc_ioc_cmd *cmd, unsigned int timeout_ms)
+{
+	struct mmc_ioc_cmd *last = multi_cmd ?
+				   &multi_cmd->cmds[multi_cmd->num_of_cmds - 1] :
+				   cmd;
+	bool poll = dev->poll_ms && timeout_ms;
+	__u32 response;
+	int ret;
+
+	last->cmd_timeout_ms = timeout_ms;
+	if (poll)
+		last->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	ret = multi_cmd ? mmc_multi_cmd(dev, multi_cmd) : mmc_cmd(dev, cmd);
+	if (ret || !poll)
+		return ret;
+
+	return mmc_wait_busy(dev, timeout_ms, dev->poll_ms, &response);
+}
+
+int mmc_write_extcsd(struct mmc_dev *dev, __u8 index, __u8 value,
+		     unsigned int timeout_ms)
+{
+	struct mmc_ioc_cmd idata = {};
+	const __u8 *ext_csd;
+	int ret;
+
+	mmc_fill_switch_cmd(&idata, index, value);
+
+	if (!timeout_ms) {
+		ext_csd = timing_ext_csd(dev);
+		timeout_ms = ext_csd ?
+			     mmc_switch_timeout(ext_csd, index, value) : 0;
+	}
+
+	ret = busy_cmd(dev, NULL, &idata, timeout_ms);
+
+	/* The erase timeouts depend on it */
+	if (!ret && index == EXT_CSD_ERASE_GROUP_DEF && dev->have_ext_csd)
+		dev->ext_csd[index] = value;
+
+	return ret;
+}
+
+int mmc_send_status(struct mmc_dev *dev, __u32 *response)
+{
+	struct mmc_ioc_cmd idata;
+	int ret;
+
+	memset(&idata, 0, sizeof(idata));
+	idata.opcode = MMC_SEND_STATUS;
+	idata.arg = (1 << 16);
+	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	ret = mmc_cmd(dev, &idata);
+
+	*response = idata.response[0];
+
+	return ret;
+}
+
+/*
+ * Sends a High Priority Interrupt to the card, using CMD12 or CMD13 with the
+ * HPI bit set, as advertised by HPI_FEATURES.
+ */
+int mmc_send_hpi(struct mmc_dev *dev, const __u8 *ext_csd, __u32 *response)
+{
+	struct mmc_ioc_cmd idata;
+	int ret;
+
+	if (!(ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_SUPP))
+		return -EOPNOTSUPP;
+
+	memset(&idata, 0, sizeof(idata));
+	if (ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_IMPL) {
+		idata.opcode = MMC_STOP_TRANSMISSION;
+		idata.flags = MMC_RSP_R1B | MMC_CMD_AC;
+	} else {
+		idata.opcode = MMC_SEND_STATUS;
+		idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	}
+	idata.arg = (1 << 16) | 1;
+
+	ret = mmc_cmd(dev, &idata);
+
+	*response = idata.response[0];
+
+	return ret;
+}
+
+int mmc_set_write_protect(struct mmc_dev *dev, __u32 blk_addr, bool on)
+{
+	struct mmc_ioc_cmd idata;
+
+	memset(&idata, 0, sizeof(idata));
+	idata.write_flag = 1;
+	if (on)
+		idata.opcode = MMC_SET_WRITE_PROT;
+	else
+		idata.opcode = MMC_CLEAR_WRITE_PROT;
+	idata.arg = blk_addr;
+	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+
+	return mmc_cmd(dev, &idata);
+}
+
+int mmc_get_write_protect_type(struct mmc_dev *dev, __u32 blk_addr,
+			       __u64 *group_bits)
+{
+	struct mmc_ioc_cmd idata;
+	__u8 buf[8] = { 0 };
+	__u64 bits = 0;
+	int x, ret;
+
+	memset(&idata, 0, sizeof(idata));
+	idata.write_flag = 0;
+	idata.opcode = MMC_SEND_WRITE_PROT_TYPE;
+	idata.blksz = 8;
+	idata.blocks = 1;
+	idata.arg = blk_addr;
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	mmc_ioc_cmd_set_data(idata, buf);
+
+	ret = mmc_cmd(dev, &idata);
+
+	for (x = 0; x < sizeof(buf); x++)
+		bits |= (__u64)(buf[7 - x]) << (x * 8);
+	*group_bits = bits;
+
+	return ret;
+}
+
+static int erase(struct mmc_dev *dev, __u32 arg, __u32 start, __u32 end,
+		 bool wait)
+{
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	const __u8 *ext_csd = timing_ext_csd(dev);
+	int ret;
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   3 * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd)
+		return -ENOMEM;
+
+	multi_cmd->num_of_cmds = 3;
+	/* Set erase start address */
+	multi_cmd->cmds[0].opcode = MMC_ERASE_GROUP_START;
+	multi_cmd->cmds[0].arg = start;
+	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	multi_cmd->cmds[0].write_flag = 1;
+
+	/* Set erase end address */
+	multi_cmd->cmds[1].opcode = MMC_ERASE_GROUP_END;
+	multi_cmd->cmds[1].arg = end;
+	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	multi_cmd->cmds[1].write_flag = 1;
+
+	/* Send Erase Command */
+	multi_cmd->cmds[2].opcode = MMC_ERASE;
+	multi_cmd->cmds[2].arg = arg;
+	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	multi_cmd->cmds[2].write_flag = 1;
+
+	/* send erase cmd with multi-cmd */
+	if (wait) {
+		ret = busy_cmd(dev, multi_cmd, NULL,
+			       ext_csd ? mmc_erase_timeout(ext_csd, arg, start, end) :
+					 LEGACY_ERASE_TIMEOUT_MS);
+	} else {
+		multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 |
+					   MMC_CMD_AC;
+		ret = mmc_multi_cmd(dev, multi_cmd);
+	}
+
+	/* Does not work for SPI cards */
+	if (multi_cmd->cmds[1].response[0] & R1_ERASE_PARAM ||
+	    multi_cmd->cmds[2].response[0] & R1_ERASE_SEQ_ERROR)
+		ret = -EIO;
+
+	free(multi_cmd);
+	return ret;
+}
+
+int mmc_erase(struct mmc_dev *dev, __u32 arg, __u32 start, __u32 end)
+{
+	return erase(dev, arg, start, end, true);
+}
+
+int mmc_erase_start(struct mmc_dev *dev, __u32 arg, __u32 start, __u32 end)
+{
+	return erase(dev, arg, start, end, false);
+}
+
+static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
+				  int write_flag, unsigned int blocks,
+				  __u32 arg)
+{
+	ioc->opcode = opcode;
+	ioc->write_flag = write_flag;
+	ioc->arg = arg;
+	ioc->blksz = 512;
+	ioc->blocks = blocks;
+	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+}
+
+int mmc_rpmb_op(struct mmc_dev *dev, const struct rpmb_frame *frame_in,
+		struct rpmb_frame *frame_out, unsigned int out_cnt)
+{
+	int err;
+	u_int16_t rpmb_type;
+	struct mmc_ioc_multi_cmd *mioc;
+	struct mmc_ioc_cmd *ioc;
+	struct rpmb_frame frame_status;
+
+	memset(&frame_status, 0, sizeof(frame_status));
+
+	if (!frame_in || !frame_out || !out_cnt)
+		return -EINVAL;
+
+	/* prepare arguments for MMC_IOC_MULTI_CMD ioctl */
+	mioc = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+		      RPMB_MULTI_CMD_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+	if (!mioc)
+		return -ENOMEM;
+
+	rpmb_type = be16toh(frame_in->req_resp);
+
+	switch (rpmb_type) {
+	case MMC_RPMB_WRITE:
+	case MMC_RPMB_WRITE_KEY:
+		if (out_cnt != 1) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		mioc->num_of_cmds = 3;
+
+		/* Write request */
+		ioc = &mioc->cmds[0];
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1, 1, 0);
+		mmc_ioc_cmd_set_data((*ioc), frame_in);
+
+		/* Result request */
+		ioc = &mioc->cmds[1];
+		frame_status.req_resp = htobe16(MMC_RPMB_READ_RESP);
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1, 0);
+		mmc_ioc_cmd_set_data((*ioc), &frame_status);
+
+		/* Get response */
+		ioc = &mioc->cmds[2];
+		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, 1, 0);
+		mmc_ioc_cmd_set_data((*ioc), frame_out);
+
+		break;
+	case MMC_RPMB_READ_CNT:
+		if (out_cnt != 1) {
+			err = -EINVAL;
+			goto out;
+		}
+		/* fall through */
+
+	case MMC_RPMB_READ:
+		mioc->num_of_cmds = 2;
+
+		/* Read request */
+		ioc = &mioc->cmds[0];
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1, 0);
+		mmc_ioc_cmd_set_data((*ioc), frame_in);
+
+		/* Get response */
+		ioc = &mioc->cmds[1];
+		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, out_cnt, 0);
+		mmc_ioc_cmd_set_data((*ioc), frame_out);
+
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = mmc_multi_cmd(dev, mioc);
+
+out:
+	free(mioc);
+	return err;
+}
+
+int mmc_rpmb_read_counter(struct mmc_dev *dev, __u32 *cnt)
+{
+	int ret;
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_READ_CNT)
+	}, frame_out;
+
+	ret = mmc_rpmb_op(dev, &frame_in, &frame_out, 1);
+	if (ret)
+		return ret;
+
+	/* Check RPMB response */
+	if (frame_out.result != 0) {
+		*cnt = 0;
+		return be16toh(frame_out.result);
+	}
+
+	*cnt = be32toh(frame_out.write_counter);
+
+	return 0;
+}
+
+static void set_ffu_download_cmd(struct mmc_ioc_multi_cmd *multi_cmd,
+				 __u8 *ext_csd, unsigned int bytes,
+				 const __u8 *buf, off_t offset,
+				 enum ffu_download_mode ffu_mode)
+{
+	__u32 arg = per_byte_htole32(&ext_csd[EXT_CSD_FFU_ARG_0]);
+
+	/* prepare multi_cmd for FFU based on cmd to be used */
+	if (ffu_mode == FFU_DEFAULT_MODE) {
+		/* put device into ffu mode */
+		mmc_fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG,
+				    EXT_CSD_FFU_MODE);
+		/* send block count */
+		set_single_cmd(&multi_cmd->cmds[1], MMC_SET_BLOCK_COUNT, 0, 0,
+			       bytes / 512);
+		multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+		/*
+		 * send image chunk: blksz and blocks essentially do not matter, as
+		 * long as the product is fw_size, but some hosts don't handle larger
+		 * blksz well.
+		 */
+		set_single_cmd(&multi_cmd->cmds[2], MMC_WRITE_MULTIPLE_BLOCK, 1,
+			       bytes / 512, arg);
+		mmc_ioc_cmd_set_data(multi_cmd->cmds[2], buf + offset);
+		/* return device into normal mode */
+		mmc_fill_switch_cmd(&multi_cmd->cmds[3], EXT_CSD_MODE_CONFIG,
+				    EXT_CSD_NORMAL_MODE);
+	} else if (ffu_mode == FFU_OPT_MODE1) {
+		/*
+		 * FFU mode 1 uses CMD23+CMD25 for repeated downloads and remains in FFU mode
+		 * during FW bundle downloading until completion. In this mode, multi_cmd only
+		 * has 2 sub-commands.
+		 */
+		set_single_cmd(&multi_cmd->cmds[0], MMC_SET_BLOCK_COUNT, 0, 0, bytes / 512);
+		multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+		set_single_cmd(&multi_cmd->cmds[1], MMC_WRITE_MULTIPLE_BLOCK, 1, bytes / 512, arg);
+		mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf + offset);
+	} else if (ffu_mode == FFU_OPT_MODE2) {
+		set_single_cmd(&multi_cmd->cmds[0], MMC_WRITE_MULTIPLE_BLOCK, 1, bytes / 512, arg);
+		multi_cmd->cmds[0].flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+		mmc_ioc_cmd_set_data(multi_cmd->cmds[0], buf + offset);
+		set_single_cmd(&multi_cmd->cmds[1], MMC_STOP_TRANSMISSION, 0, 0, 0);
+		multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	} else if (ffu_mode == FFU_OPT_MODE3) {
+		mmc_fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG,
+				    EXT_CSD_FFU_MODE);
+		set_single_cmd(&multi_cmd->cmds[1], MMC_WRITE_BLOCK, 1, 1, arg);
+		mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf + offset);
+		mmc_fill_switch_cmd(&multi_cmd->cmds[2], EXT_CSD_MODE_CONFIG,
+				    EXT_CSD_NORMAL_MODE);
+	} else if (ffu_mode == FFU_OPT_MODE4) {
+		set_single_cmd(&multi_cmd->cmds[0], MMC_WRITE_BLOCK, 1, 1, arg);
+		mmc_ioc_cmd_set_data(multi_cmd->cmds[0], buf + offset);
+	}
+}
+
+/* Number of sectors programmed during FFU download, or a negative errno */
+static int get_ffu_sectors_programmed(struct mmc_dev *dev, __u8 *ext_csd)
+{
+	int ret;
+
+	ret = mmc_read_extcsd(dev, ext_csd);
+	if (ret)
+		return ret;
+
+	return per_byte_htole32(&ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0]);
+}
+
+static int set_ffu_mode(struct mmc_dev *dev, bool on)
+{
+	struct mmc_ioc_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	mmc_fill_switch_cmd(&cmd, EXT_CSD_MODE_CONFIG,
+			    on ? EXT_CSD_FFU_MODE : EXT_CSD_NORMAL_MODE);
+
+	return mmc_cmd(dev, &cmd);
+}
+
+int mmc_ffu_download(struct mmc_dev *dev, __u8 *ext_csd, const __u8 *fw_buf,
+		     off_t fw_size, unsigned int chunk_size,
+		     enum ffu_download_mode ffu_mode,
+		     mmc_ffu_progress_t progress, void *priv)
+{
+	int ret;
+	__u8 num_of_cmds = 4;
+	off_t bytes_left, off;
+	unsigned int bytes_per_loop, retry = 3;
+	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+
+	if (!fw_buf || !ext_csd)
+		return -EINVAL;
+
+	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2) {
+		/* in FFU_OPT_MODE1 and FFU_OPT_MODE2, mmc_ioc_multi_cmd contains 2 commands */
+		num_of_cmds = 2;
+	} else if (ffu_mode == FFU_OPT_MODE3) {
+		num_of_cmds = 3; /* in FFU_OPT_MODE3, mmc_ioc_multi_cmd contains 3 commands */
+		chunk_size = 512; /* FFU_OPT_MODE3 uses CMD24 single-block write */
+	} else if (ffu_mode == FFU_OPT_MODE4) {
+		num_of_cmds = 1; /* in FFU_OPT_MODE4, it is single command mode  */
+		chunk_size = 512; /* FFU_OPT_MODE4 uses CMD24 single-block write */
+	}
+
+	/* allocate maximum required */
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+				num_of_cmds * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd)
+		return -ENOMEM;
+
+	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2 || ffu_mode == FFU_OPT_MODE4) {
+		/*
+		 * In FFU_OPT_MODE1, FFU_OPT_MODE2 and FFU_OPT_MODE4, the command to enter FFU
+		 * mode will be sent independently, separate from the firmware bundle download
+		 * command.
+		 */
+		ret = set_ffu_mode(dev, true);
+		if (ret)
+			goto out;
+	}
+
+do_retry:
+	bytes_left = fw_size;
+	off = 0;
+	multi_cmd->num_of_cmds = num_of_cmds;
+
+	while (bytes_left) {
+		bytes_per_loop = bytes_left < chunk_size ? bytes_left : chunk_size;
+
+		/* prepare multi_cmd for FFU based on cmd to be used */
+		set_ffu_download_cmd(multi_cmd, ext_csd, bytes_per_loop, fw_buf, off, ffu_mode);
+
+		if (num_of_cmds > 1)
+			/* send ioctl with multi-cmd, download firmware bundle */
+			ret = mmc_multi_cmd(dev, multi_cmd);
+		else
+			ret = mmc_cmd(dev, &multi_cmd->cmds[0]);
+
+		if (ret) {
+			/*
+			 * In case multi-cmd ioctl failed before exiting from
+			 * ffu mode
+			 */
+			set_ffu_mode(dev, false);
+			goto out;
+		}
+
+		ret = get_ffu_sectors_programmed(dev, ext_csd);
+		if (ret <= 0) {
+			set_ffu_mode(dev, false);
+			/*
+			 * By spec, host should re-start download from the first sector if
+			 * programmed count is 0
+			 */
+			if (ret == 0 && retry > 0) {
+				retry--;
+				if (progress)
+					progress(0, fw_size, priv);
+				goto do_retry;
+			}
+			if (ret == 0)
+				ret = -EIO;
+			goto out;
+		}
+
+		if (progress)
+			progress((off_t)ret * 512, fw_size, priv);
+
+		bytes_left -= bytes_per_loop;
+		off += bytes_per_loop;
+	}
+
+	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2 || ffu_mode == FFU_OPT_MODE4) {
+		/*
+		 * In FFU_OPT_MODE1, FFU_OPT_MODE2 and FFU_OPT_MODE4, the command to exit FFU mode
+		 * will be sent independently, separate from the firmware bundle download command.
+		 */
+		ret = set_ffu_mode(dev, false);
+		if (ret)
+			goto out;
+	}
+
+	ret = get_ffu_sectors_programmed(dev, ext_csd);
+out:
+	free(multi_cmd);
+	return ret;
+}
+
+int mmc_ffu_install(struct mmc_dev *dev)
+{
+	int ret;
+	__u8 ext_csd[512];
+	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) + 2 * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd)
+		return -ENOMEM;
+
+	/* Re-enter ffu mode and install the firmware */
+	multi_cmd->num_of_cmds = 2;
+	mmc_fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
+	mmc_fill_switch_cmd(&multi_cmd->cmds[1], EXT_CSD_MODE_OPERATION_CODES,
+			    EXT_CSD_FFU_INSTALL);
+
+	/* send ioctl with multi-cmd */
+	ret = mmc_multi_cmd(dev, multi_cmd);
+	if (ret) {
+		/* In case multi-cmd ioctl failed before exiting from ffu mode */
+		set_ffu_mode(dev, false);
+		goto out;
+	}
+
+	/* Check FFU install status */
+	ret = mmc_read_extcsd(dev, ext_csd);
+	if (ret)
+		goto out;
+
+	/* Return status */
+	ret = ext_csd[EXT_CSD_FFU_STATUS];
+out:
+	free(multi_cmd);
+	return ret;
+}
@@ -0,0 +1,170 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * libmmc - the card access core of mmc-utils.
+ *
+ * All functions operate on a device handle and return 0 (or a documented
+ * non-negative value) on success and a negative errno on failure. Nothing
+ * here prints or exits.
+ */
+
+#ifndef LIBMMC_H
+#define LIBMMC_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include <linux/mmc/ioctl.h>
+
+struct mmc_dev;
+
+/* Firmware Update (FFU) download modes */
+enum ffu_download_mode {
+	FFU_DEFAULT_MODE, /* Uses CMD23+CMD25; exits FFU mode after each loop */
+	FFU_OPT_MODE1,	/* Uses CMD23+CMD25; stays in FFU mode during download */
+	FFU_OPT_MODE2,	/* Uses CMD25+CMD12 open-ended multiple-block write */
+	FFU_OPT_MODE3,	/* Uses CMD24 single-block write */
+	FFU_OPT_MODE4	/* Uses CMD24 single-block write, stays in FFU mode */
+};
+
+enum rpmb_op_type {
+	MMC_RPMB_WRITE_KEY = 0x01,
+	MMC_RPMB_READ_CNT  = 0x02,
+	MMC_RPMB_WRITE     = 0x03,
+	MMC_RPMB_READ      = 0x04,
+
+	/* For internal usage only, do not use it directly */
+	MMC_RPMB_READ_RESP = 0x05
+};
+
+/* All multi-byte fields are big endian, as on the wire */
+struct rpmb_frame {
+	u_int8_t  stuff[196];
+	u_int8_t  key_mac[32];
+	u_int8_t  data[256];
+	u_int8_t  nonce[16];
+	u_int32_t write_counter;
+	u_int16_t addr;
+	u_int16_t block_count;
+	u_int16_t result;
+	u_int16_t req_resp;
+};
+
+/* Device handles */
+int mmc_dev_open(const char *path, int flags, struct mmc_dev **devp);
+void mmc_dev_close(struct mmc_dev *dev);
+int mmc_dev_fd(struct mmc_dev *dev);
+const char *mmc_dev_path(struct mmc_dev *dev);
+/*
+ * With @on, mmc_read_extcsd() returns a snapshot of EXT_CSD until a command
+ * that may change card state is sent through any handle.
+ */
+void mmc_dev_cache_extcsd(struct mmc_dev *dev, bool on);
+/*
+ * With @poll_ms, R1b commands sent by mmc_write_extcsd() and mmc_erase()
+ * don't wait for busy in the kernel; the card is polled with CMD13 every
+ * @poll_ms instead, which returns as soon as it is done, or -ETIMEDOUT.
+ * When no busy timeout can be derived, e.g. EXT_CSD can't be read on the
+ * RPMB device, the kernel waits for busy instead.
+ */
+void mmc_dev_poll_busy(struct mmc_dev *dev, unsigned int poll_ms);
+
+/* Raw command submission */
+int mmc_cmd(struct mmc_dev *dev, struct mmc_ioc_cmd *cmd);
+int mmc_multi_cmd(struct mmc_dev *dev, struct mmc_ioc_multi_cmd *multi_cmd);
+void mmc_fill_switch_cmd(struct mmc_ioc_cmd *cmd, __u8 index, __u8 value);
+
+/*
+ * Tracing. Once set, @fn is called after every MMC_IOC_CMD (@ncmds == 1) or
+ * MMC_IOC_MULTI_CMD ioctl on @dev, with the responses filled in, the ioctl
+ * result, and its CLOCK_MONOTONIC start time and duration in nanoseconds.
+ * NULL turns tracing off again.
+ */
+typedef void (*mmc_trace_t)(struct mmc_dev *dev,
+			    const struct mmc_ioc_cmd *cmds, unsigned int ncmds,
+			    int err, __u64 start_ns, __u64 duration_ns,
+			    void *priv);
+
+void mmc_dev_set_trace(struct mmc_dev *dev, mmc_trace_t fn, void *priv);
+
+/* EXT_CSD and card status */
+int mmc_read_extcsd(struct mmc_dev *dev, __u8 *ext_csd);
+/* A 0 @timeout_ms is derived from EXT_CSD with mmc_switch_timeout() */
+int mmc_write_extcsd(struct mmc_dev *dev, __u8 index, __u8 value,
+		     unsigned int timeout_ms);
+int mmc_send_status(struct mmc_dev *dev, __u32 *response);
+/*
+ * Polls CMD13 every @poll_ms until the card is out of the programming state.
+ * A 0 @poll_ms sends CMD13 back to back, which keeps the bus busy but sees
+ * the end of programming as soon as possible.
+ */
+int mmc_wait_busy(struct mmc_dev *dev, unsigned int timeout_ms,
+		  unsigned int poll_ms, __u32 *response);
+int mmc_send_hpi(struct mmc_dev *dev, const __u8 *ext_csd, __u32 *response);
+
+/* Write protection */
+int mmc_set_write_protect(struct mmc_dev *dev, __u32 blk_addr, bool on);
+int mmc_get_write_protect_type(struct mmc_dev *dev, __u32 blk_addr,
+			       __u64 *group_bits);
+
+/*
+ * Busy timeouts in ms, the way the kernel derives them from EXT_CSD:
+ * GENERIC_CMD6_TIME, PARTITION_SWITCH_TIME and POWER_OFF_LONG_TIME for
+ * switches, ERASE_TIMEOUT_MULT, TRIM_MULT and the SEC_ERASE/SEC_TRIM
+ * multipliers per erase group for erases. @start and @end are the CMD35 and
+ * CMD36 arguments: byte addresses on cards up to 2 GiB, sectors above.
+ */
+unsigned int mmc_switch_timeout(const __u8 *ext_csd, __u8 index, __u8 value);
+unsigned int mmc_erase_timeout(const __u8 *ext_csd, __u32 arg, __u32 start,
+			       __u32 end);
+
+/*
+ * Erases from @start to @end with CMD38 argument @arg, with the timeout from
+ * mmc_erase_timeout(). Returns -EIO if the card flagged an erase parameter or
+ * sequence error.
+ */
+int mmc_erase(struct mmc_dev *dev, __u32 arg, __u32 start, __u32 end);
+/*
+ * Like mmc_erase(), but returns as soon as the card accepted CMD38. The
+ * caller waits with mmc_wait_busy() or interrupts the erase with HPI.
+ */
+int mmc_erase_start(struct mmc_dev *dev, __u32 arg, __u32 start, __u32 end);
+
+/*
+ * RPMB, on the rpmb character device. The caller checks result and
+ * req_resp of @frame_out; @out_cnt is only > 1 for multiple block reads.
+ */
+int mmc_rpmb_op(struct mmc_dev *dev, const struct rpmb_frame *frame_in,
+		struct rpmb_frame *frame_out, unsigned int out_cnt);
+/* Returns the RPMB result code (> 0) if the card rejected the request */
+int mmc_rpmb_read_counter(struct mmc_dev *dev, __u32 *cnt);
+
+/*
+ * Field firmware update. mmc_ffu_download() returns the number of sectors
+ * the card reports as programmed, @progress (optional) is called after each
+ * chunk, and with @done == 0 when the download restarts from the first
+ * sector. mmc_ffu_install() returns the card's FFU_STATUS.
+ */
+typedef void (*mmc_ffu_progress_t)(off_t done, off_t total, void *priv);
+
+int mmc_ffu_download(struct mmc_dev *dev, __u8 *ext_csd, const __u8 *fw_buf,
+		     off_t fw_size, unsigned int chunk_size,
+		     enum ffu_download_mode ffu_mode,
+		     mmc_ffu_progress_t progress, void *priv);
+int mmc_ffu_install(struct mmc_dev *dev);
+
+#endif /* LIBMMC_H */
@@ -37,13 +37,16 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mmc.h"
@@ -319,12 +322,169 @@ static int parse_opts(int argc, char **argv, struct config *config)
 	return 0;
 }
 
+/*
+ * External manufacturer ID database. The file named by $MMC_IDS, or
+ * MMC_IDS_FILE, holds one "<mmc|sd> <id> <manufacturer>" entry per line,
+ * '#' starts a comment. It is read once and indexed by bus and id, so the
+ * IDs can be refreshed without rebuilding. Its entries take precedence
+ * over the built-in tables; of duplicate entries, the first one is used.
+ */
+#define MMC_IDS_FILE	"/usr/share/misc/mmc.ids"
+
+struct ids_entry {
+	unsigned int key;	/* bus << 16 | id */
+	char *manufacturer;
+};
+
+static struct ids_entry *ext_ids;
+static size_t ext_ids_cnt;
+static pthread_once_t ext_ids_once = PTHREAD_ONCE_INIT;
+
+static int cmp_ids_entry(const void *a, const void *b)
+{
+	const struct ids_entry *x = a, *y = b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* Same order, with duplicates in file order: names are stored in order */
+static int cmp_ids_entry_pos(const void *a, const void *b)
+{
+	const struct ids_entry *x = a, *y = b;
+	int ret = cmp_ids_entry(a, b);
+
+	if (ret)
+		return ret;
+	return x->manufacturer < y->manufacturer ? -1 :
+	       x->manufacturer > y->manufacturer;
+}
+
+static void load_ext_ids(void)
+{
+	const char *path = getenv("MMC_IDS");
+	char *buf, *p, *end, *eol, *name;
+	struct ids_entry *ids = NULL;
+	unsigned int bus, id;
+	size_t cnt = 0, max = 0, i, n;
+	struct stat st;
+	ssize_t len = 0, r;
+	int fd;
+
+	if (!path)
+		path = MMC_IDS_FILE;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return;
+	}
+
+	/* Names are NUL terminated in place, so they point into @buf */
+	buf = malloc(st.st_size + 1);
+	if (!buf) {
+		close(fd);
+		return;
+	}
+	while (len < st.st_size) {
+		r = read(fd, buf + len, st.st_size - len);
+		if (r <= 0)
+			break;
+		len += r;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	end = buf + len;
+	for (p = buf; p < end; p++)
+		if (*p == '\n')
+			max++;
+	max++;
+
+	ids = malloc(max * sizeof(*ids));
+	if (!ids)
+		goto out;
+
+	for (p = buf; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		while (p < eol && isspace(*p))
+			p++;
+		if (p == eol || *p == '#')
+			continue;
+
+		if (eol - p > 3 && !strncasecmp(p, "mmc", 3) && isspace(p[3])) {
+			bus = MMC;
+			p += 3;
+		} else if (eol - p > 2 && !strncasecmp(p, "sd", 2) &&
+			   isspace(p[2])) {
+			bus = SD;
+			p += 2;
+		} else {
+			continue;
+		}
+
+		while (p < eol && isspace(*p))
+			p++;
+		id = 0;
+		if (eol - p > 2 && p[0] == '0' && tolower(p[1]) == 'x')
+			p += 2;
+		if (p == eol || !isxdigit(*p))
+			continue;
+		for (; p < eol && isxdigit(*p); p++)
+			id = id * 16 + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+		if (id >= IDS_MAX)
+			continue;
+
+		while (p < eol && isspace(*p))
+			p++;
+		name = p;
+		p = eol;
+		while (p > name && isspace(p[-1]))
+			p--;
+		if (p == name)
+			continue;
+
+		*p = '\0';
+		ids[cnt].key = bus << 16 | id;
+		ids[cnt].manufacturer = name;
+		cnt++;
+	}
+	if (!cnt)
+		goto out;
+
+	qsort(ids, cnt, sizeof(*ids), cmp_ids_entry_pos);
+	for (i = 1, n = 1; i < cnt; i++)
+		if (ids[i].key != ids[n - 1].key)
+			ids[n++] = ids[i];
+
+	ext_ids = ids;
+	ext_ids_cnt = n;
+	return;
+out:
+	free(ids);
+	free(buf);
+}
+
 static char *get_manufacturer(struct config *config, unsigned int manid)
 {
 	struct ids_database *db;
+	struct ids_entry key, *found;
 	unsigned int ids_cnt;
 	int i;
 
+	pthread_once(&ext_ids_once, load_ext_ids);
+	if (ext_ids_cnt) {
+		key.key = config->bus << 16 | manid;
+		found = bsearch(&key, ext_ids, ext_ids_cnt, sizeof(*ext_ids),
+				cmp_ids_entry);
+		if (found)
+			return found->manufacturer;
+	}
+
 	if (config->bus == MMC) {
 		db = mmc_database;
 		ids_cnt = ARRAY_SIZE(mmc_database);
@@ -392,86 +552,112 @@ static char *read_file(char *name)
 }
 
 /* Hexadecimal string parsing functions */
-static char *to_binstr(char *hexstr)
-{
-	char *bindigits[] = {
-		"0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
-		"1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111",
-	};
-	char *binstr, *tail;
+/*
+ * Registers are unpacked from their hex dump into 32-bit words, most
+ * significant bit first, so fields can be extracted by bit position. The
+ * largest register decoded here is 128 bits; one spare word lets a field
+ * straddle the last word boundary without a check.
+ */
+#define REG_MAX_BITS	128
 
-	binstr = calloc(strlen(hexstr) * 4 + 1, sizeof(char));
-	if (!binstr)
-		return NULL;
+struct reg_bits {
+	uint32_t w[REG_MAX_BITS / 32 + 1];
+	unsigned int nbits;
+};
 
-	tail = binstr;
+static int hex_to_reg(struct reg_bits *reg, const char *hexstr)
+{
+	unsigned int nibble, i;
+	int c;
 
-	while (hexstr && *hexstr != '\0') {
-		if (!isxdigit(*hexstr)) {
-			free(binstr);
-			return NULL;
-		}
+	memset(reg, 0, sizeof(*reg));
 
-		if (isdigit(*hexstr))
-			strcat(tail, bindigits[*hexstr - '0']);
-		else if (islower(*hexstr))
-			strcat(tail, bindigits[*hexstr - 'a' + 10]);
+	for (i = 0; hexstr[i] != '\0'; i++) {
+		c = hexstr[i];
+		if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			nibble = c - 'A' + 10;
 		else
-			strcat(tail, bindigits[*hexstr - 'A' + 10]);
+			return -EINVAL;
+
+		if (i * 4 >= REG_MAX_BITS)
+			return -E2BIG;
 
-		hexstr++;
-		tail += 4;
+		reg->w[i / 8] |= nibble << (28 - (i % 8) * 4);
 	}
+	reg->nbits = i * 4;
 
-	return binstr;
+	return 0;
 }
 
-static void bin_to_unsigned(unsigned int *u, char *binstr, int width)
+/* Clamps @width so that the field does not run past the register end */
+static unsigned int reg_width(const struct reg_bits *reg, unsigned int pos,
+			      unsigned int width)
 {
-	*u = 0;
+	if (pos >= reg->nbits)
+		return 0;
+	if (width > reg->nbits - pos)
+		return reg->nbits - pos;
+	return width;
+}
+
+static unsigned int reg_get(const struct reg_bits *reg, unsigned int pos,
+			    unsigned int width)
+{
+	uint64_t v;
+
 	assert(width <= 32);
+	width = reg_width(reg, pos, width);
+	if (!width)
+		return 0;
 
-	while (binstr && *binstr != '\0' && width > 0) {
-		*u <<= 1;
-		*u |= *binstr == '0' ? 0 : 1;
+	v = (uint64_t)reg->w[pos / 32] << 32 | reg->w[pos / 32 + 1];
+	v >>= 64 - pos % 32 - width;
 
-		binstr++;
-		width--;
-	}
+	return v & (0xffffffffULL >> (32 - width));
 }
 
-static void bin_to_ascii(char *a, char *binstr, int width)
+static void reg_get_ascii(const struct reg_bits *reg, char *a,
+			  unsigned int pos, unsigned int width)
 {
-	assert(width % 8 == 0);
-	*a = '\0';
-
-	while (binstr && *binstr != '\0' && width > 0) {
-		unsigned int u;
-		char c[2] = { '\0', '\0' };
-		char *s = &c[0];
-
-		bin_to_unsigned(&u, binstr, 8);
-		c[0] = u;
+	unsigned int c;
 
-		strcat(a, s);
-		binstr += 8;
-		width -= 8;
+	assert(width % 8 == 0);
+	width = reg_width(reg, pos, width);
+
+	while (width > 0) {
+		c = reg_get(reg, pos, width < 8 ? width : 8);
+		/* NUL characters are dropped, as padding in product names */
+		if (c)
+			*a++ = c;
+		pos += 8;
+		width = width < 8 ? 0 : width - 8;
 	}
+	*a = '\0';
 }
 
+/*
+ * Decodes @hexstr according to @fmt, a list of <width><type> descriptors
+ * from the most significant bit down: 'u' stores an unsigned int, 'a' a NUL
+ * terminated string and 'r' skips reserved bits. Nothing is stored if
+ * @hexstr is not a valid hex string.
+ */
 static void parse_bin(char *hexstr, char *fmt, ...)
 {
+	struct reg_bits reg;
 	va_list args;
-	char *origstr;
-	char *binstr;
 	unsigned long width = 0;
+	unsigned int pos = 0;
 
-	binstr = to_binstr(hexstr);
-	origstr = binstr;
+	if (!hexstr || hex_to_reg(&reg, hexstr))
+		return;
 
 	va_start(args, fmt);
 
-	while (binstr && fmt && *fmt != '\0') {
+	while (fmt && *fmt != '\0') {
 		if (isdigit(*fmt)) {
 			char *rest;
 
@@ -484,20 +670,20 @@ static void parse_bin(char *hexstr, char *fmt, ...)
 			unsigned int *u = va_arg(args, unsigned int *);
 
 			if (u)
-				bin_to_unsigned(u, binstr, width);
-			binstr += width;
+				*u = reg_get(&reg, pos, width);
+			pos += width;
 			width = 0;
 			fmt++;
 		} else if (*fmt == 'r') {
-			binstr += width;
+			pos += width;
 			width = 0;
 			fmt++;
 		} else if (*fmt == 'a') {
 			char *c = va_arg(args, char *);
 
 			if (c)
-				bin_to_ascii(c, binstr, width);
-			binstr += width;
+				reg_get_ascii(&reg, c, pos, width);
+			pos += width;
 			width = 0;
 			fmt++;
 		} else {
@@ -506,10 +692,13 @@ static void parse_bin(char *hexstr, char *fmt, ...)
 	}
 
 	va_end(args);
-	free(origstr);
 }
 
 /* MMC/SD information parsing functions */
+#define SD_CID_FMT	"8u16a40a4u4u32u4r8u4u7u1r"
+#define MMC_CID_FMT	"8u6r2u8u48a4u4u32u4u4u7u1r"
+#define SD_SCR_FMT	"4u4u1u3u4u1u4u9r2u32r"
+
 static void print_sd_cid(struct config *config, char *cid)
 {
 	static const char *months[] = {
@@ -528,7 +717,7 @@ static void print_sd_cid(struct config *config, char *cid)
 	unsigned int crc;
 	char *manufacturer = NULL;
 
-	parse_bin(cid, "8u16a40a4u4u32u4r8u4u7u1r",
+	parse_bin(cid, SD_CID_FMT,
 		&mid, &oid[0], &pnm[0], &prv_major, &prv_minor, &psn,
 		&mdt_year, &mdt_month, &crc);
 
@@ -587,7 +776,7 @@ static void print_mmc_cid(struct config *config, char *cid)
 	unsigned int crc;
 	char *manufacturer = NULL;
 
-	parse_bin(cid, "8u6r2u8u48a4u4u32u4u4u7u1r",
+	parse_bin(cid, MMC_CID_FMT,
 		&mid, &cbx, &oid, &pnm[0], &prv_major, &prv_minor, &psn,
 		&mdt_year, &mdt_month, &crc);
 
@@ -1992,7 +2181,7 @@ static void print_sd_scr(struct config *config, char *scr)
 	unsigned int ex_security;
 	unsigned int cmd_support;
 
-	parse_bin(scr, "4u4u1u3u4u1u4u9r2u32r",
+	parse_bin(scr, SD_SCR_FMT,
 		&scr_structure, &sd_spec, &data_stat_after_erase,
 		&sd_security, &sd_bus_widths, &sd_spec3,
 		&ex_security, &cmd_support);
@@ -2284,3 +2473,662 @@ int do_read_scr(int argc, char **argv)
 {
 	return do_read_reg(argc, argv, SCR);
 }
+
+/* Batch decoding, one output line per card */
+#define DECODE_BATCH_LINES	4096
+#define DECODE_LINE_MAX		512
+
+struct card_info {
+	enum bus_type bus;
+	unsigned int mid;
+	char *manufacturer;
+	char oid[8];
+	char pnm[7];
+	unsigned int prv_major;
+	unsigned int prv_minor;
+	unsigned int psn;
+	unsigned int year;
+	unsigned int month;
+	unsigned long long capacity;	/* 0 if not given by the CSD */
+	const char *spec;		/* SD spec version from the SCR */
+};
+
+struct field {
+	const char *key;
+	const char *val;
+	bool str;
+};
+
+struct out_buf {
+	char *buf;
+	size_t len;
+	size_t pos;
+};
+
+static void out_printf(struct out_buf *o, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(o->buf + o->pos, o->len - o->pos, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		o->pos += n;
+	if (o->pos >= o->len)
+		o->pos = o->len - 1;
+}
+
+static void out_putc(struct out_buf *o, char c)
+{
+	if (o->pos + 1 < o->len) {
+		o->buf[o->pos++] = c;
+		o->buf[o->pos] = '\0';
+	}
+}
+
+static void out_str(struct out_buf *o, const char *s, bool json)
+{
+	if (!json && !strpbrk(s, ",\"\n")) {
+		out_printf(o, "%s", s);
+		return;
+	}
+
+	out_putc(o, '"');
+	for (; *s; s++) {
+		if (*s == '"')
+			out_printf(o, json ? "\\\"" : "\"\"");
+		else if (json && *s == '\\')
+			out_printf(o, "\\\\");
+		else if (json && (unsigned char)*s < 0x20)
+			out_printf(o, "\\u%04x", *s);
+		else
+			out_putc(o, *s);
+	}
+	out_putc(o, '"');
+}
+
+static void out_record(struct out_buf *o, const struct field *f, int n,
+		       bool json)
+{
+	int i;
+
+	if (json)
+		out_printf(o, "{");
+	for (i = 0; i < n; i++) {
+		if (i)
+			out_putc(o, ',');
+		if (json)
+			out_printf(o, "\"%s\":", f[i].key);
+		if (!f[i].val)
+			out_printf(o, json ? "null" : "");
+		else if (f[i].str)
+			out_str(o, f[i].val, json);
+		else
+			out_printf(o, "%s", f[i].val);
+	}
+	if (json)
+		out_printf(o, "}");
+}
+
+static void out_header(const struct field *f, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		printf("%s%s", i ? "," : "", f[i].key);
+	printf("\n");
+}
+
+static bool reg_valid(char *hexstr, unsigned int nbits)
+{
+	struct reg_bits reg;
+
+	return hexstr && !hex_to_reg(&reg, hexstr) && reg.nbits == nbits;
+}
+
+static void decode_cid(struct config *config, char *cid, struct card_info *info)
+{
+	unsigned int oid;
+
+	if (config->bus == SD) {
+		parse_bin(cid, SD_CID_FMT, &info->mid, &info->oid[0],
+			  &info->pnm[0], &info->prv_major, &info->prv_minor,
+			  &info->psn, &info->year, &info->month, NULL);
+		info->oid[2] = '\0';
+		info->pnm[5] = '\0';
+		info->year += 2000;
+	} else {
+		parse_bin(cid, MMC_CID_FMT, &info->mid, NULL, &oid,
+			  &info->pnm[0], &info->prv_major, &info->prv_minor,
+			  &info->psn, &info->year, &info->month, NULL);
+		snprintf(info->oid, sizeof(info->oid), "0x%02x", oid);
+		info->pnm[6] = '\0';
+		info->year += 1997;
+	}
+
+	info->manufacturer = get_manufacturer(config, info->mid);
+}
+
+/*
+ * Capacity as described by the CSD alone; MMC cards above 2GB report it in
+ * EXT_CSD SEC_COUNT instead.
+ */
+static unsigned long long decode_csd_capacity(struct config *config, char *csd)
+{
+	unsigned int csd_structure, read_bl_len, c_size, c_size_mult;
+
+	parse_bin(csd, "2u", &csd_structure);
+
+	if (config->bus == SD && csd_structure == 1) {
+		parse_bin(csd, "58r22u", &c_size);
+		return (c_size + 1ULL) * 512 * 1024;
+	}
+	if (config->bus == SD && csd_structure != 0)
+		return 0;
+
+	/* SD CSD 1.0 and MMC share the layout of these fields */
+	parse_bin(csd, "44r4u6r12u12r3u", &read_bl_len, &c_size, &c_size_mult);
+	if (config->bus == MMC && c_size == 0xfff)
+		return 0;
+
+	return (c_size + 1ULL) << (c_size_mult + 2 + read_bl_len);
+}
+
+static const char *decode_scr_spec(char *scr)
+{
+	unsigned int sd_spec, sd_spec3;
+
+	parse_bin(scr, SD_SCR_FMT, NULL, &sd_spec, NULL, NULL, NULL,
+		  &sd_spec3, NULL, NULL);
+
+	switch (sd_spec) {
+	case 0:
+		return "1.0/1.01";
+	case 1:
+		return "1.10";
+	case 2:
+		return sd_spec3 ? "3.0x" : "2.00";
+	case 3:
+		return "4.00";
+	default:
+		return "unknown";
+	}
+}
+
+/* Fills @f with the fields of @info, using @vals as the storage */
+static int card_fields(const struct card_info *info, struct field *f,
+		       char vals[][24])
+{
+	static const char *months[] = {
+		"jan", "feb", "mar", "apr", "may", "jun",
+		"jul", "aug", "sep", "oct", "nov", "dec",
+		"invalid0", "invalid1", "invalid2", "invalid3",
+	};
+	int n = 0;
+
+	f[n++] = (struct field){ "type", info->bus == SD ? "SD" : "MMC", true };
+
+	snprintf(vals[0], 24, "0x%02x", info->mid);
+	f[n++] = (struct field){ "mid", vals[0], true };
+	f[n++] = (struct field){ "manufacturer", info->manufacturer, true };
+	f[n++] = (struct field){ "oid", info->oid, true };
+	f[n++] = (struct field){ "name", info->pnm, true };
+
+	snprintf(vals[1], 24, "%u.%u", info->prv_major, info->prv_minor);
+	f[n++] = (struct field){ "rev", vals[1], true };
+
+	snprintf(vals[2], 24, "0x%08x", info->psn);
+	f[n++] = (struct field){ "serial", vals[2], true };
+
+	snprintf(vals[3], 24, "%u %s", info->year, months[info->month & 0xf]);
+	f[n++] = (struct field){ "date", vals[3], true };
+
+	snprintf(vals[4], 24, "%llu", info->capacity);
+	f[n++] = (struct field){ "capacity", info->capacity ? vals[4] : NULL,
+				 false };
+	f[n++] = (struct field){ "spec", info->spec, true };
+
+	return n;
+}
+
+struct decode_batch {
+	char **lines;
+	char *out;		/* DECODE_LINE_MAX bytes per line */
+	bool *failed;
+	unsigned long *linenos;
+	unsigned int nr_lines;
+	unsigned int nr_threads;
+	bool json;
+};
+
+struct decode_worker {
+	struct decode_batch *batch;
+	unsigned int id;
+};
+
+static int decode_record(char *line, bool json, struct out_buf *o)
+{
+	struct config cfg = {};
+	struct card_info info = {};
+	struct field f[16];
+	char vals[8][24];
+	char *type, *cid, *csd, *scr, *save;
+
+	type = strtok_r(line, ",", &save);
+	cid = strtok_r(NULL, ",", &save);
+	csd = strtok_r(NULL, ",", &save);
+	scr = strtok_r(NULL, ",", &save);
+
+	if (!csd || strtok_r(NULL, ",", &save)) {
+		out_printf(o, "expected type,cid,csd[,scr]");
+		return -1;
+	}
+
+	if (!strcasecmp(type, "MMC")) {
+		cfg.bus = MMC;
+	} else if (!strcasecmp(type, "SD")) {
+		cfg.bus = SD;
+	} else {
+		out_printf(o, "unknown type '%s'", type);
+		return -1;
+	}
+
+	if (!reg_valid(cid, 128) || !reg_valid(csd, 128) ||
+	    (scr && !reg_valid(scr, 64))) {
+		out_printf(o, "invalid register content");
+		return -1;
+	}
+
+	info.bus = cfg.bus;
+	decode_cid(&cfg, cid, &info);
+	info.capacity = decode_csd_capacity(&cfg, csd);
+	if (scr && cfg.bus == SD)
+		info.spec = decode_scr_spec(scr);
+
+	out_record(o, f, card_fields(&info, f, vals), json);
+
+	return 0;
+}
+
+static void *decode_thread(void *arg)
+{
+	struct decode_worker *w = arg;
+	struct decode_batch *b = w->batch;
+	struct out_buf o;
+	unsigned int i;
+
+	for (i = w->id; i < b->nr_lines; i += b->nr_threads) {
+		o = (struct out_buf){ b->out + i * DECODE_LINE_MAX,
+				      DECODE_LINE_MAX, 0 };
+		o.buf[0] = '\0';
+		b->failed[i] = decode_record(b->lines[i], b->json, &o) != 0;
+	}
+
+	return NULL;
+}
+
+static int decode_run_batch(struct decode_batch *b)
+{
+	pthread_t threads[b->nr_threads];
+	struct decode_worker workers[b->nr_threads];
+	unsigned int i, started = 0;
+	int ret = 0;
+
+	for (i = 1; i < b->nr_threads; i++) {
+		workers[i] = (struct decode_worker){ b, i };
+		if (pthread_create(&threads[i], NULL, decode_thread,
+				   &workers[i]))
+			break;
+		started++;
+	}
+	/* Whatever could not be handed to a thread is decoded here */
+	for (; i < b->nr_threads; i++) {
+		workers[i] = (struct decode_worker){ b, i };
+		decode_thread(&workers[i]);
+	}
+	workers[0] = (struct decode_worker){ b, 0 };
+	decode_thread(&workers[0]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < b->nr_lines; i++) {
+		if (b->failed[i]) {
+			fprintf(stderr, "line %lu: %s\n", b->linenos[i],
+				b->out + i * DECODE_LINE_MAX);
+			ret = -1;
+		} else {
+			printf("%s\n", b->out + i * DECODE_LINE_MAX);
+		}
+	}
+
+	return ret;
+}
+
+int do_decode_regs(int argc, char **argv)
+{
+	struct decode_batch b = { .nr_threads = 1 };
+	struct card_info dummy = {};
+	struct field f[16];
+	char vals[8][24];
+	unsigned long lineno = 0, linenos[DECODE_BATCH_LINES];
+	size_t sizes[DECODE_BATCH_LINES] = { 0 };
+	char *lines[DECODE_BATCH_LINES] = { NULL };
+	FILE *in = stdin;
+	ssize_t len;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "jt:")) != -1) {
+		switch (c) {
+		case 'j':
+			b.json = true;
+			break;
+		case 't':
+			b.nr_threads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind > 1 || !b.nr_threads || b.nr_threads > 256)
+		goto usage;
+
+	if (optind < argc && strcmp(argv[optind], "-")) {
+		in = fopen(argv[optind], "r");
+		if (!in) {
+			perror(argv[optind]);
+			exit(1);
+		}
+	}
+
+	b.lines = lines;
+	b.linenos = linenos;
+	b.out = malloc(DECODE_BATCH_LINES * DECODE_LINE_MAX);
+	b.failed = calloc(DECODE_BATCH_LINES, sizeof(*b.failed));
+	if (!b.out || !b.failed) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+
+	if (!b.json)
+		out_header(f, card_fields(&dummy, f, vals));
+
+	for (;;) {
+		b.nr_lines = 0;
+		while (b.nr_lines < DECODE_BATCH_LINES) {
+			char *line;
+
+			len = getline(&lines[b.nr_lines], &sizes[b.nr_lines], in);
+			if (len < 0)
+				break;
+			lineno++;
+
+			line = lines[b.nr_lines];
+			while (len > 0 && isspace(line[len - 1]))
+				line[--len] = '\0';
+			if (!len || line[0] == '#')
+				continue;
+
+			linenos[b.nr_lines++] = lineno;
+		}
+		if (!b.nr_lines)
+			break;
+		if (decode_run_batch(&b))
+			ret = -1;
+	}
+
+	for (c = 0; c < DECODE_BATCH_LINES; c++)
+		free(lines[c]);
+	free(b.out);
+	free(b.failed);
+	if (in != stdin)
+		fclose(in);
+
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: mmc decode [-j] [-t <threads>] [<file>|-]\n");
+	exit(1);
+}
+
+/* Card enumeration through sysfs */
+#define MMC_BUS_DIR	"/sys/bus/mmc/devices"
+
+struct list_entry {
+	char dev[NAME_MAX + 1];
+	char block[NAME_MAX + 1];
+	char fwrev[24];
+	struct card_info info;
+	struct field f[16];
+	char vals[8][24];
+	int nr_fields;
+};
+
+/* Reads a single line sysfs attribute relative to @dirfd */
+static char *read_attr(int dirfd, const char *name, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return NULL;
+
+	while (n > 0 && isspace(buf[n - 1]))
+		n--;
+	buf[n] = '\0';
+
+	return buf;
+}
+
+static void list_block_dev(int dirfd, struct list_entry *e)
+{
+	struct dirent *de;
+	char size[32];
+	int blkfd, fd;
+	DIR *dir;
+
+	blkfd = openat(dirfd, "block", O_RDONLY | O_DIRECTORY);
+	if (blkfd < 0)
+		return;
+	dir = fdopendir(blkfd);
+	if (!dir) {
+		close(blkfd);
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(e->block, sizeof(e->block), "%s", de->d_name);
+
+		fd = openat(blkfd, de->d_name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			break;
+		if (read_attr(fd, "size", size, sizeof(size)))
+			e->info.capacity = strtoull(size, NULL, 10) * 512;
+		close(fd);
+		break;
+	}
+
+	closedir(dir);
+}
+
+static int list_card(int dirfd, struct list_entry *e)
+{
+	struct config cfg = {};
+	char type[8], cid[64], csd[64], scr[32], buf[32];
+	unsigned int month, year;
+
+	if (!read_attr(dirfd, "type", type, sizeof(type)) ||
+	    !read_attr(dirfd, "cid", cid, sizeof(cid)) ||
+	    !read_attr(dirfd, "csd", csd, sizeof(csd)))
+		return -1;
+
+	if (!strcmp(type, "MMC"))
+		cfg.bus = MMC;
+	else if (!strcmp(type, "SD"))
+		cfg.bus = SD;
+	else
+		return -1;
+	if (!reg_valid(cid, 128) || !reg_valid(csd, 128))
+		return -1;
+
+	e->info.bus = cfg.bus;
+	decode_cid(&cfg, cid, &e->info);
+	e->info.capacity = decode_csd_capacity(&cfg, csd);
+	if (cfg.bus == SD && read_attr(dirfd, "scr", scr, sizeof(scr)) &&
+	    reg_valid(scr, 64))
+		e->info.spec = decode_scr_spec(scr);
+
+	/* The kernel knows the right name length and date offset */
+	if (read_attr(dirfd, "name", buf, sizeof(buf)))
+		snprintf(e->info.pnm, sizeof(e->info.pnm), "%.6s", buf);
+	if (read_attr(dirfd, "date", buf, sizeof(buf)) &&
+	    sscanf(buf, "%u/%u", &month, &year) == 2 && month) {
+		e->info.month = month - 1;
+		e->info.year = year;
+	}
+	read_attr(dirfd, "fwrev", e->fwrev, sizeof(e->fwrev));
+
+	list_block_dev(dirfd, e);
+
+	return 0;
+}
+
+static int list_fields(struct list_entry *e)
+{
+	struct field *f = e->f;
+	int n = 0;
+
+	f[n++] = (struct field){ "dev", e->dev, true };
+	f[n++] = (struct field){ "block", e->block[0] ? e->block : NULL, true };
+	n += card_fields(&e->info, f + n, e->vals);
+	f[n++] = (struct field){ "fwrev", e->fwrev[0] ? e->fwrev : NULL, true };
+
+	return n;
+}
+
+static int cmp_list_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct list_entry *)a)->dev,
+		      ((const struct list_entry *)b)->dev);
+}
+
+static void list_print_table(struct list_entry *e, int nr)
+{
+	int width[16] = { 0 };
+	int i, j, n, ncols;
+
+	ncols = e[0].nr_fields;
+	for (i = -1; i < nr; i++) {
+		for (j = 0; j < ncols; j++) {
+			const char *v = i < 0 ? e[0].f[j].key : e[i].f[j].val;
+
+			n = v ? strlen(v) : 1;
+			if (n > width[j])
+				width[j] = n;
+		}
+	}
+
+	for (i = -1; i < nr; i++) {
+		for (j = 0; j < ncols; j++) {
+			const char *v = i < 0 ? e[0].f[j].key : e[i].f[j].val;
+
+			printf("%-*s%s", j == ncols - 1 ? 0 : width[j],
+			       v ? v : "-", j == ncols - 1 ? "\n" : "  ");
+		}
+	}
+}
+
+int do_list_cards(int argc, char **argv)
+{
+	struct list_entry *entries = NULL, *tmp;
+	struct dirent *de;
+	bool json = false;
+	int busfd, fd, nr = 0, i, c;
+	DIR *dir;
+
+	while ((c = getopt(argc, argv, "j")) != -1) {
+		switch (c) {
+		case 'j':
+			json = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc)
+		goto usage;
+
+	busfd = open(MMC_BUS_DIR, O_RDONLY | O_DIRECTORY);
+	if (busfd < 0) {
+		perror(MMC_BUS_DIR);
+		return -1;
+	}
+	dir = fdopendir(busfd);
+	if (!dir) {
+		perror(MMC_BUS_DIR);
+		close(busfd);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		fd = openat(busfd, de->d_name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+
+		tmp = realloc(entries, (nr + 1) * sizeof(*entries));
+		if (!tmp) {
+			perror("Failed to allocate memory");
+			close(fd);
+			break;
+		}
+		entries = tmp;
+		memset(&entries[nr], 0, sizeof(*entries));
+		snprintf(entries[nr].dev, sizeof(entries[nr].dev), "%s",
+			 de->d_name);
+
+		/* SDIO functions and the like have no CID/CSD */
+		if (!list_card(fd, &entries[nr]))
+			nr++;
+		close(fd);
+	}
+	closedir(dir);
+
+	qsort(entries, nr, sizeof(*entries), cmp_list_entry);
+	for (i = 0; i < nr; i++)
+		entries[i].nr_fields = list_fields(&entries[i]);
+
+	if (json) {
+		printf("[");
+		for (i = 0; i < nr; i++) {
+			char line[DECODE_LINE_MAX];
+			struct out_buf o = { line, sizeof(line), 0 };
+
+			line[0] = '\0';
+			out_record(&o, entries[i].f, entries[i].nr_fields, true);
+			printf("%s%s", i ? ",\n " : "", line);
+		}
+		printf("]\n");
+	} else if (nr) {
+		list_print_table(entries, nr);
+	}
+
+	free(entries);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc list [-j]\n");
+	exit(1);
+}
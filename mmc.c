@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "mmc_cmds.h"
 
@@ -47,13 +49,17 @@ struct Command {
 	int	ncmds;		/* number of subcommand */
 };
 
+static int do_batch(int nargs, char **argv);
+
 static struct Command commands[] = {
 	/*
 	 *	avoid short commands different for the case only
 	 */
 	{ do_read_extcsd, -1,
-	  "extcsd read", "<device>\n"
-		"Print extcsd data from <device>.",
+	  "extcsd read", "[-c] <device>\n"
+		"Print extcsd data from <device>.\n"
+		"With -c the copy kept by the kernel in debugfs is used when\n"
+		"available, which does not need the block device to be opened.",
 	  NULL
 	},
 	{ do_write_extcsd, 3,
@@ -116,6 +122,38 @@ static struct Command commands[] = {
 		"Enable write reliability per partition for the <device>.\nDry-run only unless -y or -c is passed.\nUse -c if more partitioning settings are still to come.\nNOTE!  This is a one-time programmable (unreversible) change.",
 	  NULL
 	},
+	{ do_layout_apply, -2,
+	  "layout apply", "[-y] <file>|- <device>\n"
+		"Program the whole hardware partition layout described in <file>, or\n"
+		"stdin, in one multi-command transaction. PARTITION_SETTING_COMPLETED\n"
+		"is only written once no switch was rejected and the registers read\n"
+		"back as planned. One line per area, sizes in KiB or with a K, M or G\n"
+		"suffix:\n"
+		"  gp<1-4> size=<KiB> [enhanced] [ext=<0-2>] [reliable]\n"
+		"  user [enhanced start=<KiB> size=<KiB>] [reliable]\n"
+		"Areas not listed are left out of the layout. The layout is validated\n"
+		"against the card before anything is sent. Dry-run only unless -y is passed.\n"
+		"NOTE!  This is a one-time programmable (unreversible) change.",
+	  NULL
+	},
+	{ do_layout_plan, -2,
+	  "layout plan", "[-o <out file>] [-e <ext_csd dump>] <file>|- [<device>]\n"
+		"Plan the layout described in <file> (see layout apply) for the card:\n"
+		"sizes are rounded up to whole write protect groups, giving back\n"
+		"enhanced round ups if MAX_ENH_SIZE_MULT would be exceeded. The slack\n"
+		"lost to alignment, the enhanced capacity cost and the expected user\n"
+		"area are reported, and the planned layout printed, or written to\n"
+		"<out file> for layout apply. EXT_CSD is read from <device>, or with\n"
+		"-e from a dump, raw or as hex like the debugfs ext_csd file.",
+	  NULL
+	},
+	{ do_health_get, -1,
+	  "health get", "<device>\n"
+	  "Print the device life time estimations, pre EOL information and\n"
+	  "firmware version of <device>. The values cached by the kernel in\n"
+	  "sysfs are used when available, EXT_CSD is read otherwise.",
+	  NULL
+	},
 	{ do_status_get, -1,
 	  "status get", "<device>\n"
 	  "Print the response to STATUS_SEND (CMD13).",
@@ -126,6 +164,15 @@ static struct Command commands[] = {
 		"Enable the boot partition for the <device>.\nDisable the boot partition for the <device> if <boot_partition> is set to 0.\nTo receive acknowledgment of boot from the card set <send_ack>\nto 1, else set it to 0.",
 	  NULL
 	},
+	{ do_boot_part_write, -3,
+	  "bootpart write", "[-e] [-a] <boot_partition> <image> <device>\n"
+		"Write <image> to boot partition <boot_partition> (1 or 2) of <device>.\n"
+		"The current content is compared in erase group sized chunks and only\n"
+		"the chunks which differ are rewritten. The result is verified with SHA-256.\n"
+		"  -e  Enable the written partition for booting.\n"
+		"  -a  With -e, request the boot acknowledgment.",
+	  NULL
+	},
 	{ do_boot_bus_conditions_set, -4,
 	  "bootbus set", "<boot_mode> " "<reset_boot_bus_conditions> " "<boot_bus_width> " "<device>\n"
 	  "Set Boot Bus Conditions.\n"
@@ -134,6 +181,22 @@ static struct Command commands[] = {
 	  "<boot_bus_width> must be \"x1|x4|x8\"",
 	  NULL
 	},
+	{ do_bkops_daemon, -1,
+	  "bkops daemon", "[-i <idle_ms>] [-p <poll_ms>] [-l <level>] [-c <count>] [-s <stat>] <device>\n"
+		"Run manual background operations on <device> while it is idle.\n"
+		"The block device statistics (/sys/class/block/<dev>/stat, or <stat>)\n"
+		"are polled every <poll_ms> (default 100 ms). Once there was no I/O for\n"
+		"<idle_ms> (default 1000 ms) and BKOPS_STATUS is at least <level>\n"
+		"(1-3, default 1), BKOPS_START is sent. HPI is sent when I/O shows up\n"
+		"in the statistics, on the BKOPS timeout or on a signal. Exits after\n"
+		"<count> operations if given, or on SIGINT/SIGTERM. Manual BKOPS must\n"
+		"be enabled, see bkops_en.\n"
+		"NOTE!: BKOPS_START does not wait for busy, so the kernel does not know\n"
+		"the card is busy. I/O arriving during BKOPS is sent to the busy card\n"
+		"and waits for the operation to end; the HPI is queued behind it and\n"
+		"cannot preempt it. Only an idle card is interrupted right away.",
+	  NULL
+	},
 	{ do_write_bkops_en, -2,
 	  "bkops_en", "<auto|manual> <device>\n"
 		"Enable the eMMC BKOPS feature on <device>.\n"
@@ -153,8 +216,21 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_sanitize, -1,
-	  "sanitize", "<device> [timeout_ms]\n"
-		"Send Sanitize command to the <device>.\nThis will delete the unmapped memory region of the device.",
+	  "sanitize", "[-p <poll_ms>] <device> [timeout_ms]\n"
+		"Send Sanitize command to the <device>.\nThis will delete the unmapped memory region of the device.\n"
+		"  -p  Don't block in the kernel, poll the device status every\n"
+		"      <poll_ms> instead and report the elapsed time. In this mode\n"
+		"      [timeout_ms] bounds the runtime: on expiry, or on Ctrl-C,\n"
+		"      the sanitize is aborted with HPI.\n"
+		"[timeout_ms] defaults to the kernel's sanitize timeout, 240 s.",
+	  NULL
+	},
+	{ do_hpi, -1,
+	  "hpi", "<device>\n"
+		"Send a High Priority Interrupt (HPI) to <device>, CMD12 or CMD13\n"
+		"as HPI_FEATURES selects, and report the time until the card is\n"
+		"ready again. This interrupts a background operation, sanitize or\n"
+		"erase in progress.",
 	  NULL
 	},
 	{ do_rpmb_write_key, -1,
@@ -209,6 +285,25 @@ static struct Command commands[] = {
 		"NOTE! The cache is an optional feature on devices >= eMMC4.5.",
 	  NULL
 	},
+	{ do_cache_flush, -1,
+	  "cache flush", "<device>\n"
+		"Flush the eMMC cache of <device> (FLUSH_CACHE) and report how long\n"
+		"it took.",
+	  NULL
+	},
+	{ do_cache_daemon, -1,
+	  "cache daemon", "[-i <idle_ms>] [-t <max_dirty_ms>] [-p <poll_ms>] [-c <count>] [-s <stat>] <device>\n"
+		"Flush the eMMC cache of <device> by policy. The block device\n"
+		"statistics (/sys/class/block/<dev>/stat, or <stat>) are polled\n"
+		"every <poll_ms> (default 100 ms). After a write, the cache is\n"
+		"flushed once there was no I/O for <idle_ms> (default 1000 ms, 0 to\n"
+		"disable) or once data has been dirty for <max_dirty_ms> (default\n"
+		"off). A flush the kernel issued itself (stat field 15) also counts\n"
+		"as clean. Each flush is logged with its latency and how long data was\n"
+		"dirty; on SIGINT/SIGTERM, or after <count> flushes, the cache is\n"
+		"flushed a last time if needed and a latency histogram is printed.",
+	  NULL
+	},
 	{ do_read_csd, -1,
 	  "csd read", "<device path>\n"
 		  "Print CSD data from <device path>.\n"
@@ -227,6 +322,21 @@ static struct Command commands[] = {
 		  "The device path should specify the scr file directory.",
 	  NULL
 	},
+	{ do_decode_regs, 999,
+	  "decode", "[-j] [-t <threads>] [<file>|-]\n"
+		  "Decode a stream of register dumps, one card per line, from <file> or stdin.\n"
+		  "Each line holds \"type,cid,csd[,scr]\" with <type> MMC or SD and the\n"
+		  "registers as hex strings. One CSV line, or with -j one JSON object, is\n"
+		  "printed per card, in input order. -t spreads the decoding over <threads>.",
+	  NULL
+	},
+	{ do_list_cards, 999,
+	  "list", "[-j]\n"
+		  "List all MMC and SD cards found in " "/sys/bus/mmc/devices" ",\n"
+		  "with their block device, identification, capacity and firmware\n"
+		  "revision, as a table or with -j as JSON.",
+	  NULL
+	},
 	{ do_ffu, -2,
 	  "ffu", "<image name> <device> [chunk-bytes]\n"
 		"Run Field Firmware Update with <image name> on <device>.\n"
@@ -254,14 +364,98 @@ static struct Command commands[] = {
 	 "Optional FFU mode 4, uses CMD24 Single-block write for repeated downloads, remaining in FFU mode until completion.\n",
 	 NULL
 	},
+	{ do_erase_verify, -3,
+	"erase verify", "[-t <threads>] [-s <percent>] [-b <chunk KiB>] <start address> <end address> <device>\n"
+		"Read back an erased region of <device> with O_DIRECT and check it\n"
+		"holds the ERASED_MEM_CONT pattern. The addresses are the same as\n"
+		"for the erase command.\n"
+		"  -t  Number of reader threads, defaults to 4.\n"
+		"  -s  Only check a random sample of <percent> of the chunks.\n"
+		"  -b  Size of each read, defaults to 1024 KiB.\n"
+		"NOTE!: Discard and trim leave the content undefined, only\n"
+		"legacy and secure erase can be verified.\n",
+	NULL
+	},
 	{ do_erase, -4,
-	"erase", "<type> " "<start address> " "<end address> " "<device>\n"
+	"erase", "[-p <poll_ms>] <type> " "<start address> " "<end address> " "<device> [timeout_ms]\n"
 		"Send Erase CMD38 with specific argument to the <device>\n\n"
 		"NOTE!: This will delete all user data in the specified region of the device\n"
 		"<type> must be: legacy | discard | secure-erase | "
-		"secure-trim1 | secure-trim2 | trim \n",
+		"secure-trim1 | secure-trim2 | trim \n"
+		"  -p  Don't block in the kernel, poll the device status every\n"
+		"      <poll_ms> instead. [timeout_ms] bounds the runtime: on expiry,\n"
+		"      or on Ctrl-C, the erase is aborted with HPI and the range is\n"
+		"      left partially erased. It defaults to the erase timeout.\n",
 	NULL
 	},
+	{ do_bench_qdepth, -1,
+	  "bench qdepth", "[-q <depth,...>] [-b <block KiB>] [-t <seconds>] [-w <write %>] [-o <offset KiB>] [-s <size KiB>] <device>\n"
+		"Measure random O_DIRECT I/O on <device> at each queue depth of the\n"
+		"list (default 1,2,4,8,16,32), with as many threads, and report\n"
+		"IOPS, throughput and p50/p99/p99.9 latency per depth, along with\n"
+		"the CMDQ state from EXT_CSD. -b sets the block size (default 4 KiB),\n"
+		"-t the run time per depth (default 10 s), -w the share of writes\n"
+		"(default 0), -o and -s the area used (default the whole device).\n"
+		"Sizes take a K, M or G suffix.\n"
+		"NOTE!: With -w, which needs -s, this overwrites data in the area\n"
+		"used.",
+	  NULL
+	},
+	{ do_bench_cmd, -2,
+	  "bench cmd", "[-n <count>] [-m <batch>] [-a <arg>] <opcode> <device>\n"
+		"Send control command <opcode> to <device> <count> times (default\n"
+		"1000), one MMC_IOC_CMD ioctl each, and report the min, mean and\n"
+		"percentile latency. With -m, the commands are sent again in\n"
+		"MMC_IOC_MULTI_CMD batches of <batch> (up to 255) and the saving per\n"
+		"command is reported. <opcode> is 13 (SEND_STATUS), 8 (SEND_EXT_CSD)\n"
+		"or 6 (SWITCH), which needs its argument in -a and really performs\n"
+		"the switch each time.",
+	  NULL
+	},
+	{ do_bench_relwrite, -1,
+	  "bench relwrite", "[-b <block KiB,...>] [-n <count>] [-o <offset KiB>] [-t <busy_ms>] [-p <poll_ms>] <device>\n"
+		"Compare normal and reliable writes on <device>, the user area or a\n"
+		"boot or general purpose partition device. For each block size of\n"
+		"the list (default 4,64,512 KiB, at most 512), <count> (default 256)\n"
+		"sequential writes from <offset KiB> are sent as CMD23+CMD25, with\n"
+		"and without the reliable write bit of CMD23, and the throughput,\n"
+		"latency and cost of reliable writes are reported, along with\n"
+		"WR_REL_PARAM and WR_REL_SET. The card may stay busy programming\n"
+		"each write for up to <busy_ms> (default 10000 ms); EXT_CSD has no\n"
+		"write timeout to derive it from. It is polled with CMD13 every\n"
+		"<poll_ms>, by default back to back for precise latencies, which\n"
+		"keeps the bus busy.\n"
+		"NOTE!: This overwrites data, bypassing the page cache and the\n"
+		"partition table: offsets are within the hardware partition.",
+	  NULL
+	},
+	{ do_bench, -1,
+	  "bench", "[-b <block KiB,...>] [-t <seconds>] [-q <depth>] [-w] [-o <offset KiB>] [-s <size KiB>] <device>\n"
+		"Run sequential and random O_DIRECT reads, and writes with -w, on\n"
+		"<device> (a disk or partition) at each block size of the list\n"
+		"(default 4,128,512 KiB) and report throughput, IOPS and a latency\n"
+		"histogram per test. The results are tagged with the CID, firmware\n"
+		"version, bus mode, cache and CMDQ state. -t sets the run time per\n"
+		"test (default 5 s), -q the number of I/Os in flight (default 1),\n"
+		"-o and -s the area used (default the whole device).\n"
+		"NOTE!: With -w, which needs -s, this overwrites data in the area\n"
+		"used.",
+	  NULL
+	},
+	{ do_power_class_set, -1,
+	  "power_class set", "[-n] [-t <seconds>] [-w] [-o <offset KiB>] [-s <size KiB>] [-i <ios file>] <device>\n"
+		"Set POWER_CLASS of <device> to the highest class the card allows\n"
+		"for the bus mode the host negotiated, read from the debugfs ios\n"
+		"file of the host (or <ios file>): the PWR_CL field for its supply\n"
+		"voltage, clock and DDR mode, for 4 or 8 data lines. A sequential\n"
+		"512 KiB read (write with -w) runs for <seconds> (default 3)\n"
+		"before and after the switch to check the throughput gain, on\n"
+		"<size KiB> from <offset KiB> (default the whole device). -n only\n"
+		"reports the current and target class.\n"
+		"NOTE!: POWER_CLASS is reset on power cycle. With -w, which needs\n"
+		"-s, this overwrites data in the area used.",
+	  NULL
+	},
 	{ do_general_cmd_read, -1,
 	"gen_cmd read", "<device> [arg]\n"
 		"Send GEN_CMD (CMD56) to read vendor-specific format/meaning data from <device>\n\n"
@@ -270,6 +464,20 @@ static struct Command commands[] = {
 		"be 1.",
 	NULL
 	},
+	{ do_raw, -2,
+	  "raw", "[-r <repeat>] <sequence>|- <device>\n"
+		"Send the commands described in <sequence>, or read from stdin, to <device>\n"
+		"as one multi-command transaction, then print all responses and the latency.\n"
+		"Commands are separated by newlines or ';' and made of the words:\n"
+		"  op=<opcode> arg=<arg> rsp=none|r1|r1b|r2|r3 type=ac|adtc|bc|bcr\n"
+		"  flags=<raw flags> blksz=<bytes> blocks=<n> write rel data=<file>\n"
+		"  timeout=<ms> data_timeout=<ms> (at most 4294)\n"
+		"op= is required, rsp defaults to r1 and type to adtc when blocks are\n"
+		"given, ac otherwise. Data is written from data=<file>, or read into it,\n"
+		"or printed in hex when no file is given. -r repeats the transaction and\n"
+		"reports the minimum, average and maximum latency.",
+	NULL
+	},
 	{ do_softreset, -1,
 	  "softreset", "<device>\n"
 	  "Issues a CMD0 softreset, e.g. for testing if hardware reset for UHS works",
@@ -281,17 +489,28 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_alt_boot_op, -1,
-	  "boot_operation", "<boot_data_file> <device>\n"
-	  "Does the alternative boot operation and writes the specified starting blocks of boot data into the requested file.\n\n"
+	  "boot_operation", "[-f] [-t] <boot_data_file> <device>\n"
+	  "Does the alternative boot operation and writes the specified starting blocks of boot data into the requested file.\n"
+	  "  -f  Capture the full boot partition, reading the data beyond 512K from the enabled boot partition.\n"
+	  "  -t  Report the first data latency and the boot transfer rate.\n\n"
 	  "Note some limitations\n:"
 	  "1. The boot operation must be configured, e.g. for legacy speed:\n"
 	  "mmc-utils bootbus set single_backward retain x8 /dev/mmcblk2\n"
 	  "mmc-utils bootpart enable 1 0 /dev/mmcblk2\n"
 	  "2. The MMC must currently be running at the bus mode that is configured for the boot operation (HS200 and HS400 not supported at all).\n"
-	  "3. Only up to 512K bytes of boot data will be transferred.\n"
+	  "3. Only up to 512K bytes of boot data will be transferred by the boot operation itself.\n"
 	  "4. The MMC will perform a soft reset, if your system cannot handle that do not use the boot operation from mmc-utils.\n",
 	  NULL
 	},
+	{ do_batch, 1,
+	  "batch", "<script>|-\n"
+	  "Run the mmc commands listed in <script>, or read from stdin, one per line,\n"
+	  "in a single process. Devices stay open and EXT_CSD is only re-read after a\n"
+	  "command may have changed it. Everything after a # is ignored, as is a\n"
+	  "leading \"mmc\". The result of each line is reported on stderr and the\n"
+	  "batch stops at the first failing line.",
+	  NULL
+	},
 	{ NULL, 0, NULL, NULL }
 };
 
@@ -339,6 +558,8 @@ static void help(char *np)
 
 	printf("\n\t%s help|--help|-h\n\t\tShow the help.\n",np);
 	printf("\n\t%s <cmd> --help\n\t\tShow detailed help for a command or subset of commands.\n",np);
+	printf("\n\t%s --trace <file> <cmd> ...\n\t\tLog every command sent to the card to <file> (CSV, - for stdout)\n\t\tand print a latency summary on exit.\n",np);
+	printf("\n\t%s --poll <ms> <cmd> ...\n\t\tWait for switch and erase commands to complete by polling the card\n\t\tstatus every <ms> instead of in the kernel.\n",np);
 	printf("\n%s\n", VERSION);
 }
 
@@ -377,7 +598,7 @@ static int check_ambiguity(struct Command *cmd, char **argv){
 			int	j, skip;
 			char	*s1, *s2;
 
-			if( cp->ncmds < i )
+			if( cp->ncmds <= i )
 				continue;
 
 			for( skip = 0, j = 0 ; j < i ; j++ )
@@ -390,6 +611,9 @@ static int check_ambiguity(struct Command *cmd, char **argv){
 
 			if( !strcmp(cmd->cmds[i], cp->cmds[i]))
 				continue;
+			/* an exact word is never ambiguous */
+			if( !strcmp(argv[i+1], cmd->cmds[i]))
+				continue;
 			for(s2 = cp->cmds[i], s1 = argv[i+1];
 				*s1 == *s2 && *s1; s1++, s2++ ) ;
 			if( !*s1 )
@@ -440,6 +664,10 @@ static int prepare_args(int *ac, char ***av, char *prgname, struct Command *cmd
 
 }
 
+/* Line of the batch script being run, 0 outside batch mode */
+static int batch_line;
+static char *batch_verb;
+
 /*
 	This function performs the following jobs:
 	- show the help if '--help' or 'help' or '-h' are passed
@@ -526,7 +754,8 @@ static int parse_args(int argc, char **argv,
 
 	if(!matchcmd){
 		fprintf( stderr, "ERROR: unknown command '%s'\n",argv[1]);
-		help(prgname);
+		if (!batch_line)
+			help(prgname);
 		return -1;
 	}
 
@@ -553,12 +782,195 @@ static int parse_args(int argc, char **argv,
 
 	return 1;
 }
+/*
+ * Splits @line into words, honouring double quotes, in place. Returns the
+ * number of words, stopping at a # outside quotes.
+ */
+static int split_line(char *line, char **words, int max)
+{
+	int n = 0;
+	char *p = line, *w;
+
+	while (n < max) {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+		if (!*p || *p == '#')
+			break;
+
+		if (*p == '"') {
+			w = ++p;
+			while (*p && *p != '"')
+				p++;
+		} else {
+			w = p;
+			while (*p && *p != ' ' && *p != '\t' && *p != '\n' &&
+			       *p != '\r')
+				p++;
+		}
+		words[n++] = w;
+		if (!*p)
+			break;
+		*p++ = '\0';
+	}
+
+	return n;
+}
+
+/* The commands exit() on errors, which ends the batch at that line */
+static void batch_exit(int status, void *arg)
+{
+	if (!batch_line)
+		return;
+
+	fflush(stdout);
+	fprintf(stderr, "line %d: %s: failed, exit status %d\n", batch_line,
+		batch_verb ? batch_verb : "?", status);
+}
+
+#define BATCH_MAX_WORDS 64
+
+static int do_batch(int nargs, char **argv)
+{
+	char *line = NULL, *words[BATCH_MAX_WORDS + 1], **av;
+	int n, r, ret = 0, lineno = 0, cmd_nargs;
+	char *cmd, **cmd_args;
+	CommandFunction func;
+	struct timespec t0, t1;
+	size_t len = 0;
+	FILE *f;
+
+	if (!strcmp(argv[1], "-")) {
+		f = stdin;
+	} else {
+		f = fopen(argv[1], "r");
+		if (!f) {
+			perror(argv[1]);
+			exit(1);
+		}
+	}
+
+	dev_cache_enable();
+	on_exit(batch_exit, NULL);
+
+	while (getline(&line, &len, f) != -1) {
+		lineno++;
+		n = split_line(line, words + 1, BATCH_MAX_WORDS);
+		av = words;
+		if (n && !strcmp(words[1], "mmc")) {
+			av++;
+			n--;
+		}
+		if (!n)
+			continue;
+		av[0] = "mmc";
+
+		batch_line = lineno;
+		batch_verb = NULL;
+		r = parse_args(n + 1, av, &func, &cmd_nargs, &cmd, &cmd_args);
+		if (r < 0) {
+			fprintf(stderr, "line %d: invalid command\n", lineno);
+			ret = 1;
+			break;
+		}
+		if (r == 0)
+			continue;
+		if (func == do_batch) {
+			fprintf(stderr, "line %d: batch cannot be nested\n",
+				lineno);
+			ret = 1;
+			break;
+		}
+
+		batch_verb = cmd;
+		/* Let getopt() start over for every command */
+		optind = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		r = func(cmd_nargs, cmd_args);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		free(cmd_args[0]);
+		free(cmd_args);
+
+		fflush(stdout);
+		if (r) {
+			fprintf(stderr, "line %d: %s: failed, status %d\n",
+				lineno, cmd, r);
+			ret = 1;
+			break;
+		}
+		fprintf(stderr, "line %d: %s: ok, %.1f ms\n", lineno, cmd,
+			(t1.tv_sec - t0.tv_sec) * 1e3 +
+			(t1.tv_nsec - t0.tv_nsec) / 1e6);
+	}
+
+	batch_line = 0;
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	dev_cache_flush();
+
+	return ret;
+}
+
+/*
+ * Takes the global option @name, given as "<name> <value>" or
+ * "<name>=<value>", off the front of the arguments and returns its value.
+ * Returns NULL if the next argument is something else.
+ */
+static char *take_option(int *ac, char ***av, const char *name)
+{
+	size_t len = strlen(name);
+	char *prog = (*av)[0], *arg, *value;
+
+	if (*ac < 2)
+		return NULL;
+
+	arg = (*av)[1];
+	if (strncmp(arg, name, len) || (arg[len] && arg[len] != '='))
+		return NULL;
+
+	if (arg[len] == '=') {
+		value = arg + len + 1;
+	} else if (*ac > 2) {
+		value = (*av)[2];
+		(*ac)--;
+		(*av)++;
+	} else {
+		fprintf(stderr, "ERROR: %s requires a value\n", name);
+		exit(1);
+	}
+
+	/* Keep the program name in front of what is left */
+	(*ac)--;
+	(*av)[1] = prog;
+	(*av)++;
+
+	return value;
+}
+
 int main(int ac, char **av )
 {
-	char *cmd = NULL, **args = NULL;
+	char *cmd = NULL, **args = NULL, *opt;
 	int nargs = 0, r;
+	unsigned long poll_ms;
 	CommandFunction func = NULL;
 
+	/* Global options come before the command */
+	for (;;) {
+		if ((opt = take_option(&ac, &av, "--trace"))) {
+			trace_enable(opt);
+		} else if ((opt = take_option(&ac, &av, "--poll"))) {
+			poll_ms = strtoul(opt, NULL, 10);
+			if (!poll_ms) {
+				fprintf(stderr, "ERROR: invalid poll interval '%s'\n",
+					opt);
+				exit(1);
+			}
+			dev_poll_busy(poll_ms);
+		} else {
+			break;
+		}
+	}
+
 	r = parse_args(ac, av, &func, &nargs, &cmd, &args);
 	if( r <= 0 ){
 		/* error or no command to parse*/
@@ -17,8 +17,11 @@
  * those modifications are Copyright (c) 2016 SanDisk Corp.
  */
 
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -30,9 +33,13 @@
 #include <assert.h>
 #include <linux/fs.h> /* for BLKGETSIZE */
 #include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mmc.h"
 #include "mmc_cmds.h"
+#include "libmmc.h"
 #include "3rdparty/hmac_sha/hmac_sha2.h"
 
 #ifndef MMC_IOC_MULTI_CMD
@@ -45,108 +52,499 @@
 
 #define WP_BLKS_PER_QUERY 32
 
-#define USER_WP_PERM_PSWD_DIS	0x80
-#define USER_WP_CD_PERM_WP_DIS	0x40
-#define USER_WP_US_PERM_WP_DIS	0x10
-#define USER_WP_US_PWR_WP_DIS	0x08
-#define USER_WP_US_PERM_WP_EN	0x04
-#define USER_WP_US_PWR_WP_EN	0x01
-#define USER_WP_CLEAR (USER_WP_US_PERM_WP_DIS | USER_WP_US_PWR_WP_DIS	\
-			| USER_WP_US_PERM_WP_EN | USER_WP_US_PWR_WP_EN)
-
 #define WPTYPE_NONE 0
 #define WPTYPE_TEMP 1
 #define WPTYPE_PWRON 2
 #define WPTYPE_PERM 3
 
 
-// Firmware Update (FFU) download modes
-enum ffu_download_mode {
-	FFU_DEFAULT_MODE, // Default mode: Uses CMD23+CMD25; exits FFU mode after each loop.
-	FFU_OPT_MODE1,	// Optional mode 1: Uses CMD23+CMD25; but stays in FFU mode during download.
-	FFU_OPT_MODE2,	// Optional mode 2: Uses CMD25+CMD12 Open-ended Multiple-block write to download
-	FFU_OPT_MODE3,	// Optional mode 3: Uses CMD24 Single-block write to download
-	FFU_OPT_MODE4	// Optional mode 4: Uses CMD24 Single-block write to download, but stays in FFU mode during download.
+#define DEV_CACHE_MAX 16
+
+/*
+ * In batch mode devices stay open across commands, and their EXT_CSD is
+ * read from the card only after something may have changed it.
+ */
+static struct mmc_dev *dev_cache[DEV_CACHE_MAX];
+static bool dev_cache_on;
+static unsigned int dev_poll_ms;
+/* Set on every handle opened, see trace_enable() */
+static mmc_trace_t dev_trace;
+
+void dev_cache_enable(void)
+{
+	dev_cache_on = true;
+}
+
+void dev_poll_busy(unsigned int poll_ms)
+{
+	dev_poll_ms = poll_ms;
+}
+
+void dev_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < DEV_CACHE_MAX && dev_cache[i]; i++) {
+		mmc_dev_close(dev_cache[i]);
+		dev_cache[i] = NULL;
+	}
+}
+
+/* Opens the card behind @device, or exits */
+static struct mmc_dev *open_dev(const char *device)
+{
+	struct mmc_dev *dev;
+	int i, ret;
+
+	for (i = 0; dev_cache_on && i < DEV_CACHE_MAX && dev_cache[i]; i++)
+		if (!strcmp(mmc_dev_path(dev_cache[i]), device))
+			return dev_cache[i];
+
+	ret = mmc_dev_open(device, O_RDWR, &dev);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", device, strerror(-ret));
+		exit(1);
+	}
+	mmc_dev_poll_busy(dev, dev_poll_ms);
+	if (dev_trace)
+		mmc_dev_set_trace(dev, dev_trace, NULL);
+
+	if (dev_cache_on && i < DEV_CACHE_MAX) {
+		mmc_dev_cache_extcsd(dev, true);
+		dev_cache[i] = dev;
+	}
+
+	return dev;
+}
+
+static void close_dev(struct mmc_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < DEV_CACHE_MAX && dev_cache[i]; i++)
+		if (dev_cache[i] == dev)
+			return;
+
+	mmc_dev_close(dev);
+}
+
+/*
+ * Tracing: with --trace every ioctl is logged as one CSV line per command,
+ * and the latencies are summarized per command (sequence) on exit.
+ */
+#define TRACE_KEY_LEN 40
+
+struct trace_stat {
+	char key[TRACE_KEY_LEN];
+	unsigned int count;
+	unsigned int size;
+	__u64 *ns;
 };
 
-static inline __u32 per_byte_htole32(__u8 *arr)
+static FILE *trace_file;
+static struct trace_stat *trace_stats;
+static unsigned int trace_nstats;
+static unsigned long trace_ioctls;
+static __u64 trace_start_ns, trace_busy_ns;
+
+static __u64 get_time_ns(void)
 {
-	return arr[0] | arr[1] << 8 | arr[2] << 16 | arr[3] << 24;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int read_extcsd(int fd, __u8 *ext_csd)
+static void trace_add(const char *key, __u64 ns)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-	memset(&idata, 0, sizeof(idata));
-	memset(ext_csd, 0, sizeof(__u8) * 512);
-	idata.write_flag = 0;
-	idata.opcode = MMC_SEND_EXT_CSD;
-	idata.arg = 0;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	idata.blksz = 512;
-	idata.blocks = 1;
-	mmc_ioc_cmd_set_data(idata, ext_csd);
+	struct trace_stat *stat = NULL;
+	unsigned int i;
+
+	for (i = 0; i < trace_nstats; i++)
+		if (!strcmp(trace_stats[i].key, key))
+			stat = &trace_stats[i];
+
+	if (!stat) {
+		trace_stats = realloc(trace_stats,
+				      (trace_nstats + 1) * sizeof(*stat));
+		if (!trace_stats) {
+			perror("trace");
+			exit(1);
+		}
+		stat = &trace_stats[trace_nstats++];
+		memset(stat, 0, sizeof(*stat));
+		snprintf(stat->key, sizeof(stat->key), "%s", key);
+	}
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
+	if (stat->count == stat->size) {
+		stat->size = stat->size ? stat->size * 2 : 64;
+		stat->ns = realloc(stat->ns, stat->size * sizeof(*stat->ns));
+		if (!stat->ns) {
+			perror("trace");
+			exit(1);
+		}
+	}
+	stat->ns[stat->count++] = ns;
+}
 
-	return ret;
+static void trace_cmd(struct mmc_dev *dev, const struct mmc_ioc_cmd *cmds,
+		      unsigned int ncmds, int err, __u64 start_ns,
+		      __u64 duration_ns, void *priv)
+{
+	char key[TRACE_KEY_LEN];
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < ncmds; i++) {
+		const struct mmc_ioc_cmd *cmd = &cmds[i];
+
+		fprintf(trace_file,
+			"%lu,%.3f,%s,%u,%u,%u,0x%08x,0x%08x,%u,%u,%u,0x%08x,%d,%.3f\n",
+			trace_ioctls, (start_ns - trace_start_ns) / 1000.0,
+			mmc_dev_path(dev), i, ncmds, cmd->opcode, cmd->arg,
+			cmd->flags, cmd->blksz, cmd->blocks, cmd->write_flag,
+			cmd->response[0], err, duration_ns / 1000.0);
+
+		if (len < sizeof(key))
+			len += snprintf(key + len, sizeof(key) - len, "%sCMD%u",
+					i ? "+" : "", cmd->opcode);
+	}
+
+	trace_add(key, duration_ns);
+	trace_busy_ns += duration_ns;
+	trace_ioctls++;
 }
 
-static void fill_switch_cmd(struct mmc_ioc_cmd *cmd, __u8 index, __u8 value)
+static int cmp_u64(const void *a, const void *b)
 {
-	cmd->opcode = MMC_SWITCH;
-	cmd->write_flag = 1;
-	cmd->arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) |
-		   (value << 8) | EXT_CSD_CMD_SET_NORMAL;
-	cmd->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-static int
-write_extcsd_value(int fd, __u8 index, __u8 value, unsigned int timeout_ms)
+/* Nearest rank percentile of the sorted @v, @p in tenths of a percent */
+static __u64 percentile(const __u64 *v, __u64 n, unsigned int p)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata = {};
+	__u64 rank = (n * p + 999) / 1000;
 
-	fill_switch_cmd(&idata, index, value);
+	return v[rank ? rank - 1 : 0];
+}
 
-	/* Kernel will set cmd_timeout_ms if 0 is set */
-	idata.cmd_timeout_ms = timeout_ms;
+static void trace_summary(void)
+{
+	__u64 run_ns = get_time_ns() - trace_start_ns;
+	unsigned int i;
+
+	if (trace_file != stdout)
+		fclose(trace_file);
+
+	fprintf(stderr, "\ntrace: %lu ioctls, %.3f ms in ioctls of %.3f ms run time\n",
+		trace_ioctls, trace_busy_ns / 1e6, run_ns / 1e6);
+	if (!trace_nstats)
+		return;
+
+	fprintf(stderr, "%-24s %8s %10s %10s %10s %10s (us)\n",
+		"command", "count", "p50", "p90", "p99", "max");
+	for (i = 0; i < trace_nstats; i++) {
+		struct trace_stat *stat = &trace_stats[i];
+
+		qsort(stat->ns, stat->count, sizeof(*stat->ns), cmp_u64);
+		fprintf(stderr, "%-24s %8u %10.1f %10.1f %10.1f %10.1f\n",
+			stat->key, stat->count,
+			percentile(stat->ns, stat->count, 500) / 1000.0,
+			percentile(stat->ns, stat->count, 900) / 1000.0,
+			percentile(stat->ns, stat->count, 990) / 1000.0,
+			stat->ns[stat->count - 1] / 1000.0);
+	}
+}
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
+/* Starts tracing to @path ("-" for stdout), until the program exits */
+void trace_enable(const char *path)
+{
+	if (!strcmp(path, "-")) {
+		trace_file = stdout;
+	} else {
+		trace_file = fopen(path, "w");
+		if (!trace_file) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+	fprintf(trace_file, "ioctl,start_us,device,index,ncmds,opcode,arg,flags,"
+		"blksz,blocks,write,resp0,err,latency_us\n");
+
+	trace_start_ns = get_time_ns();
+	dev_trace = trace_cmd;
+	atexit(trace_summary);
+}
+
+/* libmmc never prints, report its errors the way the commands used to */
+static int report(int ret)
+{
+	if (ret < 0)
+		fprintf(stderr, "ioctl: %s\n", strerror(-ret));
 
 	return ret;
 }
 
-static int send_status(int fd, __u32 *response)
+static int read_extcsd(struct mmc_dev *dev, __u8 *ext_csd)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
+	return report(mmc_read_extcsd(dev, ext_csd));
+}
 
-	memset(&idata, 0, sizeof(idata));
-	idata.opcode = MMC_SEND_STATUS;
-	idata.arg = (1 << 16);
-	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
+/*
+ * Finds the sysfs directory of the card behind @device, through the
+ * device link of its disk (the parent disk for a partition).
+ */
+static int card_sysfs_dir(const char *device, char *dir, size_t len)
+{
+	char path[PATH_MAX], resolved[PATH_MAX];
+	const char *name;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-	perror("ioctl");
+	name = strrchr(device, '/');
+	name = name ? name + 1 : device;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/device", name);
+	if (!realpath(path, resolved)) {
+		snprintf(path, sizeof(path), "/sys/class/block/%s/../device",
+			 name);
+		if (!realpath(path, resolved))
+			return -ENODEV;
+	}
+
+	snprintf(dir, len, "%s", resolved);
+	return 0;
+}
+
+static char *read_sysfs_attr(const char *dir, const char *attr, char *buf,
+			     size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return NULL;
+
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		n--;
+	buf[n] = '\0';
+
+	return buf;
+}
+
+static int parse_extcsd_hex(const char *hex, __u8 *ext_csd)
+{
+	unsigned int byte;
+	int i;
+
+	for (i = 0; i < 512; i++) {
+		if (sscanf(&hex[i * 2], "%2x", &byte) != 1)
+			return -EIO;
+		ext_csd[i] = byte;
+	}
+
+	return 0;
+}
+
+/* The kernel's debugfs directory of the card behind @device */
+static int card_debugfs_dir(const char *device, char *path, size_t len)
+{
+	char dir[PATH_MAX];
+	char *card, *host;
+
+	if (card_sysfs_dir(device, dir, sizeof(dir)))
+		return -ENODEV;
+
+	card = strrchr(dir, '/');
+	if (!card)
+		return -ENODEV;
+	*card++ = '\0';
+	host = strrchr(dir, '/');
+	if (!host)
+		return -ENODEV;
+	host++;
+
+	snprintf(path, len, "/sys/kernel/debug/%s/%s", host, card);
+	return 0;
+}
+
+/*
+ * Reads EXT_CSD through the kernel's debugfs file for the card, which is
+ * readable without opening the block device. The kernel still fetches it
+ * from the card with CMD8, but serialized with its own requests.
+ */
+static int read_extcsd_debugfs(const char *device, __u8 *ext_csd)
+{
+	char dir[PATH_MAX], path[PATH_MAX + 8], hex[512 * 2 + 1];
+	int fd;
+	ssize_t n;
+
+	if (card_debugfs_dir(device, dir, sizeof(dir)))
+		return -ENODEV;
+
+	snprintf(path, sizeof(path), "%s/ext_csd", dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, hex, sizeof(hex) - 1);
+	close(fd);
+	if (n < (ssize_t)sizeof(hex) - 1)
+		return -EIO;
+	hex[n] = '\0';
+
+	return parse_extcsd_hex(hex, ext_csd);
+}
+
+/* Bus settings the host negotiated with the card */
+struct host_ios {
+	unsigned int clock_hz;
+	unsigned int width;	/* data lines */
+	unsigned int vdd;	/* bit number in the OCR, 0 if unknown */
+	char timing[32];	/* e.g. "mmc HS200" */
+};
 
-	*response = idata.response[0];
+/*
+ * Parses the debugfs ios file of the host of the card behind @device, or
+ * @ios_path if not NULL.
+ */
+static int read_host_ios(const char *device, const char *ios_path,
+			 struct host_ios *ios)
+{
+	char path[PATH_MAX + 8], line[128], *p, *q;
+	FILE *fp;
+
+	if (ios_path) {
+		snprintf(path, sizeof(path), "%s", ios_path);
+	} else {
+		if (card_debugfs_dir(device, path, PATH_MAX))
+			return -ENODEV;
+		p = strrchr(path, '/');
+		strcpy(p, "/ios");
+	}
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	memset(ios, 0, sizeof(*ios));
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "clock: %u", &ios->clock_hz) == 1 ||
+		    sscanf(line, "actual clock: %u", &ios->clock_hz) == 1 ||
+		    sscanf(line, "vdd: %u", &ios->vdd) == 1 ||
+		    sscanf(line, "bus width: %*u (%u bits)", &ios->width) == 1)
+			continue;
+		if (!strncmp(line, "timing spec:", 12)) {
+			p = strchr(line, '(');
+			q = p ? strchr(p, ')') : NULL;
+			if (q)
+				snprintf(ios->timing, sizeof(ios->timing),
+					 "%.*s", (int)(q - p - 1), p + 1);
+		}
+	}
+	fclose(fp);
+
+	return ios->width ? 0 : -EIO;
+}
+
+/*
+ * Loads an EXT_CSD dump from @path: the 512 raw bytes, or 1024 hex digits as
+ * in the debugfs file, whitespace allowed.
+ */
+static int load_extcsd_dump(const char *path, __u8 *ext_csd)
+{
+	char buf[4096], hex[512 * 2 + 1];
+	int fd, i, n = 0;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len < 0)
+		return -errno;
+
+	for (i = 0; i < len; i++) {
+		if (isxdigit((unsigned char)buf[i]) && n < sizeof(hex) - 1)
+			hex[n++] = buf[i];
+		else if (!isspace((unsigned char)buf[i]))
+			break;
+	}
+	hex[n] = '\0';
+	if (i == len && n == sizeof(hex) - 1)
+		return parse_extcsd_hex(hex, ext_csd);
+
+	if (len != 512)
+		return -EINVAL;
+	memcpy(ext_csd, buf, 512);
+
+	return 0;
+}
+
+static int
+write_extcsd_value(struct mmc_dev *dev, __u8 index, __u8 value,
+		   unsigned int timeout_ms)
+{
+	return report(mmc_write_extcsd(dev, index, value, timeout_ms));
+}
+
+static int send_status(struct mmc_dev *dev, __u32 *response)
+{
+	return report(mmc_send_status(dev, response));
+}
+
+static int send_hpi(struct mmc_dev *dev, __u8 *ext_csd, __u32 *response)
+{
+	int ret = mmc_send_hpi(dev, ext_csd, response);
+
+	return ret == -EOPNOTSUPP ? ret : report(ret);
+}
+
+static volatile sig_atomic_t abort_requested;
+
+static void abort_handler(int sig)
+{
+	abort_requested = 1;
+}
+
+/*
+ * Interrupts the operation in progress with HPI and waits for the card to
+ * leave the programming state, which it should within OUT_OF_INTERRUPT_TIME.
+ * @latency_us is from sending HPI until the card is ready again.
+ */
+static int hpi_interrupt(struct mmc_dev *dev, __u8 *ext_csd, __u64 *latency_us)
+{
+	unsigned int timeout_ms = ext_csd[EXT_CSD_OUT_OF_INTERRUPT_TIME] * 10;
+	__u64 start = get_time_ns() / 1000;
+	__u32 response;
+	int ret;
+
+	ret = send_hpi(dev, ext_csd, &response);
+	if (!ret)
+		ret = report(mmc_wait_busy(dev, timeout_ms ? timeout_ms : 100,
+					   1, &response));
+	*latency_us = get_time_ns() / 1000 - start;
 
 	return ret;
 }
 
-static __u32 get_size_in_blks(int fd)
+static __u32 get_size_in_blks(struct mmc_dev *dev)
 {
 	int res;
 	int size;
 
-	res = ioctl(fd, BLKGETSIZE, &size);
+	res = ioctl(mmc_dev_fd(dev), BLKGETSIZE, &size);
 	if (res) {
 		fprintf(stderr, "Error getting device size, errno: %d\n",
 			errno);
@@ -156,51 +554,15 @@ static __u32 get_size_in_blks(int fd)
 	return size;
 }
 
-static int set_write_protect(int fd, __u32 blk_addr, int on_off)
+static int set_write_protect(struct mmc_dev *dev, __u32 blk_addr, int on_off)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 1;
-	if (on_off)
-		idata.opcode = MMC_SET_WRITE_PROT;
-	else
-		idata.opcode = MMC_CLEAR_WRITE_PROT;
-	idata.arg = blk_addr;
-	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
-
-	return ret;
+	return report(mmc_set_write_protect(dev, blk_addr, on_off));
 }
 
-static int send_write_protect_type(int fd, __u32 blk_addr, __u64 *group_bits)
+static int send_write_protect_type(struct mmc_dev *dev, __u32 blk_addr,
+				   __u64 *group_bits)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-	__u8 buf[8];
-	__u64 bits = 0;
-	int x;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 0;
-	idata.opcode = MMC_SEND_WRITE_PROT_TYPE;
-	idata.blksz      = 8,
-	idata.blocks     = 1,
-	idata.arg = blk_addr;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	mmc_ioc_cmd_set_data(idata, buf);
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
-	for (x = 0; x < sizeof(buf); x++)
-		bits |= (__u64)(buf[7 - x]) << (x * 8);
-	*group_bits = bits;
-	return ret;
+	return report(mmc_get_write_protect_type(dev, blk_addr, group_bits));
 }
 
 static void print_writeprotect_boot_status(__u8 *ext_csd)
@@ -261,7 +623,8 @@ static int get_wp_group_size_in_blks(__u8 *ext_csd, __u32 *size)
 int do_writeprotect_boot_get(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
@@ -271,13 +634,9 @@ int do_writeprotect_boot_get(int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -285,14 +644,15 @@ int do_writeprotect_boot_get(int nargs, char **argv)
 
 	print_writeprotect_boot_status(ext_csd);
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
 int do_writeprotect_boot_set(int nargs, char **argv)
 {
 	__u8 ext_csd[512], value;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	char *end;
 	int argi = 1;
@@ -317,11 +677,7 @@ int do_writeprotect_boot_set(int nargs, char **argv)
 
 	device = argv[argi++];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
 	if (nargs == 1 + argi) {
 		partition = strtoul(argv[argi], &end, 0);
@@ -332,7 +688,7 @@ int do_writeprotect_boot_set(int nargs, char **argv)
 		}
 	}
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -366,7 +722,7 @@ int do_writeprotect_boot_set(int nargs, char **argv)
 	value |= permanent ? EXT_CSD_BOOT_WP_B_PERM_WP_EN
 			   : EXT_CSD_BOOT_WP_B_PWR_WP_EN;
 
-	ret = write_extcsd_value(fd, EXT_CSD_BOOT_WP, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_BOOT_WP, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n",
@@ -374,7 +730,7 @@ int do_writeprotect_boot_set(int nargs, char **argv)
 		exit(1);
 	}
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
@@ -398,7 +754,8 @@ static void print_wp_status(__u32 wp_sizeblks, __u32 start_group,
 int do_writeprotect_user_get(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	int x;
 	int y = 0;
@@ -419,12 +776,8 @@ int do_writeprotect_user_get(int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-	ret = read_extcsd(fd, ext_csd);
+	dev = open_dev(device);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -435,10 +788,10 @@ int do_writeprotect_user_get(int nargs, char **argv)
 		exit(1);
 	printf("Write Protect Group size in blocks/bytes: %d/%d\n",
 		wp_sizeblks, wp_sizeblks * 512);
-	dev_sizeblks = get_size_in_blks(fd);
+	dev_sizeblks = get_size_in_blks(dev);
 	cnt = dev_sizeblks / wp_sizeblks;
 	for (x = 0; x < cnt; x += WP_BLKS_PER_QUERY) {
-		ret = send_write_protect_type(fd, x * wp_sizeblks, &bits);
+		ret = send_write_protect_type(dev, x * wp_sizeblks, &bits);
 		if (ret)
 			break;
 		remain = cnt - x;
@@ -463,14 +816,15 @@ int do_writeprotect_user_get(int nargs, char **argv)
 	if (last_wpblk != (x + y - 1))
 		print_wp_status(wp_sizeblks, last_wpblk, cnt - 1, last_prot);
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
 int do_writeprotect_user_set(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	int blk_start;
 	int blk_cnt;
@@ -482,11 +836,7 @@ int do_writeprotect_user_set(int nargs, char **argv)
 	if (nargs != 5)
 		goto usage;
 	device = argv[4];
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 	if (!strcmp(argv[1], "none")) {
 		wptype = WPTYPE_NONE;
 	} else if (!strcmp(argv[1], "temp")) {
@@ -501,7 +851,7 @@ int do_writeprotect_user_set(int nargs, char **argv)
 		fprintf(stderr, "Error, invalid \"type\"\n");
 		goto usage;
 	}
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -533,7 +883,7 @@ int do_writeprotect_user_set(int nargs, char **argv)
 			break;
 		}
 		if (user_wp != ext_csd[EXT_CSD_USER_WP]) {
-			ret = write_extcsd_value(fd, EXT_CSD_USER_WP, user_wp, 0);
+			ret = write_extcsd_value(dev, EXT_CSD_USER_WP, user_wp, 0);
 			if (ret) {
 				fprintf(stderr, "Error setting EXT_CSD\n");
 				exit(1);
@@ -541,7 +891,7 @@ int do_writeprotect_user_set(int nargs, char **argv)
 		}
 	}
 	for (x = 0; x < blk_cnt; x += wp_blks) {
-		ret = set_write_protect(fd, blk_start + x,
+		ret = set_write_protect(dev, blk_start + x,
 					wptype != WPTYPE_NONE);
 		if (ret) {
 			fprintf(stderr,
@@ -550,7 +900,7 @@ int do_writeprotect_user_set(int nargs, char **argv)
 		}
 	}
 	if (wptype != WPTYPE_NONE) {
-		ret = write_extcsd_value(fd, EXT_CSD_USER_WP,
+		ret = write_extcsd_value(dev, EXT_CSD_USER_WP,
 				ext_csd[EXT_CSD_USER_WP], 0);
 		if (ret) {
 			fprintf(stderr, "Error restoring EXT_CSD\n");
@@ -568,7 +918,8 @@ usage:
 int do_disable_512B_emulation(int nargs, char **argv)
 {
 	__u8 ext_csd[512], native_sector_size, data_sector_size, wr_rel_param;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
@@ -578,13 +929,9 @@ int do_disable_512B_emulation(int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -596,7 +943,7 @@ int do_disable_512B_emulation(int nargs, char **argv)
 
 	if (native_sector_size && !data_sector_size &&
 	   (wr_rel_param & EN_REL_WR)) {
-		ret = write_extcsd_value(fd, EXT_CSD_USE_NATIVE_SECTOR, 1, 0);
+		ret = write_extcsd_value(dev, EXT_CSD_USE_NATIVE_SECTOR, 1, 0);
 
 		if (ret) {
 			fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
@@ -610,45 +957,18 @@ int do_disable_512B_emulation(int nargs, char **argv)
 		printf("MMC does not support disabling 512B emulation mode.\n");
 	}
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
-int do_write_boot_en(int nargs, char **argv)
+/*
+ * The PART_CONFIG value that enables @boot_area for booting, keeping the
+ * partition access bits as they are. Returns -EINVAL for an invalid area.
+ */
+static int boot_en_value(const __u8 *ext_csd, int boot_area, int send_ack,
+			 __u8 *part_config)
 {
-	__u8 ext_csd[512];
-	__u8 value = 0;
-	int fd, ret;
-	char *device;
-	int boot_area, send_ack;
-
-	if (nargs != 4) {
-		fprintf(stderr, "Usage: mmc bootpart enable <partition_number> <send_ack> </path/to/mmcblkX>\n");
-		exit(1);
-	}
-
-	/*
-	 * If <send_ack> is 1, the device will send acknowledgment
-	 * pattern "010" to the host when boot operation begins.
-	 * If <send_ack> is 0, it won't.
-	 */
-	boot_area = strtol(argv[1], NULL, 10);
-	send_ack = strtol(argv[2], NULL, 10);
-	device = argv[3];
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
-
-	value = ext_csd[EXT_CSD_PART_CONFIG];
+	__u8 value = ext_csd[EXT_CSD_PART_CONFIG];
 
 	switch (boot_area) {
 	case EXT_CSD_PART_CONFIG_ACC_NONE:
@@ -667,30 +987,280 @@ int do_write_boot_en(int nargs, char **argv)
 		value |= (boot_area << 3);
 		break;
 	default:
-		fprintf(stderr, "Cannot enable the boot area\n");
-		exit(1);
+		return -EINVAL;
 	}
 	if (send_ack)
 		value |= EXT_CSD_PART_CONFIG_ACC_ACK;
 	else
 		value &= ~EXT_CSD_PART_CONFIG_ACC_ACK;
 
-	ret = write_extcsd_value(fd, EXT_CSD_PART_CONFIG, value, 0);
+	*part_config = value;
+	return 0;
+}
+
+int do_write_boot_en(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	__u8 value;
+	struct mmc_dev *dev;
+	int ret;
+	char *device;
+	int boot_area, send_ack;
+
+	if (nargs != 4) {
+		fprintf(stderr, "Usage: mmc bootpart enable <partition_number> <send_ack> </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	/*
+	 * If <send_ack> is 1, the device will send acknowledgment
+	 * pattern "010" to the host when boot operation begins.
+	 * If <send_ack> is 0, it won't.
+	 */
+	boot_area = strtol(argv[1], NULL, 10);
+	send_ack = strtol(argv[2], NULL, 10);
+	device = argv[3];
+
+	dev = open_dev(device);
+
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_PART_CONFIG, device);
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (boot_en_value(ext_csd, boot_area, send_ack, &value)) {
+		fprintf(stderr, "Cannot enable the boot area\n");
+		exit(1);
+	}
+
+	ret = write_extcsd_value(dev, EXT_CSD_PART_CONFIG, value, 0);
+	if (ret) {
+		fprintf(stderr, "Could not write EXT_CSD[%d] in %s\n",
+			EXT_CSD_PART_CONFIG, device);
 		exit(1);
 	}
+	close_dev(dev);
+	return ret;
+}
+
+static int set_force_ro(const char *part, const char *val, char *old)
+{
+	char path[PATH_MAX];
+	const char *name;
+	int fd, ret = 0;
+
+	name = strrchr(part, '/');
+	name = name ? name + 1 : part;
+	snprintf(path, sizeof(path), "/sys/block/%s/force_ro", name);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+	if (old && pread(fd, old, 1, 0) != 1)
+		ret = -EIO;
+	if (!ret && pwrite(fd, val, 1, 0) != 1)
+		ret = -EIO;
+	if (ret)
+		fprintf(stderr, "Could not update %s\n", path);
+
 	close(fd);
 	return ret;
 }
 
+static int hash_part(int fd, unsigned int len, __u8 *buf, unsigned int chunk,
+		     unsigned char *digest)
+{
+	sha256_ctx ctx;
+	unsigned int off, n;
+
+	sha256_init(&ctx);
+	for (off = 0; off < len; off += n) {
+		n = len - off < chunk ? len - off : chunk;
+		if (pread(fd, buf, n, off) != n)
+			return -EIO;
+		sha256_update(&ctx, buf, n);
+	}
+	sha256_final(&ctx, digest);
+
+	return 0;
+}
+
+static void print_digest(const char *what, unsigned char *digest)
+{
+	int i;
+
+	printf("%s", what);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		printf("%02x", digest[i]);
+	printf("\n");
+}
+
+int do_boot_part_write(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	unsigned char want[SHA256_DIGEST_SIZE], got[SHA256_DIGEST_SIZE];
+	char part[PATH_MAX], old_ro = '0';
+	char *image, *device;
+	__u8 *img = NULL, *cur = NULL;
+	unsigned int part_size, chunk, off, n, written = 0;
+	unsigned int chunks = 0, changed = 0;
+	__u8 value;
+	int boot_area, enable = 0, send_ack = 0;
+	struct mmc_dev *dev;
+	int img_fd, part_fd, opt, ret;
+	struct stat st;
+
+	while ((opt = getopt(nargs, argv, "ea")) != -1) {
+		switch (opt) {
+		case 'e':
+			enable = 1;
+			break;
+		case 'a':
+			send_ack = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 3)
+		goto usage;
+
+	boot_area = strtol(argv[optind], NULL, 10);
+	image = argv[optind + 1];
+	device = argv[optind + 2];
+	if (boot_area != EXT_CSD_PART_CONFIG_ACC_BOOT0 &&
+	    boot_area != EXT_CSD_PART_CONFIG_ACC_BOOT1) {
+		fprintf(stderr, "<boot_partition> must be 1 (boot0) or 2 (boot1)\n");
+		exit(1);
+	}
+
+	dev = open_dev(device);
+
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	part_size = ext_csd[EXT_CSD_BOOT_MULT] * 128 * 1024;
+	/* Compare in erase group sized chunks, the unit the card rewrites */
+	chunk = ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] * 512 * 1024;
+	if (!chunk || chunk > part_size)
+		chunk = 128 * 1024;
+
+	img_fd = open(image, O_RDONLY);
+	if (img_fd < 0 || fstat(img_fd, &st)) {
+		perror(image);
+		exit(1);
+	}
+	if (!st.st_size || st.st_size > part_size) {
+		fprintf(stderr, "Image size %lld does not fit the %u KiB boot partition\n",
+			(long long)st.st_size, part_size / 1024);
+		exit(1);
+	}
+
+	img = malloc(st.st_size);
+	cur = malloc(chunk);
+	if (!img || !cur) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+	if (pread(img_fd, img, st.st_size, 0) != st.st_size) {
+		fprintf(stderr, "Could not read %s\n", image);
+		exit(1);
+	}
+	close(img_fd);
+
+	snprintf(part, sizeof(part), "%sboot%d", device, boot_area - 1);
+	ret = set_force_ro(part, "0", &old_ro);
+	if (ret)
+		exit(1);
+
+	part_fd = open(part, O_RDWR);
+	if (part_fd < 0) {
+		perror(part);
+		ret = -errno;
+		goto restore_ro;
+	}
+
+	for (off = 0; off < st.st_size; off += n) {
+		n = st.st_size - off < chunk ? st.st_size - off : chunk;
+		if (pread(part_fd, cur, n, off) != n) {
+			fprintf(stderr, "Could not read %s at %u\n", part, off);
+			ret = -EIO;
+			goto close_part;
+		}
+		chunks++;
+		if (!memcmp(cur, img + off, n))
+			continue;
+		changed++;
+		if (pwrite(part_fd, img + off, n, off) != n) {
+			fprintf(stderr, "Could not write %s at %u\n", part, off);
+			ret = -EIO;
+			goto close_part;
+		}
+		written += n;
+	}
+
+	/* Drop the page cache so the verify pass reads back from the card */
+	if (fsync(part_fd) || ioctl(part_fd, BLKFLSBUF, 0)) {
+		perror("flush");
+		ret = -errno;
+		goto close_part;
+	}
+
+	printf("Wrote %u of %lld bytes to %s, %u of %u chunks of %u KiB changed\n",
+	       written, (long long)st.st_size, part, changed, chunks,
+	       chunk / 1024);
+
+	sha256(img, st.st_size, want);
+	ret = hash_part(part_fd, st.st_size, cur, chunk, got);
+	if (ret) {
+		fprintf(stderr, "Could not read back %s\n", part);
+		goto close_part;
+	}
+	print_digest("Image sha256:     ", want);
+	print_digest("Partition sha256: ", got);
+	if (memcmp(want, got, sizeof(want))) {
+		fprintf(stderr, "Verify failed, boot partition content does not match the image\n");
+		ret = -EIO;
+		goto close_part;
+	}
+
+	if (enable) {
+		/* boot_area was checked to be boot0 or boot1 */
+		boot_en_value(ext_csd, boot_area, send_ack, &value);
+		ret = write_extcsd_value(dev, EXT_CSD_PART_CONFIG, value, 0);
+		if (ret)
+			fprintf(stderr, "Could not write EXT_CSD[%d] in %s\n",
+				EXT_CSD_PART_CONFIG, device);
+	}
+
+close_part:
+	close(part_fd);
+restore_ro:
+	set_force_ro(part, &old_ro, NULL);
+	free(img);
+	free(cur);
+	close_dev(dev);
+	if (ret)
+		exit(1);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc bootpart write [-e] [-a] <boot_partition> <image> </path/to/mmcblkX>\n");
+	exit(1);
+}
+
 int do_boot_bus_conditions_set(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
 	__u8 value = 0;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 5) {
@@ -731,13 +1301,9 @@ int do_boot_bus_conditions_set(int nargs, char **argv)
 	}
 
 	device = argv[4];
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -745,21 +1311,22 @@ int do_boot_bus_conditions_set(int nargs, char **argv)
 	printf("Changing ext_csd[BOOT_BUS_CONDITIONS] from 0x%02x to 0x%02x\n",
 		ext_csd[EXT_CSD_BOOT_BUS_CONDITIONS], value);
 
-	ret = write_extcsd_value(fd, EXT_CSD_BOOT_BUS_CONDITIONS, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_BOOT_BUS_CONDITIONS, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n",
 			value, EXT_CSD_BOOT_BUS_CONDITIONS, device);
 		exit(1);
 	}
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
 static int do_hwreset(int value, int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
@@ -769,13 +1336,9 @@ static int do_hwreset(int value, int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -796,7 +1359,7 @@ static int do_hwreset(int value, int nargs, char **argv)
 		exit(1);
 	}
 
-	ret = write_extcsd_value(fd, EXT_CSD_RST_N_FUNCTION, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_RST_N_FUNCTION, value, 0);
 	if (ret) {
 		fprintf(stderr,
 			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
@@ -804,7 +1367,7 @@ static int do_hwreset(int value, int nargs, char **argv)
 		exit(1);
 	}
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
@@ -821,7 +1384,8 @@ int do_hwreset_dis(int nargs, char **argv)
 int do_write_bkops_en(int nargs, char **argv)
 {
 	__u8 ext_csd[512], value = 0;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	char *en_type;
 
@@ -833,13 +1397,9 @@ int do_write_bkops_en(int nargs, char **argv)
 	en_type = argv[1];
 	device = argv[2];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -850,9 +1410,9 @@ int do_write_bkops_en(int nargs, char **argv)
 			fprintf(stderr, "%s doesn't support AUTO_EN in the BKOPS_EN register\n", device);
 			exit(1);
 		}
-		ret = write_extcsd_value(fd, EXT_CSD_BKOPS_EN, BKOPS_AUTO_ENABLE, 0);
+		ret = write_extcsd_value(dev, EXT_CSD_BKOPS_EN, BKOPS_AUTO_ENABLE, 0);
 	} else if (strcmp(en_type, "manual") == 0) {
-		ret = write_extcsd_value(fd, EXT_CSD_BKOPS_EN, BKOPS_MAN_ENABLE, 0);
+		ret = write_extcsd_value(dev, EXT_CSD_BKOPS_EN, BKOPS_MAN_ENABLE, 0);
 	} else {
 		fprintf(stderr, "%s invalid mode for BKOPS_EN requested: %s. Valid options: auto or manual\n", en_type, device);
 		exit(1);
@@ -864,14 +1424,271 @@ int do_write_bkops_en(int nargs, char **argv)
 		exit(1);
 	}
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
+/* Completed I/Os and I/Os in flight on a block device */
+struct blk_activity {
+	unsigned long long ios;
+	unsigned long long writes;
+	unsigned long long in_flight;
+	unsigned long long flushes;
+};
+
+/* The stat file of @device in sysfs, unless @path was already given */
+static void blk_stat_path(const char *device, char *path, size_t len)
+{
+	const char *name;
+
+	if (path[0])
+		return;
+
+	name = strrchr(device, '/');
+	name = name ? name + 1 : device;
+	snprintf(path, len, "/sys/class/block/%s/stat", name);
+}
+
+/*
+ * Reads @path, a block device stat file (see the kernel's
+ * Documentation/block/stat.rst): read, write and discard I/Os completed,
+ * writes alone, the I/Os in flight, and the flushes completed (0 before
+ * Linux 5.5).
+ */
+static int read_blk_activity(const char *path, struct blk_activity *act)
+{
+	unsigned long long f[17] = {};
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	for (n = 0; n < 17; n++)
+		if (fscanf(fp, "%llu", &f[n]) != 1)
+			break;
+	fclose(fp);
+	if (n < 9)
+		return -EIO;
+
+	act->ios = f[0] + f[4] + f[11];
+	act->writes = f[4];
+	act->in_flight = f[8];
+	act->flushes = f[15];
+
+	return 0;
+}
+
+/* Log lines of the daemons, stamped with the time since @start */
+static void daemon_log(__u64 start, const char *fmt, ...)
+{
+	__u64 t = get_time_ns() / 1000 - start;
+	va_list ap;
+
+	printf("[%6llu.%03llu] ", t / 1000000, (t / 1000) % 1000);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+/*
+ * Runs one manual BKOPS. The kernel doesn't wait for busy; the card is polled
+ * with SEND_STATUS every @poll_ms until it is done, and interrupted with HPI as
+ * soon as @stat_path shows new I/O, on @timeout_ms, or when the user interrupts.
+ * Returns 1 if BKOPS was interrupted.
+ */
+static int bkops_run(struct mmc_dev *dev, __u8 *ext_csd,
+		     const char *stat_path, unsigned int poll_ms, unsigned int timeout_ms, __u64 t0)
+{
+	struct mmc_ioc_cmd idata = {};
+	struct blk_activity idle, act;
+	__u64 start, elapsed, hpi_us;
+	__u32 response;
+	const char *why = NULL;
+	int ret;
+
+	ret = read_blk_activity(stat_path, &idle);
+	if (ret)
+		return ret;
+
+	/*
+	 * Sent as R1 so the ioctl returns and the card can be polled. The
+	 * kernel then thinks the card is idle: a request arriving meanwhile
+	 * goes to the busy card and waits for BKOPS to end, and our HPI
+	 * ioctl is queued behind it. I/O is noticed, not preempted.
+	 */
+	mmc_fill_switch_cmd(&idata, EXT_CSD_BKOPS_START, 1);
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	start = get_time_ns() / 1000;
+	ret = report(mmc_cmd(dev, &idata));
+	if (ret)
+		return ret;
+	daemon_log(t0, "BKOPS started, status %u\n",
+		  ext_csd[EXT_CSD_BKOPS_STATUS]);
+
+	for (;;) {
+		ret = send_status(dev, &response);
+		elapsed = get_time_ns() / 1000 - start;
+		if (ret)
+			return ret;
+		if (R1_CURRENT_STATE(response) != R1_STATE_PRG)
+			break;
+
+		if (read_blk_activity(stat_path, &act) ||
+		    act.ios != idle.ios || act.in_flight)
+			why = "I/O resumed";
+		else if (elapsed >= timeout_ms * 1000ull)
+			why = "timeout";
+		else if (abort_requested)
+			why = "signal";
+		if (why) {
+			ret = hpi_interrupt(dev, ext_csd, &hpi_us);
+			if (ret)
+				return ret;
+			daemon_log(t0, "BKOPS interrupted (%s) after %llu ms, "
+				  "HPI latency %llu us\n", why,
+				  elapsed / 1000, hpi_us);
+			return 1;
+		}
+		usleep(poll_ms * 1000);
+	}
+
+	if (response & (R1_ERROR | R1_CC_ERROR | R1_SWITCH_ERROR)) {
+		fprintf(stderr, "BKOPS status error: 0x%08x\n", response);
+		return -EIO;
+	}
+	daemon_log(t0, "BKOPS completed after %llu ms\n", elapsed / 1000);
+
+	return 0;
+}
+
+int do_bkops_daemon(int nargs, char **argv)
+{
+	unsigned int idle_ms = 1000, poll_ms = 100, level = 1, count = 0;
+	unsigned int timeout_ms, runs = 0;
+	struct blk_activity last, act;
+	__u8 ext_csd[512];
+	struct mmc_dev *dev;
+	char stat_path[PATH_MAX];
+	char *device;
+	__u64 t0, idle_since, now;
+	int ret, opt;
+
+	stat_path[0] = '\0';
+	while ((opt = getopt(nargs, argv, "i:p:l:c:s:")) != -1) {
+		switch (opt) {
+		case 'i':
+			idle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			poll_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			level = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			snprintf(stat_path, sizeof(stat_path), "%s", optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 1 || !poll_ms || level < 1 || level > 3)
+		goto usage;
+	device = argv[optind];
+
+	blk_stat_path(device, stat_path, sizeof(stat_path));
+	ret = read_blk_activity(stat_path, &last);
+	if (ret) {
+		fprintf(stderr, "Could not read %s: %s\n", stat_path,
+			strerror(-ret));
+		exit(1);
+	}
+
+	dev = open_dev(device);
+
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BKOPS_SUPPORT] & 1)) {
+		fprintf(stderr, "%s doesn't support BKOPS\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BKOPS_EN] & BKOPS_MAN_ENABLE)) {
+		fprintf(stderr, "Manual BKOPS is not enabled on %s, see 'mmc bkops_en'\n",
+			device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_SUPP)) {
+		fprintf(stderr, "%s doesn't support HPI, BKOPS could not be "
+			"interrupted when I/O resumes\n", device);
+		exit(1);
+	}
+	timeout_ms = mmc_switch_timeout(ext_csd, EXT_CSD_BKOPS_START, 1);
+
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
+
+	t0 = idle_since = get_time_ns() / 1000;
+	daemon_log(t0, "watching %s, idle %u ms, BKOPS status >= %u\n",
+		  stat_path, idle_ms, level);
+
+	while (!abort_requested) {
+		usleep(poll_ms * 1000);
+		now = get_time_ns() / 1000;
+
+		ret = read_blk_activity(stat_path, &act);
+		if (ret) {
+			fprintf(stderr, "Could not read %s: %s\n", stat_path,
+				strerror(-ret));
+			break;
+		}
+		if (act.ios != last.ios || act.in_flight) {
+			last = act;
+			idle_since = now;
+			continue;
+		}
+		if (now - idle_since < idle_ms * 1000ull)
+			continue;
+
+		/* Idle long enough, check whether the card needs BKOPS */
+		ret = read_extcsd(dev, ext_csd);
+		if (ret)
+			break;
+		if (ext_csd[EXT_CSD_BKOPS_STATUS] >= level) {
+			ret = bkops_run(dev, ext_csd, stat_path, poll_ms,
+					timeout_ms, t0);
+			if (ret < 0)
+				break;
+			if (count && ++runs >= count)
+				break;
+			read_blk_activity(stat_path, &last);
+		}
+		/* Wait for another idle window before checking again */
+		idle_since = get_time_ns() / 1000;
+	}
+
+	close_dev(dev);
+	return ret < 0 ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc bkops daemon [-i idle_ms] [-p poll_ms] "
+		"[-l level] [-c count] [-s stat] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
 int do_status_get(int nargs, char **argv)
 {
 	__u32 response;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	const char *str;
 	__u8 state;
@@ -883,13 +1700,9 @@ int do_status_get(int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = send_status(fd, &response);
+	ret = send_status(dev, &response);
 	if (ret) {
 		fprintf(stderr, "Could not read response to SEND_STATUS from %s\n", device);
 		exit(1);
@@ -980,7 +1793,7 @@ int do_status_get(int nargs, char **argv)
 	if (response & R1_APP_CMD)
 		printf("STATUS: APP_CMD\n");
 out_free:
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
@@ -1012,7 +1825,7 @@ static unsigned int get_hc_erase_grp_size(__u8 *ext_csd)
 
 static int
 set_partitioning_setting_completed(int dry_run, const char *const device,
-				   int fd)
+				   struct mmc_dev *dev)
 {
 	int ret;
 
@@ -1028,7 +1841,7 @@ set_partitioning_setting_completed(int dry_run, const char *const device,
 	}
 
 	fprintf(stderr, "setting OTP PARTITION_SETTING_COMPLETED!\n");
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITION_SETTING_COMPLETED, 0x1, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_PARTITION_SETTING_COMPLETED, 0x1, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x1 to "
 			"EXT_CSD[%d] in %s\n",
@@ -1037,7 +1850,7 @@ set_partitioning_setting_completed(int dry_run, const char *const device,
 	}
 
 	__u32 response;
-	ret = send_status(fd, &response);
+	ret = send_status(dev, &response);
 	if (ret) {
 		fprintf(stderr, "Could not get response to SEND_STATUS "
 			"from %s\n", device);
@@ -1060,21 +1873,16 @@ set_partitioning_setting_completed(int dry_run, const char *const device,
 	return 0;
 }
 
-static int check_enhanced_area_total_limit(const char *const device, int fd)
+/* Checks the partition sizes programmed in @ext_csd against the card limits */
+static int check_enhanced_area_total_limit(const char *const device,
+					   __u8 *ext_csd)
 {
-	__u8 ext_csd[512];
 	__u32 regl;
 	unsigned long max_enh_area_sz, user_area_sz, enh_area_sz = 0;
 	unsigned long gp4_part_sz, gp3_part_sz, gp2_part_sz, gp1_part_sz;
 	unsigned long total_sz, total_gp_user_sz;
 	unsigned int wp_sz, erase_sz;
-	int ret;
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
 	wp_sz = get_hc_wp_grp_size(ext_csd);
 	erase_sz = get_hc_erase_grp_size(ext_csd);
 
@@ -1158,7 +1966,8 @@ int do_create_gp_partition(int nargs, char **argv)
 	__u8 value;
 	__u8 ext_csd[512];
 	__u8 address;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	int dry_run = 1;
 	int partition, enh_attr, ext_attr;
@@ -1192,13 +2001,9 @@ int do_create_gp_partition(int nargs, char **argv)
 		exit(1);
 	}
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -1214,7 +2019,7 @@ int do_create_gp_partition(int nargs, char **argv)
 	gp_size_mult = (length_kib + align/2l) / align;
 
 	/* set EXT_CSD_ERASE_GROUP_DEF bit 0 */
-	ret = write_extcsd_value(fd, EXT_CSD_ERASE_GROUP_DEF, 0x1, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ERASE_GROUP_DEF, 0x1, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x1 to EXT_CSD[%d] in %s\n",
 			EXT_CSD_ERASE_GROUP_DEF, device);
@@ -1223,7 +2028,7 @@ int do_create_gp_partition(int nargs, char **argv)
 
 	value = (gp_size_mult >> 16) & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_2 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value, 0);
+	ret = write_extcsd_value(dev, address, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
 			value, address, device);
@@ -1231,7 +2036,7 @@ int do_create_gp_partition(int nargs, char **argv)
 	}
 	value = (gp_size_mult >> 8) & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_1 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value, 0);
+	ret = write_extcsd_value(dev, address, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
 			value, address, device);
@@ -1239,7 +2044,7 @@ int do_create_gp_partition(int nargs, char **argv)
 	}
 	value = gp_size_mult & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_0 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value, 0);
+	ret = write_extcsd_value(dev, address, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
 			value, address, device);
@@ -1252,7 +2057,7 @@ int do_create_gp_partition(int nargs, char **argv)
 	else
 		value &= ~(1 << partition);
 
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITIONS_ATTRIBUTE, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_PARTITIONS_ATTRIBUTE, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write EXT_CSD_ENH_%x to EXT_CSD[%d] in %s\n",
 			partition, EXT_CSD_PARTITIONS_ATTRIBUTE, device);
@@ -1266,18 +2071,24 @@ int do_create_gp_partition(int nargs, char **argv)
 	else
 		value &= (0xF << (4 * ((partition % 2))));
 
-	ret = write_extcsd_value(fd, address, value, 0);
+	ret = write_extcsd_value(dev, address, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%x to EXT_CSD[%d] in %s\n",
 			value, address, device);
 		exit(1);
 	}
 
-	ret = check_enhanced_area_total_limit(device, fd);
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	ret = check_enhanced_area_total_limit(device, ext_csd);
 	if (ret)
 		exit(1);
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
+	if (set_partitioning_setting_completed(dry_run, device, dev))
 		exit(1);
 
 	return 0;
@@ -1287,7 +2098,8 @@ int do_enh_area_set(int nargs, char **argv)
 {
 	__u8 value;
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 	int dry_run = 1;
 	unsigned int start_kib, length_kib, enh_start_addr, enh_size_mult;
@@ -1308,13 +2120,9 @@ int do_enh_area_set(int nargs, char **argv)
 	length_kib = strtol(argv[3], NULL, 10);
 	device = argv[4];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -1343,7 +2151,7 @@ int do_enh_area_set(int nargs, char **argv)
 	enh_start_addr *= align;
 
 	/* set EXT_CSD_ERASE_GROUP_DEF bit 0 */
-	ret = write_extcsd_value(fd, EXT_CSD_ERASE_GROUP_DEF, 0x1, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ERASE_GROUP_DEF, 0x1, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x1 to "
 			"EXT_CSD[%d] in %s\n",
@@ -1353,7 +2161,7 @@ int do_enh_area_set(int nargs, char **argv)
 
 	/* write to ENH_START_ADDR and ENH_SIZE_MULT and PARTITIONS_ATTRIBUTE's ENH_USR bit */
 	value = (enh_start_addr >> 24) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_3, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_START_ADDR_3, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1361,7 +2169,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = (enh_start_addr >> 16) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_2, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_START_ADDR_2, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1369,7 +2177,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = (enh_start_addr >> 8) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_1, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_START_ADDR_1, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1377,7 +2185,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = enh_start_addr & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_0, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_START_ADDR_0, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1386,7 +2194,7 @@ int do_enh_area_set(int nargs, char **argv)
 	}
 
 	value = (enh_size_mult >> 16) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_2, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_SIZE_MULT_2, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1394,7 +2202,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = (enh_size_mult >> 8) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_1, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_SIZE_MULT_1, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1402,7 +2210,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = enh_size_mult & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_0, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_ENH_SIZE_MULT_0, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to "
 			"EXT_CSD[%d] in %s\n", value,
@@ -1410,7 +2218,7 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 	value = ext_csd[EXT_CSD_PARTITIONS_ATTRIBUTE] | EXT_CSD_ENH_USR;
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITIONS_ATTRIBUTE, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_PARTITIONS_ATTRIBUTE, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write EXT_CSD_ENH_USR to "
 			"EXT_CSD[%d] in %s\n",
@@ -1418,13 +2226,19 @@ int do_enh_area_set(int nargs, char **argv)
 		exit(1);
 	}
 
-	ret = check_enhanced_area_total_limit(device, fd);
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	ret = check_enhanced_area_total_limit(device, ext_csd);
 	if (ret)
 		exit(1);
 
 	printf("Done setting ENH_USR area on %s\n", device);
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
+	if (set_partitioning_setting_completed(dry_run, device, dev))
 		exit(1);
 
 	return 0;
@@ -1434,7 +2248,8 @@ int do_write_reliability_set(int nargs, char **argv)
 {
 	__u8 value;
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 
 	int dry_run = 1;
 	int partition;
@@ -1454,13 +2269,9 @@ int do_write_reliability_set(int nargs, char **argv)
 	partition = strtol(argv[2], NULL, 10);
 	device = argv[3];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -1481,7 +2292,7 @@ int do_write_reliability_set(int nargs, char **argv)
 	}
 
 	value = ext_csd[EXT_CSD_WR_REL_SET] | (1<<partition);
-	ret = write_extcsd_value(fd, EXT_CSD_WR_REL_SET, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_WR_REL_SET, value, 0);
 	if (ret) {
 		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
 				value, EXT_CSD_WR_REL_SET, device);
@@ -1491,38 +2302,691 @@ int do_write_reliability_set(int nargs, char **argv)
 	printf("Done setting EXT_CSD_WR_REL_SET to 0x%02x on %s\n",
 		value, device);
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
+	if (set_partitioning_setting_completed(dry_run, device, dev))
 		exit(1);
 
 	return 0;
 }
 
-int do_read_extcsd(int nargs, char **argv)
+/* A hardware partition layout, as described to 'layout apply' */
+struct layout {
+	unsigned long gp_kib[4];
+	bool gp_enh[4];
+	unsigned int gp_ext[4];
+	bool enh_user;
+	unsigned long enh_start_kib;
+	unsigned long enh_size_kib;
+	__u8 wr_rel;			/* WR_REL_SET bits */
+};
+
+/* Parses a size in KiB, with an optional K, M or G suffix */
+static int parse_kib(const char *str, unsigned long *kib)
 {
-	__u8 ext_csd[512], ext_csd_rev, reg;
-	__u32 regl;
-	int fd, ret;
-	char *device;
-	const char *str;
+	char *end;
 
-	if (nargs != 2) {
-		fprintf(stderr, "Usage: mmc extcsd read </path/to/mmcblkX>\n");
+	*kib = strtoul(str, &end, 0);
+	if (end == str)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		*kib *= 1024;
+		/* fall through */
+	case 'M':
+	case 'm':
+		*kib *= 1024;
+		/* fall through */
+	case 'K':
+	case 'k':
+		end++;
+		break;
+	}
+
+	return *end ? -EINVAL : 0;
+}
+
+/*
+ * Reads a layout, one area per line:
+ *	gp<1-4> size=<KiB> [enhanced] [ext=<0-2>] [reliable]
+ *	user [enhanced start=<KiB> size=<KiB>] [reliable]
+ * Sizes take a K, M or G suffix and everything after a # is ignored.
+ */
+static int layout_parse(FILE *f, const char *name, struct layout *l)
+{
+	char line[256], *word, *save, *p;
+	int lineno = 0;
+
+	memset(l, 0, sizeof(*l));
+
+	while (fgets(line, sizeof(line), f)) {
+		int gp = -1;
+		bool user = false, have_size = false;
+		unsigned long kib;
+
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		word = strtok_r(line, " \t\r\n", &save);
+		if (!word)
+			continue;
+
+		if (!strcmp(word, "user"))
+			user = true;
+		else if (!strncmp(word, "gp", 2) && word[2] >= '1' &&
+			 word[2] <= '4' && !word[3])
+			gp = word[2] - '1';
+		else
+			goto bad;
+
+		while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+			if (!strcmp(word, "enhanced")) {
+				if (user)
+					l->enh_user = true;
+				else
+					l->gp_enh[gp] = true;
+			} else if (!strcmp(word, "reliable")) {
+				/* bit 0 is the user area, 1-4 GP1-4 */
+				l->wr_rel |= 1 << (gp + 1);
+			} else if (!strncmp(word, "size=", 5)) {
+				if (parse_kib(word + 5, &kib))
+					goto bad;
+				if (user)
+					l->enh_size_kib = kib;
+				else
+					l->gp_kib[gp] = kib;
+				have_size = true;
+			} else if (user && !strncmp(word, "start=", 6)) {
+				if (parse_kib(word + 6, &l->enh_start_kib))
+					goto bad;
+			} else if (!user && !strncmp(word, "ext=", 4)) {
+				l->gp_ext[gp] = strtoul(word + 4, &p, 0);
+				if (*p || l->gp_ext[gp] > 2)
+					goto bad;
+			} else {
+				goto bad;
+			}
+		}
+
+		if (!user && !have_size) {
+			fprintf(stderr, "%s:%d: gp%d needs a size\n", name,
+				lineno, gp + 1);
+			return -EINVAL;
+		}
+		if (user && l->enh_user != have_size) {
+			fprintf(stderr, "%s:%d: the enhanced user area needs "
+				"a size, and size= needs enhanced\n", name,
+				lineno);
+			return -EINVAL;
+		}
+		if (!user && l->gp_enh[gp] && l->gp_ext[gp]) {
+			fprintf(stderr, "%s:%d: gp%d can't be both enhanced "
+				"and have an extended attribute\n", name,
+				lineno, gp + 1);
+			return -EINVAL;
+		}
+		continue;
+bad:
+		fprintf(stderr, "%s:%d: invalid \"%s\"\n", name, lineno,
+			word ? word : line);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void set_reg24(__u8 *ext_csd, int idx, __u32 value)
+{
+	ext_csd[idx] = value & 0xff;
+	ext_csd[idx + 1] = (value >> 8) & 0xff;
+	ext_csd[idx + 2] = (value >> 16) & 0xff;
+}
+
+/* The registers 'layout apply' programs, PARTITION_SETTING_COMPLETED aside */
+static const __u8 layout_regs[] = {
+	EXT_CSD_ERASE_GROUP_DEF,
+	EXT_CSD_GP_SIZE_MULT_1_0, EXT_CSD_GP_SIZE_MULT_1_1,
+	EXT_CSD_GP_SIZE_MULT_1_2, EXT_CSD_GP_SIZE_MULT_2_0,
+	EXT_CSD_GP_SIZE_MULT_2_1, EXT_CSD_GP_SIZE_MULT_2_2,
+	EXT_CSD_GP_SIZE_MULT_3_0, EXT_CSD_GP_SIZE_MULT_3_1,
+	EXT_CSD_GP_SIZE_MULT_3_2, EXT_CSD_GP_SIZE_MULT_4_0,
+	EXT_CSD_GP_SIZE_MULT_4_1, EXT_CSD_GP_SIZE_MULT_4_2,
+	EXT_CSD_ENH_START_ADDR_0, EXT_CSD_ENH_START_ADDR_1,
+	EXT_CSD_ENH_START_ADDR_2, EXT_CSD_ENH_START_ADDR_3,
+	EXT_CSD_ENH_SIZE_MULT_0, EXT_CSD_ENH_SIZE_MULT_1,
+	EXT_CSD_ENH_SIZE_MULT_2,
+	EXT_CSD_PARTITIONS_ATTRIBUTE,
+	EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0,
+	EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_1,
+	EXT_CSD_WR_REL_SET,
+};
+
+/*
+ * Computes the registers for @l into @target, a copy of the card's current
+ * @ext_csd, rounding sizes to the write protect group the way 'gp create'
+ * and 'enh_area set' do. Returns 1 if the card can't take the layout.
+ */
+static int layout_registers(const char *device, __u8 *ext_csd,
+			    const struct layout *l, __u8 *target)
+{
+	unsigned long align, gp_total = 0, user_kib;
+	__u32 mult, start;
+	__u8 support = ext_csd[EXT_CSD_PARTITIONING_SUPPORT];
+	int i;
+
+	align = 512l * get_hc_wp_grp_size(ext_csd) * get_hc_erase_grp_size(ext_csd);
+	if (!align) {
+		fprintf(stderr, "%s reports no high capacity write protect "
+			"group size\n", device);
+		return 1;
+	}
+
+	memcpy(target, ext_csd, 512);
+	target[EXT_CSD_ERASE_GROUP_DEF] = 1;
+	target[EXT_CSD_PARTITIONS_ATTRIBUTE] = 0;
+	target[EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0] = 0;
+	target[EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_1] = 0;
+
+	for (i = 0; i < 4; i++) {
+		mult = (l->gp_kib[i] + align / 2) / align;
+		if (l->gp_kib[i] && !mult) {
+			fprintf(stderr, "gp%d: %lu KiB is below the %lu KiB "
+				"write protect group\n", i + 1, l->gp_kib[i],
+				align);
+			return 1;
+		}
+		if (mult && !(support & EXT_CSD_PARTITIONING_EN)) {
+			fprintf(stderr, "%s does not support general purpose "
+				"partitions\n", device);
+			return 1;
+		}
+		if (mult > 0xffffff) {
+			fprintf(stderr, "gp%d: %lu KiB is too large\n", i + 1,
+				l->gp_kib[i]);
+			return 1;
+		}
+		if (mult * align != l->gp_kib[i])
+			printf("gp%d: %lu KiB rounded to %lu KiB\n", i + 1,
+			       l->gp_kib[i], mult * align);
+		set_reg24(target, EXT_CSD_GP_SIZE_MULT_1_0 + i * 3, mult);
+		gp_total += mult * align;
+
+		if (l->gp_enh[i])
+			target[EXT_CSD_PARTITIONS_ATTRIBUTE] |= 1 << (i + 1);
+		target[EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0 + i / 2] |=
+			l->gp_ext[i] << (4 * (i % 2));
+	}
+
+	/* The enhanced user area is aligned like its size */
+	start = 0;
+	mult = (l->enh_size_kib + align / 2) / align;
+	if (l->enh_user) {
+		if (!mult) {
+			fprintf(stderr, "user: enhanced size %lu KiB is below "
+				"the %lu KiB write protect group\n",
+				l->enh_size_kib, align);
+			return 1;
+		}
+		if (l->enh_start_kib % align)
+			printf("user: enhanced start %lu KiB rounded down to "
+			       "%lu KiB\n", l->enh_start_kib,
+			       l->enh_start_kib / align * align);
+		if (mult * align != l->enh_size_kib)
+			printf("user: enhanced size %lu KiB rounded to %lu KiB\n",
+			       l->enh_size_kib, mult * align);
+		start = l->enh_start_kib / align * align;
+		user_kib = get_sector_count(ext_csd) / 2 - gp_total;
+		if (start + mult * align > user_kib) {
+			fprintf(stderr, "user: enhanced area ends past the "
+				"%lu KiB user area\n", user_kib);
+			return 1;
+		}
+		target[EXT_CSD_PARTITIONS_ATTRIBUTE] |= EXT_CSD_ENH_USR;
+		/* In sectors on block addressed cards, in bytes otherwise */
+		start *= is_blockaddresed(ext_csd) ? 2 : 1024;
+	} else {
+		mult = 0;
+	}
+	set_reg24(target, EXT_CSD_ENH_SIZE_MULT_0, mult);
+	target[EXT_CSD_ENH_START_ADDR_0] = start & 0xff;
+	target[EXT_CSD_ENH_START_ADDR_1] = (start >> 8) & 0xff;
+	target[EXT_CSD_ENH_START_ADDR_2] = (start >> 16) & 0xff;
+	target[EXT_CSD_ENH_START_ADDR_3] = (start >> 24) & 0xff;
+
+	if (target[EXT_CSD_PARTITIONS_ATTRIBUTE] &&
+	    !(support & EXT_CSD_ENH_ATTRIBUTE_EN)) {
+		fprintf(stderr, "%s does not support enhanced areas\n", device);
+		return 1;
+	}
+	if ((target[EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0] ||
+	     target[EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_1]) &&
+	    !(support & EXT_CSD_EXT_ATTRIBUTE_EN)) {
+		fprintf(stderr, "%s does not support extended partition "
+			"attributes\n", device);
+		return 1;
+	}
+
+	if (ext_csd[EXT_CSD_WR_REL_PARAM] & HS_CTRL_REL) {
+		target[EXT_CSD_WR_REL_SET] = l->wr_rel;
+	} else if (l->wr_rel != ext_csd[EXT_CSD_WR_REL_SET]) {
+		fprintf(stderr, "%s: WR_REL_SET is read-only (0x%02x)\n",
+			device, ext_csd[EXT_CSD_WR_REL_SET]);
+		return 1;
+	}
+
+	return check_enhanced_area_total_limit(device, target);
+}
+
+int do_layout_apply(int nargs, char **argv)
+{
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	__u8 ext_csd[512], target[512];
+	struct mmc_dev *dev;
+	struct layout layout;
+	char *file, *device;
+	bool yes = false;
+	unsigned int i, n = 0;
+	int opt, ret;
+	FILE *f;
+
+	while ((opt = getopt(nargs, argv, "y")) != -1) {
+		switch (opt) {
+		case 'y':
+			yes = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 2)
+		goto usage;
+	file = argv[optind];
+	device = argv[optind + 1];
+
+	f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	if (!f) {
+		perror(file);
 		exit(1);
 	}
+	ret = layout_parse(f, file, &layout);
+	if (f != stdin)
+		fclose(f);
+	if (ret)
+		exit(1);
 
-	device = argv[1];
+	dev = open_dev(device);
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED]) {
+		fprintf(stderr, "%s is already partitioned\n", device);
+		exit(1);
+	}
+
+	if (layout_registers(device, ext_csd, &layout, target))
+		exit(1);
+
+	printf("%s EXT_CSD changes:\n", yes ? "Applying" : "Would apply");
+	for (i = 0; i < sizeof(layout_regs); i++)
+		if (target[layout_regs[i]] != ext_csd[layout_regs[i]])
+			printf("  [%3d] 0x%02x -> 0x%02x\n", layout_regs[i],
+			       ext_csd[layout_regs[i]], target[layout_regs[i]]);
+	printf("  [%3d] PARTITION_SETTING_COMPLETED -> 0x01\n",
+	       EXT_CSD_PARTITION_SETTING_COMPLETED);
+
+	if (!yes) {
+		printf("Dry run, pass -y to program the layout. "
+		       "NOTE! This is a one-time programmable change.\n");
+		close_dev(dev);
+		return 0;
+	}
+
+	/*
+	 * The switches and a final status go in one transaction. The kernel
+	 * carries on after a rejected switch, so PARTITION_SETTING_COMPLETED,
+	 * which cannot be undone, is only written once the responses and the
+	 * EXT_CSD read back show that every register took its value.
+	 */
+	multi_cmd = calloc(1, sizeof(*multi_cmd) +
+			   (sizeof(layout_regs) + 1) * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < sizeof(layout_regs); i++) {
+		__u8 idx = layout_regs[i];
+
+		if (target[idx] == ext_csd[idx] && idx != EXT_CSD_ERASE_GROUP_DEF)
+			continue;
+		mmc_fill_switch_cmd(&multi_cmd->cmds[n], idx, target[idx]);
+		multi_cmd->cmds[n++].cmd_timeout_ms =
+			mmc_switch_timeout(ext_csd, idx, target[idx]);
+	}
+	multi_cmd->cmds[n].opcode = MMC_SEND_STATUS;
+	multi_cmd->cmds[n].arg = 1 << 16;
+	multi_cmd->cmds[n++].flags = MMC_RSP_R1 | MMC_CMD_AC;
+	multi_cmd->num_of_cmds = n;
+
+	ret = mmc_multi_cmd(dev, multi_cmd);
+	if (ret) {
+		fprintf(stderr, "Layout multi-cmd ioctl failed on %s: %s\n",
+			device, strerror(-ret));
+		exit(1);
+	}
+
+	/* A switch error shows in the status after the failing switch */
+	for (i = 1; i < n; i++) {
+		if (multi_cmd->cmds[i].response[0] & R1_SWITCH_ERROR) {
+			fprintf(stderr, "Switch of EXT_CSD[%d] failed on %s, "
+				"PARTITION_SETTING_COMPLETED not set\n",
+				(multi_cmd->cmds[i - 1].arg >> 16) & 0xff,
+				device);
+			exit(1);
+		}
+	}
+	free(multi_cmd);
+
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	for (i = 0; i < sizeof(layout_regs); i++) {
+		if (ext_csd[layout_regs[i]] != target[layout_regs[i]]) {
+			fprintf(stderr, "EXT_CSD[%d] reads 0x%02x, expected "
+				"0x%02x\n", layout_regs[i],
+				ext_csd[layout_regs[i]], target[layout_regs[i]]);
+			ret = 1;
+		}
+	}
+	if (ret) {
+		fprintf(stderr, "PARTITION_SETTING_COMPLETED not set, the "
+			"registers revert on power cycle\n");
+		exit(1);
+	}
+
+	fprintf(stderr, "setting OTP PARTITION_SETTING_COMPLETED!\n");
+	ret = write_extcsd_value(dev, EXT_CSD_PARTITION_SETTING_COMPLETED, 1, 0);
+	if (ret) {
+		fprintf(stderr, "Could not write 0x01 to EXT_CSD[%d] in %s\n",
+			EXT_CSD_PARTITION_SETTING_COMPLETED, device);
 		exit(1);
 	}
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
 	}
+	if (!ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED]) {
+		fprintf(stderr, "PARTITION_SETTING_COMPLETED is not set\n");
+		exit(1);
+	}
+
+	printf("Layout applied and verified on %s.\n"
+	       "Device power cycle needed for settings to take effect.\n",
+	       device);
+
+	close_dev(dev);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc layout apply [-y] <file>|- </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/* Writes @l in the syntax layout_parse() reads */
+static void layout_print(FILE *f, const struct layout *l)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!l->gp_kib[i])
+			continue;
+		fprintf(f, "gp%d size=%lu%s", i + 1, l->gp_kib[i],
+			l->gp_enh[i] ? " enhanced" : "");
+		if (l->gp_ext[i])
+			fprintf(f, " ext=%u", l->gp_ext[i]);
+		fprintf(f, "%s\n", l->wr_rel & (1 << (i + 1)) ? " reliable" : "");
+	}
+
+	if (l->enh_user || (l->wr_rel & 1)) {
+		fprintf(f, "user");
+		if (l->enh_user)
+			fprintf(f, " enhanced start=%lu size=%lu",
+				l->enh_start_kib, l->enh_size_kib);
+		fprintf(f, "%s\n", l->wr_rel & 1 ? " reliable" : "");
+	}
+}
+
+int do_layout_plan(int nargs, char **argv)
+{
+	__u8 ext_csd[512], target[512];
+	struct layout req, plan;
+	unsigned long align, total_kib, max_enh_kib, enh_kib, cost_kib;
+	unsigned long *sizes[5], *planned[5], slack = 0;
+	bool enhanced[5];
+	char *file, *dump = NULL, *out = NULL, *name;
+	const char *area[5] = { "gp1", "gp2", "gp3", "gp4", "user (enhanced)" };
+	double ratio;
+	long diff;
+	int opt, ret, i;
+	FILE *f;
+
+	while ((opt = getopt(nargs, argv, "e:o:")) != -1) {
+		switch (opt) {
+		case 'e':
+			dump = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != (dump ? 1 : 2))
+		goto usage;
+	file = argv[optind];
+
+	f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	if (!f) {
+		perror(file);
+		exit(1);
+	}
+	ret = layout_parse(f, file, &req);
+	if (f != stdin)
+		fclose(f);
+	if (ret)
+		exit(1);
+
+	if (dump) {
+		name = dump;
+		ret = load_extcsd_dump(dump, ext_csd);
+		if (ret) {
+			fprintf(stderr, "Could not load EXT_CSD from %s: %s\n",
+				dump, strerror(-ret));
+			exit(1);
+		}
+	} else {
+		struct mmc_dev *dev;
+
+		name = argv[optind + 1];
+		dev = open_dev(name);
+		ret = read_extcsd(dev, ext_csd);
+		if (ret) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", name);
+			exit(1);
+		}
+		close_dev(dev);
+	}
+
+	align = 512l * get_hc_wp_grp_size(ext_csd) * get_hc_erase_grp_size(ext_csd);
+	if (!align) {
+		fprintf(stderr, "%s reports no high capacity write protect "
+			"group size\n", name);
+		exit(1);
+	}
+	total_kib = get_sector_count(ext_csd) / 2;
+	max_enh_kib = align * ((ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_2] << 16) |
+			       (ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_1] << 8) |
+			       ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_0]);
+
+	plan = req;
+	for (i = 0; i < 4; i++) {
+		sizes[i] = &req.gp_kib[i];
+		planned[i] = &plan.gp_kib[i];
+		enhanced[i] = req.gp_enh[i];
+	}
+	sizes[4] = &req.enh_size_kib;
+	planned[4] = &plan.enh_size_kib;
+	enhanced[4] = req.enh_user;
+	plan.enh_start_kib = req.enh_start_kib / align * align;
+
+	/* Never smaller than asked for */
+	for (i = 0; i < 5; i++)
+		*planned[i] = (*sizes[i] + align - 1) / align * align;
+
+	/*
+	 * If that overflows the enhanced limit, give back the largest round
+	 * ups of enhanced areas first, down to the group below the request.
+	 */
+	for (;;) {
+		int best = -1;
+
+		for (enh_kib = 0, i = 0; i < 5; i++)
+			if (enhanced[i])
+				enh_kib += *planned[i];
+		if (enh_kib <= max_enh_kib)
+			break;
+
+		for (i = 0; i < 5; i++)
+			if (enhanced[i] && *planned[i] > *sizes[i] &&
+			    *planned[i] > align &&
+			    (best < 0 || *planned[i] - *sizes[i] >
+					 *planned[best] - *sizes[best]))
+				best = i;
+		if (best < 0) {
+			fprintf(stderr, "The enhanced areas need %lu KiB, "
+				"%s allows %lu KiB\n", enh_kib, name,
+				max_enh_kib);
+			exit(1);
+		}
+		*planned[best] -= align;
+	}
+
+	printf("Alignment unit (HC_WP_GRP_SIZE x HC_ERASE_GRP_SIZE): %lu KiB\n\n",
+	       align);
+	printf("%-16s %14s %14s %10s %12s\n", "area", "requested KiB",
+	       "planned KiB", "units", "slack KiB");
+	for (i = 0; i < 5; i++) {
+		if (!*sizes[i])
+			continue;
+		diff = *planned[i] - *sizes[i];
+		printf("%-16s %14lu %14lu %10lu %12ld%s\n", area[i], *sizes[i],
+		       *planned[i], *planned[i] / align, diff,
+		       enhanced[i] && i < 4 ? "  enhanced" : "");
+		if (diff > 0)
+			slack += diff;
+	}
+	if (req.enh_user && plan.enh_start_kib != req.enh_start_kib)
+		printf("enhanced user area start %lu KiB aligned down to %lu KiB\n",
+		       req.enh_start_kib, plan.enh_start_kib);
+
+	/*
+	 * Enhanced (typically SLC) areas take more of the raw flash: with all of
+	 * it enhanced the card would hold MAX_ENH_SIZE_MULT, so each enhanced
+	 * KiB costs capacity / max enhanced KiB of normal capacity.
+	 */
+	ratio = max_enh_kib ? (double)total_kib / max_enh_kib : 0;
+	cost_kib = 0;
+	for (i = 0; i < 5; i++)
+		if (enhanced[i])
+			cost_kib += (unsigned long)(*planned[i] * (ratio - 1));
+
+	printf("\nSlack lost to alignment: %lu KiB\n", slack);
+	printf("Enhanced areas: %lu KiB of at most %lu KiB\n", enh_kib,
+	       max_enh_kib);
+	if (enh_kib) {
+		unsigned long used_kib = cost_kib;
+
+		for (i = 0; i < 4; i++)
+			used_kib += plan.gp_kib[i];
+		printf("Enhanced capacity cost: x%.2f, %lu KiB of normal capacity\n",
+		       ratio, cost_kib);
+		printf("Expected user area: about %lu KiB of %lu KiB\n",
+		       used_kib < total_kib ? total_kib - used_kib : 0,
+		       total_kib);
+	}
+
+	printf("\nValidating the planned layout against %s:\n", name);
+	if (layout_registers(name, ext_csd, &plan, target))
+		exit(1);
+
+	printf("\nPlanned layout:\n");
+	layout_print(stdout, &plan);
+	if (out) {
+		f = fopen(out, "w");
+		if (!f) {
+			perror(out);
+			exit(1);
+		}
+		fprintf(f, "# planned by mmc layout plan for %s\n", name);
+		layout_print(f, &plan);
+		fclose(f);
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc layout plan [-o <out file>] <file>|- </path/to/mmcblkX>\n"
+		"       mmc layout plan [-o <out file>] -e <ext_csd dump> <file>|-\n");
+	exit(1);
+}
+
+int do_read_extcsd(int nargs, char **argv)
+{
+	__u8 ext_csd[512], ext_csd_rev, reg;
+	__u32 regl;
+	struct mmc_dev *dev;
+	int ret = 0, opt;
+	char *device;
+	const char *str;
+	bool cached = false;
+
+	while ((opt = getopt(nargs, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c':
+			cached = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 1)
+		goto usage;
+
+	device = argv[optind];
+
+	if (!cached || read_extcsd_debugfs(device, ext_csd)) {
+		if (cached)
+			fprintf(stderr, "EXT_CSD not available in debugfs, reading it from %s\n",
+				device);
+
+		dev = open_dev(device);
+
+		ret = read_extcsd(dev, ext_csd);
+		if (ret) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+			exit(1);
+		}
+	}
 
 	ext_csd_rev = ext_csd[EXT_CSD_REV];
 
@@ -2004,11 +3468,92 @@ int do_read_extcsd(int nargs, char **argv)
 	}
 out_free:
 	return ret;
+
+usage:
+	fprintf(stderr, "Usage: mmc extcsd read [-c] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+static void print_life_time(const char *what, unsigned int est)
+{
+	printf("%s: 0x%02x", what, est);
+	if (est >= 0x01 && est <= 0x0a)
+		printf(" (%u%%-%u%% device life time used)\n",
+		       (est - 1) * 10, est * 10);
+	else if (est == 0x0b)
+		printf(" (exceeded its maximum estimated device life time)\n");
+	else
+		printf(" (not defined)\n");
+}
+
+int do_health_get(int nargs, char **argv)
+{
+	static const char *pre_eol[] = {
+		"not defined", "normal", "warning, 80% of reserved blocks consumed",
+		"urgent, 90% of reserved blocks consumed",
+	};
+	char dir[PATH_MAX], life[32], eol[16], fwrev[40];
+	unsigned int est_a, est_b, eol_info;
+	__u8 ext_csd[512];
+	char *device;
+	struct mmc_dev *dev;
+	int i;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc health get </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[1];
+
+	/*
+	 * The kernel caches these from EXT_CSD at card init, so reading them
+	 * from sysfs does not touch the bus.
+	 */
+	if (!card_sysfs_dir(device, dir, sizeof(dir)) &&
+	    read_sysfs_attr(dir, "life_time", life, sizeof(life)) &&
+	    sscanf(life, "%x %x", &est_a, &est_b) == 2 &&
+	    read_sysfs_attr(dir, "pre_eol_info", eol, sizeof(eol)) &&
+	    sscanf(eol, "%x", &eol_info) == 1) {
+		if (!read_sysfs_attr(dir, "fwrev", fwrev, sizeof(fwrev)))
+			snprintf(fwrev, sizeof(fwrev), "unknown");
+		printf("Source: %s\n", dir);
+	} else {
+		dev = open_dev(device);
+		if (read_extcsd(dev, ext_csd)) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+			exit(1);
+		}
+		close_dev(dev);
+
+		if (ext_csd[EXT_CSD_REV] < 7) {
+			fprintf(stderr, "Health information needs eMMC 5.0 or newer\n");
+			exit(1);
+		}
+
+		est_a = ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A];
+		est_b = ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B];
+		eol_info = ext_csd[EXT_CSD_PRE_EOL_INFO];
+		/* Same format as the kernel's fwrev attribute */
+		strcpy(fwrev, "0x");
+		for (i = 0; i < 8; i++)
+			sprintf(fwrev + 2 + i * 2, "%02x",
+				ext_csd[EXT_CSD_FIRMWARE_VERSION + i]);
+		printf("Source: EXT_CSD\n");
+	}
+
+	print_life_time("Life Time Estimation A", est_a);
+	print_life_time("Life Time Estimation B", est_b);
+	printf("Pre EOL information: 0x%02x (%s)\n", eol_info,
+	       eol_info < 4 ? pre_eol[eol_info] : "reserved");
+	printf("Firmware Version: %s\n", fwrev);
+
+	return 0;
 }
 
 int do_write_extcsd(int nargs, char **argv)
 {
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	int offset, value;
 	char *device;
 
@@ -2021,13 +3566,9 @@ int do_write_extcsd(int nargs, char **argv)
 	value  = strtol(argv[2], NULL, 0);
 	device = argv[3];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = write_extcsd_value(fd, offset, value, 0);
+	ret = write_extcsd_value(dev, offset, value, 0);
 	if (ret) {
 		fprintf(stderr,
 			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
@@ -2038,190 +3579,247 @@ int do_write_extcsd(int nargs, char **argv)
 	return ret;
 }
 
-int do_sanitize(int nargs, char **argv)
+/*
+ * Polls the card with SEND_STATUS every @poll_ms until the operation that was
+ * started at @start, without the kernel waiting for busy, leaves the
+ * programming state. If @timeout_ms expires or the user interrupts, the
+ * operation is aborted with HPI. Reports the outcome as @what and returns
+ * -EINTR if the operation was aborted.
+ */
+static int wait_or_hpi(struct mmc_dev *dev, __u8 *ext_csd, const char *device,
+		       const char *what, unsigned int poll_ms,
+		       unsigned int timeout_ms, __u64 start)
 {
-	int fd, ret;
-	char *device;
-	unsigned int timeout = 0;
+	__u32 response = 0;
+	__u64 now, elapsed, last_report = 0, hpi_us = 0;
+	const char *result = "completed";
+	int ret;
 
-	if (nargs != 2 && nargs != 3) {
-		fprintf(stderr, "Usage: mmc sanitize </path/to/mmcblkX> [timeout_in_ms]\n");
-		exit(1);
-	}
+	if (!(ext_csd[EXT_CSD_HPI_MGMT] & EXT_CSD_HPI_EN))
+		fprintf(stderr, "Warning: HPI is not enabled in HPI_MGMT, "
+			"%s may ignore an abort of the %s\n", device, what);
 
-	if (nargs == 3)
-		timeout = strtol(argv[2], NULL, 10);
+	for (;;) {
+		ret = send_status(dev, &response);
+		now = get_time_ns() / 1000;
+		elapsed = now - start;
+		if (ret) {
+			result = "failed";
+			break;
+		}
 
-	device = argv[1];
+		if (R1_CURRENT_STATE(response) != R1_STATE_PRG)
+			break;
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
+		if (abort_requested ||
+		    (timeout_ms && elapsed >= timeout_ms * 1000ull)) {
+			ret = hpi_interrupt(dev, ext_csd, &hpi_us);
+			if (ret == -EOPNOTSUPP)
+				fprintf(stderr, "%s does not support HPI, "
+					"cannot abort %s\n", device, what);
+			result = ret ? "failed" : "aborted by HPI";
+			if (!ret)
+				ret = -EINTR;
+			break;
+		}
+
+		if (now - last_report >= 1000000) {
+			fprintf(stderr, "Waiting for %s on %s: %llu s elapsed\r",
+				what, device, elapsed / 1000000);
+			last_report = now;
+		}
+		usleep(poll_ms * 1000);
 	}
 
-	ret = write_extcsd_value(fd, EXT_CSD_SANITIZE_START, 1, timeout);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			1, EXT_CSD_SANITIZE_START, device);
-		exit(1);
+	if (!ret && (response & (R1_ERROR | R1_CC_ERROR | R1_SWITCH_ERROR))) {
+		fprintf(stderr, "%s status error: 0x%08x\n", what, response);
+		result = "failed";
+		ret = -EIO;
 	}
 
-	close(fd);
-	return ret;
+	if (last_report)
+		fprintf(stderr, "\n");
+	printf("%s: %s %s after %llu.%03llu s", device, what, result,
+	       elapsed / 1000000, (elapsed / 1000) % 1000);
+	if (ret == -EINTR)
+		printf(", HPI latency %llu us", hpi_us);
+	printf("\n");
 
+	return ret;
 }
 
-#define DO_IO(func, fd, buf, nbyte)					\
-	({												\
-		ssize_t ret = 0, r;							\
-		do {										\
-			r = func(fd, buf + ret, nbyte - ret);	\
-			if (r < 0 && errno != EINTR) {			\
-				ret = -1;							\
-				break;								\
-			}										\
-			else if (r > 0)							\
-				ret += r;							\
-		} while (r != 0 && (size_t)ret < nbyte);	\
-													\
-		ret;										\
-	})
+/*
+ * Starts a sanitize without letting the kernel wait for busy, then waits for
+ * it with wait_or_hpi().
+ */
+static int sanitize_poll(struct mmc_dev *dev, const char *device,
+			 unsigned int poll_ms, unsigned int timeout_ms)
+{
+	struct mmc_ioc_cmd idata = {};
+	__u8 ext_csd[512];
+	__u64 start;
+	int ret;
 
-#define RPMB_MULTI_CMD_MAX_CMDS 3
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		return ret;
+	}
 
-enum rpmb_op_type {
-	MMC_RPMB_WRITE_KEY = 0x01,
-	MMC_RPMB_READ_CNT  = 0x02,
-	MMC_RPMB_WRITE     = 0x03,
-	MMC_RPMB_READ      = 0x04,
+	if (!timeout_ms)
+		timeout_ms = mmc_switch_timeout(ext_csd, EXT_CSD_SANITIZE_START, 1);
 
-	/* For internal usage only, do not use it directly */
-	MMC_RPMB_READ_RESP = 0x05
-};
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
 
-struct rpmb_frame {
-	u_int8_t  stuff[196];
-	u_int8_t  key_mac[32];
-	u_int8_t  data[256];
-	u_int8_t  nonce[16];
-	u_int32_t write_counter;
-	u_int16_t addr;
-	u_int16_t block_count;
-	u_int16_t result;
-	u_int16_t req_resp;
-};
+	mmc_fill_switch_cmd(&idata, EXT_CSD_SANITIZE_START, 1);
+	/* The card is polled for busy below, don't wait for it in the kernel */
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
 
-static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
-				  int write_flag, unsigned int blocks,
-				  __u32 arg)
-{
-	ioc->opcode = opcode;
-	ioc->write_flag = write_flag;
-	ioc->arg = arg;
-	ioc->blksz = 512;
-	ioc->blocks = blocks;
-	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	start = get_time_ns() / 1000;
+	ret = mmc_cmd(dev, &idata);
+	if (ret) {
+		perror("ioctl");
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			1, EXT_CSD_SANITIZE_START, device);
+		return ret;
+	}
+
+	return wait_or_hpi(dev, ext_csd, device, "sanitize", poll_ms,
+			   timeout_ms, start);
 }
 
-/* Performs RPMB operation.
- *
- * @fd: RPMB device on which we should perform ioctl command
- * @frame_in: input RPMB frame, should be properly inited
- * @frame_out: output (result) RPMB frame. Caller is responsible for checking
- *             result and req_resp for output frame.
- * @out_cnt: count of outer frames. Used only for multiple blocks reading,
- *           in the other cases -EINVAL will be returned.
- */
-static int do_rpmb_op(int fd,
-					  const struct rpmb_frame *frame_in,
-					  struct rpmb_frame *frame_out,
-					  unsigned int out_cnt)
+int do_sanitize(int nargs, char **argv)
 {
-	int err;
-	u_int16_t rpmb_type;
-	struct mmc_ioc_multi_cmd *mioc;
-	struct mmc_ioc_cmd *ioc;
-	struct rpmb_frame frame_status;
+	struct mmc_dev *dev;
+	int ret, opt;
+	char *device;
+	unsigned int timeout = 0, poll_ms = 0;
+
+	while ((opt = getopt(nargs, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			poll_ms = strtoul(optarg, NULL, 10);
+			if (!poll_ms) {
+				fprintf(stderr, "Invalid poll interval: %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
 
-	memset(&frame_status, 0, sizeof(frame_status));
+	if (nargs - optind != 1 && nargs - optind != 2)
+		goto usage;
 
-	if (!frame_in || !frame_out || !out_cnt)
-		return -EINVAL;
+	device = argv[optind];
+	if (nargs - optind == 2)
+		timeout = strtol(argv[optind + 1], NULL, 10);
 
-	/* prepare arguments for MMC_IOC_MULTI_CMD ioctl */
-	mioc = (struct mmc_ioc_multi_cmd *)
-		calloc(1, sizeof (struct mmc_ioc_multi_cmd) +
-		       RPMB_MULTI_CMD_MAX_CMDS * sizeof (struct mmc_ioc_cmd));
-	if (!mioc) {
-		return -ENOMEM;
+	dev = open_dev(device);
+
+	if (poll_ms) {
+		ret = sanitize_poll(dev, device, poll_ms, timeout);
+		if (ret)
+			exit(1);
+		close_dev(dev);
+		return ret;
 	}
 
-	rpmb_type = be16toh(frame_in->req_resp);
+	ret = write_extcsd_value(dev, EXT_CSD_SANITIZE_START, 1, timeout);
+	if (ret) {
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			1, EXT_CSD_SANITIZE_START, device);
+		exit(1);
+	}
 
-	switch(rpmb_type) {
-	case MMC_RPMB_WRITE:
-	case MMC_RPMB_WRITE_KEY:
-		if (out_cnt != 1) {
-			err = -EINVAL;
-			goto out;
-		}
+	close_dev(dev);
+	return ret;
 
-		mioc->num_of_cmds = 3;
+usage:
+	fprintf(stderr, "Usage: mmc sanitize [-p <poll_ms>] </path/to/mmcblkX> [timeout_in_ms]\n");
+	exit(1);
+}
 
-		/* Write request */
-		ioc = &mioc->cmds[0];
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1, 1, 0);
-		mmc_ioc_cmd_set_data((*ioc), frame_in);
+int do_hpi(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	struct mmc_dev *dev;
+	__u32 response;
+	__u64 latency_us;
+	char *device;
+	bool busy;
+	int ret;
 
-		/* Result request */
-		ioc = &mioc->cmds[1];
-		frame_status.req_resp = htobe16(MMC_RPMB_READ_RESP);
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1, 0);
-		mmc_ioc_cmd_set_data((*ioc), &frame_status);
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc hpi </path/to/mmcblkX>\n");
+		exit(1);
+	}
 
-		/* Get response */
-		ioc = &mioc->cmds[2];
-		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, 1, 0);
-		mmc_ioc_cmd_set_data((*ioc), frame_out);
+	device = argv[1];
 
-		break;
-	case MMC_RPMB_READ_CNT:
-		if (out_cnt != 1) {
-			err = -EINVAL;
-			goto out;
-		}
-		/* fall through */
+	dev = open_dev(device);
 
-	case MMC_RPMB_READ:
-		mioc->num_of_cmds = 2;
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
 
-		/* Read request */
-		ioc = &mioc->cmds[0];
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1, 0);
-		mmc_ioc_cmd_set_data((*ioc), frame_in);
+	if (!(ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_SUPP)) {
+		fprintf(stderr, "%s does not support HPI\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_HPI_MGMT] & EXT_CSD_HPI_EN))
+		fprintf(stderr, "Warning: HPI is not enabled in HPI_MGMT, "
+			"%s may ignore it\n", device);
 
-		/* Get response */
-		ioc = &mioc->cmds[1];
-		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, out_cnt, 0);
-		mmc_ioc_cmd_set_data((*ioc), frame_out);
+	ret = send_status(dev, &response);
+	if (ret) {
+		fprintf(stderr, "Could not read response to SEND_STATUS from %s\n",
+			device);
+		exit(1);
+	}
+	busy = R1_CURRENT_STATE(response) == R1_STATE_PRG;
 
-		break;
-	default:
-		err = -EINVAL;
-		goto out;
+	ret = hpi_interrupt(dev, ext_csd, &latency_us);
+	if (ret) {
+		fprintf(stderr, "HPI failed on %s\n", device);
+		exit(1);
 	}
 
-	err = ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	printf("%s: HPI (%s) sent while %s, card ready after %llu us "
+	       "(OUT_OF_INTERRUPT_TIME %u ms)\n", device,
+	       ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_IMPL ? "CMD12" : "CMD13",
+	       busy ? "busy" : "idle", latency_us,
+	       ext_csd[EXT_CSD_OUT_OF_INTERRUPT_TIME] * 10);
 
-out:
-	free(mioc);
-	return err;
+	close_dev(dev);
+	return ret;
 }
 
+#define DO_IO(func, fd, buf, nbyte)					\
+	({												\
+		ssize_t ret = 0, r;							\
+		do {										\
+			r = func(fd, buf + ret, nbyte - ret);	\
+			if (r < 0 && errno != EINTR) {			\
+				ret = -1;							\
+				break;								\
+			}										\
+			else if (r > 0)							\
+				ret += r;							\
+		} while (r != 0 && (size_t)ret < nbyte);	\
+													\
+		ret;										\
+	})
+
 int do_rpmb_write_key(int nargs, char **argv)
 {
-	int ret, dev_fd, key_fd;
+	struct mmc_dev *dev;
+	int ret, key_fd;
 	struct rpmb_frame frame_in = {
 		.req_resp = htobe16(MMC_RPMB_WRITE_KEY)
 	}, frame_out;
@@ -2231,11 +3829,7 @@ int do_rpmb_write_key(int nargs, char **argv)
 		exit(1);
 	}
 
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
+	dev = open_dev(argv[1]);
 
 	if (0 == strcmp(argv[2], "-"))
 		key_fd = STDIN_FILENO;
@@ -2260,9 +3854,9 @@ int do_rpmb_write_key(int nargs, char **argv)
 	}
 
 	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
+	ret = mmc_rpmb_op(dev, &frame_in, &frame_out, 1);
 	if (ret != 0) {
-		perror("RPMB ioctl failed");
+		fprintf(stderr, "RPMB ioctl failed: %s\n", strerror(-ret));
 		exit(1);
 	}
 
@@ -2273,41 +3867,30 @@ int do_rpmb_write_key(int nargs, char **argv)
 		exit(1);
 	}
 
-	close(dev_fd);
+	close_dev(dev);
 	if (key_fd != STDIN_FILENO)
 		close(key_fd);
 
 	return ret;
 }
 
-static int rpmb_read_counter(int dev_fd, unsigned int *cnt)
+static int rpmb_read_counter(struct mmc_dev *dev, unsigned int *cnt)
 {
 	int ret;
-	struct rpmb_frame frame_in = {
-		.req_resp = htobe16(MMC_RPMB_READ_CNT)
-	}, frame_out;
 
-	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
-	if (ret != 0) {
-		perror("RPMB ioctl failed");
+	ret = mmc_rpmb_read_counter(dev, cnt);
+	if (ret < 0) {
+		fprintf(stderr, "RPMB ioctl failed: %s\n", strerror(-ret));
 		exit(1);
 	}
 
-	/* Check RPMB response */
-	if (frame_out.result != 0) {
-		*cnt = 0;
-		return be16toh(frame_out.result);
-	}
-
-	*cnt = be32toh(frame_out.write_counter);
-
-	return 0;
+	return ret;
 }
 
 int do_rpmb_read_counter(int nargs, char **argv)
 {
-	int ret, dev_fd;
+	struct mmc_dev *dev;
+	int ret;
 	unsigned int cnt;
 
 	if (nargs != 2) {
@@ -2315,13 +3898,9 @@ int do_rpmb_read_counter(int nargs, char **argv)
 		exit(1);
 	}
 
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
+	dev = open_dev(argv[1]);
 
-	ret = rpmb_read_counter(dev_fd, &cnt);
+	ret = rpmb_read_counter(dev, &cnt);
 
 	/* Check RPMB response */
 	if (ret != 0) {
@@ -2329,7 +3908,7 @@ int do_rpmb_read_counter(int nargs, char **argv)
 		exit(1);
 	}
 
-	close(dev_fd);
+	close_dev(dev);
 
 	printf("Counter value: 0x%08x\n", cnt);
 
@@ -2338,7 +3917,8 @@ int do_rpmb_read_counter(int nargs, char **argv)
 
 int do_rpmb_read_block(int nargs, char **argv)
 {
-	int i, ret, dev_fd, data_fd, key_fd = -1;
+	struct mmc_dev *dev;
+	int i, ret, data_fd, key_fd = -1;
 	uint16_t addr;
 	/*
 	 * for reading RPMB, number of blocks is set by CMD23 only, the packet
@@ -2355,11 +3935,7 @@ int do_rpmb_read_block(int nargs, char **argv)
 		exit(1);
 	}
 
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
+	dev = open_dev(argv[1]);
 
 	/* Get block address */
 	errno = 0;
@@ -2426,9 +4002,9 @@ int do_rpmb_read_block(int nargs, char **argv)
 	}
 
 	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, frame_out_p, blocks_cnt);
+	ret = mmc_rpmb_op(dev, &frame_in, frame_out_p, blocks_cnt);
 	if (ret != 0) {
-		perror("RPMB ioctl failed");
+		fprintf(stderr, "RPMB ioctl failed: %s\n", strerror(-ret));
 		exit(1);
 	}
 
@@ -2481,7 +4057,7 @@ int do_rpmb_read_block(int nargs, char **argv)
 	}
 
 	free(frame_out_p);
-	close(dev_fd);
+	close_dev(dev);
 	if (data_fd != STDOUT_FILENO)
 		close(data_fd);
 	if (key_fd != -1 && key_fd != STDIN_FILENO)
@@ -2492,7 +4068,8 @@ int do_rpmb_read_block(int nargs, char **argv)
 
 int do_rpmb_write_block(int nargs, char **argv)
 {
-	int ret, dev_fd, key_fd, data_fd;
+	struct mmc_dev *dev;
+	int ret, key_fd, data_fd;
 	unsigned char key[32];
 	uint16_t addr;
 	unsigned int cnt;
@@ -2506,13 +4083,9 @@ int do_rpmb_write_block(int nargs, char **argv)
 		exit(1);
 	}
 
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
+	dev = open_dev(argv[1]);
 
-	ret = rpmb_read_counter(dev_fd, &cnt);
+	ret = rpmb_read_counter(dev, &cnt);
 	/* Check RPMB response */
 	if (ret != 0) {
 		printf("RPMB read counter operation failed, retcode 0x%04x\n", ret);
@@ -2580,9 +4153,9 @@ int do_rpmb_write_block(int nargs, char **argv)
 		frame_in.key_mac, sizeof(frame_in.key_mac));
 
 	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
+	ret = mmc_rpmb_op(dev, &frame_in, &frame_out, 1);
 	if (ret != 0) {
-		perror("RPMB ioctl failed");
+		fprintf(stderr, "RPMB ioctl failed: %s\n", strerror(-ret));
 		exit(1);
 	}
 
@@ -2593,7 +4166,7 @@ int do_rpmb_write_block(int nargs, char **argv)
 		exit(1);
 	}
 
-	close(dev_fd);
+	close_dev(dev);
 	if (data_fd != STDIN_FILENO)
 		close(data_fd);
 	if (key_fd != STDIN_FILENO)
@@ -2605,7 +4178,8 @@ int do_rpmb_write_block(int nargs, char **argv)
 static int do_cache_ctrl(int value, int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
@@ -2615,13 +4189,9 @@ static int do_cache_ctrl(int value, int nargs, char **argv)
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
@@ -2644,7 +4214,7 @@ static int do_cache_ctrl(int value, int nargs, char **argv)
 			device);
 		exit(1);
 	}
-	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value, 0);
+	ret = write_extcsd_value(dev, EXT_CSD_CACHE_CTRL, value, 0);
 	if (ret) {
 		fprintf(stderr,
 			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
@@ -2652,7 +4222,7 @@ static int do_cache_ctrl(int value, int nargs, char **argv)
 		exit(1);
 	}
 
-	close(fd);
+	close_dev(dev);
 	return ret;
 }
 
@@ -2666,497 +4236,781 @@ int do_cache_dis(int nargs, char **argv)
 	return do_cache_ctrl(0, nargs, argv);
 }
 
-static int erase(int dev_fd, __u32 argin, __u32 start, __u32 end)
-{
-	int ret = 0;
-	struct mmc_ioc_multi_cmd *multi_cmd;
-	__u8 ext_csd[512];
+/* Log2 latency histogram, bucket i counts [2^i, 2^(i+1)) us, bucket 0 [0, 2) */
+#define LAT_HIST_BUCKETS	32
 
+struct lat_hist {
+	__u64 count[LAT_HIST_BUCKETS];
+	__u64 n, sum_us, min_us, max_us;
+};
 
-	ret = read_extcsd(dev_fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD\n");
-		exit(1);
-	}
-	if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x01) {
-	  fprintf(stderr, "High Capacity Erase Unit Size=%d bytes\n" \
-                          "High Capacity Erase Timeout=%d ms\n" \
-                          "High Capacity Write Protect Group Size=%d bytes\n",
-		           ext_csd[224]*0x80000,
-		           ext_csd[223]*300,
-                           ext_csd[221]*ext_csd[224]*0x80000);
-	}
+static void lat_hist_add(struct lat_hist *h, __u64 us)
+{
+	unsigned int b = 0;
+
+	while (b < LAT_HIST_BUCKETS - 1 && (us >> (b + 1)))
+		b++;
+	h->count[b]++;
+
+	if (!h->n || us < h->min_us)
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->sum_us += us;
+	h->n++;
+}
 
-	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
-			   3 * sizeof(struct mmc_ioc_cmd));
-	if (!multi_cmd) {
-		perror("Failed to allocate memory");
-		return -ENOMEM;
-	}
+static void lat_hist_print(FILE *fp, const struct lat_hist *h)
+{
+	static const char bar[] = "########################################";
+	unsigned int i, first = LAT_HIST_BUCKETS, last = 0;
+	__u64 peak = 0;
+
+	if (!h->n)
+		return;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		if (!h->count[i])
+			continue;
+		if (first == LAT_HIST_BUCKETS)
+			first = i;
+		last = i;
+		if (h->count[i] > peak)
+			peak = h->count[i];
+	}
+
+	fprintf(fp, "  min %llu us, mean %llu us, max %llu us\n",
+		h->min_us, h->sum_us / h->n, h->max_us);
+	for (i = first; i <= last; i++)
+		fprintf(fp, "  %9llu - %9llu us %8llu %.*s\n",
+			i ? 1ull << i : 0, (1ull << (i + 1)) - 1, h->count[i],
+			(int)((sizeof(bar) - 1) * h->count[i] / peak), bar);
+}
 
-	multi_cmd->num_of_cmds = 3;
-	/* Set erase start address */
-	multi_cmd->cmds[0].opcode = MMC_ERASE_GROUP_START;
-	multi_cmd->cmds[0].arg = start;
-	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-	multi_cmd->cmds[0].write_flag = 1;
-
-	/* Set erase end address */
-	multi_cmd->cmds[1].opcode = MMC_ERASE_GROUP_END;
-	multi_cmd->cmds[1].arg = end;
-	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-	multi_cmd->cmds[1].write_flag = 1;
-
-	/* Send Erase Command */
-	multi_cmd->cmds[2].opcode = MMC_ERASE;
-	multi_cmd->cmds[2].arg = argin;
-	multi_cmd->cmds[2].cmd_timeout_ms = 300*255*255;
-	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-	multi_cmd->cmds[2].write_flag = 1;
-
-	/* send erase cmd with multi-cmd */
-	ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-	if (ret)
-		perror("Erase multi-cmd ioctl");
+static int flush_cache(struct mmc_dev *dev, __u64 *latency_us)
+{
+	__u64 start = get_time_ns() / 1000;
+	int ret;
 
-	/* Does not work for SPI cards */
-	if (multi_cmd->cmds[1].response[0] & R1_ERASE_PARAM) {
-		fprintf(stderr, "Erase start response: 0x%08x\n",
-				multi_cmd->cmds[0].response[0]);
-		ret = -EIO;
-	}
-	if (multi_cmd->cmds[2].response[0] & R1_ERASE_SEQ_ERROR) {
-		fprintf(stderr, "Erase response: 0x%08x\n",
-				multi_cmd->cmds[2].response[0]);
-		ret = -EIO;
-	}
+	ret = write_extcsd_value(dev, EXT_CSD_FLUSH_CACHE, 1, 0);
+	*latency_us = get_time_ns() / 1000 - start;
 
-	free(multi_cmd);
 	return ret;
 }
 
-int do_erase(int nargs, char **argv)
+int do_cache_flush(int nargs, char **argv)
 {
-	int dev_fd, ret;
-	char *print_str;
-	__u8 ext_csd[512], checkup_mask = 0;
-	__u32 arg, start, end;
+	__u8 ext_csd[512];
+	struct mmc_dev *dev;
+	__u64 latency_us;
+	char *device;
+	int ret;
 
-	if (nargs != 5) {
-		fprintf(stderr, "Usage: erase <type> <start addr> <end addr> </path/to/mmcblkX>\n");
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc cache flush </path/to/mmcblkX>\n");
 		exit(1);
 	}
 
-	if (strstr(argv[2], "0x") || strstr(argv[2], "0X"))
-		start = strtol(argv[2], NULL, 16);
-	else
-		start = strtol(argv[2], NULL, 10);
+	device = argv[1];
 
-	if (strstr(argv[3], "0x") || strstr(argv[3], "0X"))
-		end = strtol(argv[3], NULL, 16);
-	else
-		end = strtol(argv[3], NULL, 10);
+	dev = open_dev(device);
 
-	if (end < start) {
-		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
-			start, end);
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
 	}
 
-	if (strcmp(argv[1], "legacy") == 0) {
-		arg = 0x00000000;
-		print_str = "Legacy Erase";
-	} else if (strcmp(argv[1], "discard") == 0) {
-		arg = 0x00000003;
-		print_str = "Discard";
-	} else if (strcmp(argv[1], "secure-erase") == 0) {
-		print_str = "Secure Erase";
-		checkup_mask = EXT_CSD_SEC_ER_EN;
-		arg = 0x80000000;
-	} else if (strcmp(argv[1], "secure-trim1") == 0) {
-		print_str = "Secure Trim Step 1";
-		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x80000001;
-	} else if (strcmp(argv[1], "secure-trim2") == 0) {
-		print_str = "Secure Trim Step 2";
-		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x80008000;
-	} else if (strcmp(argv[1], "trim") == 0) {
-		print_str = "Trim";
-		checkup_mask = EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x00000001;
-	} else {
-		fprintf(stderr, "Unknown erase type: %s\n", argv[1]);
-		exit(1);
+	if (!(ext_csd[EXT_CSD_CACHE_CTRL] & 1)) {
+		printf("The cache is disabled on %s, nothing to flush\n",
+		       device);
+		close_dev(dev);
+		return 0;
 	}
 
-	dev_fd = open(argv[4], O_RDWR);
-	if (dev_fd < 0) {
-		perror(argv[4]);
+	ret = flush_cache(dev, &latency_us);
+	if (ret) {
+		fprintf(stderr, "Could not flush the cache of %s\n", device);
 		exit(1);
 	}
+	printf("%s: cache flushed in %llu us\n", device, latency_us);
 
-	if (checkup_mask) {
-		ret = read_extcsd(dev_fd, ext_csd);
-		if (ret) {
-			fprintf(stderr, "Could not read EXT_CSD from %s\n",
-				argv[4]);
-			goto out;
-		}
-		if ((checkup_mask & ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT]) !=
-								checkup_mask) {
-			fprintf(stderr, "%s is not supported in %s\n",
-				print_str, argv[4]);
-			ret = -ENOTSUP;
-			goto out;
-		}
-
-	}
-	printf("Executing %s from 0x%08x to 0x%08x\n", print_str, start, end);
-
-	ret = erase(dev_fd, arg, start, end);
-out:
-	printf(" %s %s!\n\n", print_str, ret ? "Failed" : "Succeed");
-	close(dev_fd);
+	close_dev(dev);
 	return ret;
 }
 
-static void set_ffu_download_cmd(struct mmc_ioc_multi_cmd *multi_cmd,
-			       __u8 *ext_csd, unsigned int bytes, __u8 *buf,
-			       off_t offset, enum ffu_download_mode ffu_mode)
-{
-	__u32 arg = per_byte_htole32(&ext_csd[EXT_CSD_FFU_ARG_0]);
-
-	/* prepare multi_cmd for FFU based on cmd to be used */
-	if (ffu_mode == FFU_DEFAULT_MODE) {
-		/* put device into ffu mode */
-		fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
-		/* send block count */
-		set_single_cmd(&multi_cmd->cmds[1], MMC_SET_BLOCK_COUNT, 0, 0,
-			       bytes / 512);
-		multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-
-		/*
-		 * send image chunk: blksz and blocks essentially do not matter, as
-		 * long as the product is fw_size, but some hosts don't handle larger
-		 * blksz well.
-		 */
-		set_single_cmd(&multi_cmd->cmds[2], MMC_WRITE_MULTIPLE_BLOCK, 1,
-			       bytes / 512, arg);
-		mmc_ioc_cmd_set_data(multi_cmd->cmds[2], buf + offset);
-		/* return device into normal mode */
-		fill_switch_cmd(&multi_cmd->cmds[3], EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
-	} else if (ffu_mode == FFU_OPT_MODE1) {
-		/*
-		 * FFU mode 2 uses CMD23+CMD25 for repeated downloads and remains in FFU mode
-		 * during FW bundle downloading until completion. In this mode, multi_cmd only
-		 * has 2 sub-commands.
-		 */
-		set_single_cmd(&multi_cmd->cmds[0], MMC_SET_BLOCK_COUNT, 0, 0, bytes / 512);
-		multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-		set_single_cmd(&multi_cmd->cmds[1], MMC_WRITE_MULTIPLE_BLOCK, 1, bytes / 512, arg);
-		mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf + offset);
-	} else if (ffu_mode == FFU_OPT_MODE2) {
-		set_single_cmd(&multi_cmd->cmds[0], MMC_WRITE_MULTIPLE_BLOCK, 1, bytes / 512, arg);
-		multi_cmd->cmds[0].flags = MMC_RSP_R1 | MMC_CMD_ADTC;
-		mmc_ioc_cmd_set_data(multi_cmd->cmds[0], buf + offset);
-		set_single_cmd(&multi_cmd->cmds[1], MMC_STOP_TRANSMISSION, 0, 0, 0);
-		multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-	} else if (ffu_mode == FFU_OPT_MODE3) {
-		fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
-		set_single_cmd(&multi_cmd->cmds[1], MMC_WRITE_BLOCK, 1, 1, arg);
-		mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf + offset);
-		fill_switch_cmd(&multi_cmd->cmds[2], EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
-	} else if (ffu_mode == FFU_OPT_MODE4) {
-		set_single_cmd(&multi_cmd->cmds[0], MMC_WRITE_BLOCK, 1, 1, arg);
-		mmc_ioc_cmd_set_data(multi_cmd->cmds[0], buf + offset);
-	}
-}
-
 /*
- * Retrieves the number of sectors programmed during FFU download.
- *
- * @dev_fd:  File descriptor for the eMMC device.
- * @ext_csd: Pointer to the buffer holding the Extended CSD register data of the eMMC device.
- *
- * Return: The number of sectors programmed, or -1 if reading the EXT_CSD fails.
+ * Flushes the cache once the device has been idle for @idle_ms after a
+ * write, or once data has been dirty for @max_ms, whichever comes first.
+ * The dirty exposure of a flush is the time from the first write seen after
+ * the previous flush until the flush completed.
  */
-static int get_ffu_sectors_programmed(int dev_fd, __u8 *ext_csd)
+int do_cache_daemon(int nargs, char **argv)
 {
-
-	if (read_extcsd(dev_fd, ext_csd)) {
-		fprintf(stderr, "Could not read EXT_CSD\n");
-		return -1;
+	unsigned int idle_ms = 1000, max_ms = 0, poll_ms = 100, count = 0;
+	unsigned int on_idle = 0, on_timer = 0, by_kernel = 0;
+	struct blk_activity last, act;
+	struct lat_hist flushes = {};
+	__u64 t0, now, prev, idle_since, dirty_since = 0, flush_start, latency_us;
+	__u64 exposure, exposure_sum = 0, exposure_max = 0;
+	__u8 ext_csd[512];
+	struct mmc_dev *dev;
+	char stat_path[PATH_MAX];
+	const char *why;
+	char *device;
+	bool dirty = false;
+	int ret, opt;
+
+	stat_path[0] = '\0';
+	while ((opt = getopt(nargs, argv, "i:t:p:c:s:")) != -1) {
+		switch (opt) {
+		case 'i':
+			idle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			poll_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			snprintf(stat_path, sizeof(stat_path), "%s", optarg);
+			break;
+		default:
+			goto usage;
+		}
 	}
+	if (optind != nargs - 1 || !poll_ms || (!idle_ms && !max_ms))
+		goto usage;
+	device = argv[optind];
 
-	return per_byte_htole32((__u8 *)&ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0]);
-}
+	blk_stat_path(device, stat_path, sizeof(stat_path));
+	ret = read_blk_activity(stat_path, &last);
+	if (ret) {
+		fprintf(stderr, "Could not read %s: %s\n", stat_path,
+			strerror(-ret));
+		exit(1);
+	}
 
-static bool ffu_is_supported(__u8 *ext_csd, char *device)
-{
+	dev = open_dev(device);
 
-	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0) {
-		fprintf(stderr, "The FFU feature is only available on devices >= "
-			"MMC 5.0, not supported in %s\n", device);
-		return false;
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
 	}
-
-	if (!(ext_csd[EXT_CSD_SUPPORTED_MODES] & EXT_CSD_FFU)) {
-		fprintf(stderr, "FFU is not supported in %s\n", device);
-		return false;
+	if (!(ext_csd[EXT_CSD_CACHE_CTRL] & 1)) {
+		fprintf(stderr, "The cache is disabled on %s\n", device);
+		exit(1);
 	}
 
-	if (ext_csd[EXT_CSD_FW_CONFIG] & EXT_CSD_UPDATE_DISABLE) {
-		fprintf(stderr, "Firmware update was disabled in %s\n", device);
-		return false;
-	}
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
 
-	return true;
-}
+	t0 = idle_since = now = get_time_ns() / 1000;
+	daemon_log(t0, "watching %s, flush after %u ms idle, %u ms dirty\n",
+		   stat_path, idle_ms, max_ms);
 
-static int enter_ffu_mode(int dev_fd)
-{
-	int ret;
-	struct mmc_ioc_cmd cmd;
+	for (;;) {
+		if (!abort_requested)
+			usleep(poll_ms * 1000);
+		prev = now;
+		now = get_time_ns() / 1000;
 
-	memset(&cmd, 0, sizeof(cmd));
+		ret = read_blk_activity(stat_path, &act);
+		if (ret) {
+			fprintf(stderr, "Could not read %s: %s\n", stat_path,
+				strerror(-ret));
+			break;
+		}
+		/*
+		 * A flush the kernel issued itself, e.g. for an fsync, covers
+		 * the writes before it. Writes in the same interval may have
+		 * come after it, so those keep the cache dirty.
+		 */
+		if (dirty && act.flushes != last.flushes) {
+			daemon_log(t0, "flush by the kernel, dirty for %llu ms\n",
+				   (now - dirty_since) / 1000);
+			by_kernel++;
+			dirty = false;
+			if (act.writes != last.writes) {
+				dirty = true;
+				dirty_since = prev;
+			}
+		} else if (act.writes != last.writes && !dirty) {
+			dirty = true;
+			dirty_since = now;
+		}
+		if (act.ios != last.ios || act.in_flight)
+			idle_since = now;
+		last = act;
 
-	fill_switch_cmd(&cmd, EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &cmd);
-	if (ret)
-		perror("enter FFU mode failed!");
+		if (abort_requested) {
+			/* Don't leave with data at risk */
+			if (!dirty)
+				break;
+			why = "exit";
+		} else if (!dirty) {
+			continue;
+		} else if (max_ms && now - dirty_since >= max_ms * 1000ull) {
+			why = "timer";
+			on_timer++;
+		} else if (idle_ms && now - idle_since >= idle_ms * 1000ull) {
+			why = "idle";
+			on_idle++;
+		} else {
+			continue;
+		}
 
-	return ret;
-}
+		flush_start = get_time_ns() / 1000;
+		ret = flush_cache(dev, &latency_us);
+		if (ret)
+			break;
+		exposure = flush_start + latency_us - dirty_since;
+		lat_hist_add(&flushes, latency_us);
+		exposure_sum += exposure;
+		if (exposure > exposure_max)
+			exposure_max = exposure;
+		daemon_log(t0, "flush (%s) in %llu us, dirty for %llu ms\n",
+			   why, latency_us, exposure / 1000);
+
+		/* Writes that completed meanwhile may have missed the flush */
+		dirty = false;
+		if (!read_blk_activity(stat_path, &act) &&
+		    act.writes != last.writes) {
+			dirty = true;
+			dirty_since = flush_start;
+		}
+		last = act;
 
-static int exit_ffu_mode(int dev_fd)
-{
-	int ret;
-	struct mmc_ioc_cmd cmd;
+		if (abort_requested || (count && flushes.n >= count))
+			break;
+	}
 
-	memset(&cmd, 0, sizeof(cmd));
+	printf("%llu flushes (%u on idle, %u on timer), %u by the kernel",
+	       flushes.n, on_idle, on_timer, by_kernel);
+	if (flushes.n)
+		printf(", dirty exposure mean %llu ms, max %llu ms",
+		       exposure_sum / flushes.n / 1000, exposure_max / 1000);
+	printf("\n");
+	if (flushes.n) {
+		printf("Flush latency:\n");
+		lat_hist_print(stdout, &flushes);
+	}
 
-	fill_switch_cmd(&cmd, EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &cmd);
-	if (ret)
-		perror("exit FFU mode failed!");
+	close_dev(dev);
+	return ret ? 1 : 0;
 
-	return ret;
+usage:
+	fprintf(stderr, "Usage: mmc cache daemon [-i idle_ms] [-t max_dirty_ms] "
+		"[-p poll_ms] [-c count] [-s stat] </path/to/mmcblkX>\n");
+	exit(1);
 }
 
 /*
- * Performs FFU download of the firmware bundle.
- *
- * @dev_fd:     File descriptor for the eMMC device on which the ioctl command will be performed.
- * @ext_csd:    Extended CSD register data of the eMMC device.
- * @fw_buf:     Pointer to the firmware buffer containing the firmware data to be downloaded.
- * @fw_size:    Size of the firmware in bytes.
- * @chunk_size: Size of the chunks in which the firmware is sent to the device.
- * @ffu_mode:	FFU mode for firmware download mode
- *
- * Return: If successful, returns the number of sectors programmed.
- *         On failure, returns a negative error number.
+ * With @poll_ms, the kernel doesn't wait for the erase; the card is polled
+ * and the erase is aborted with HPI after @timeout_ms (default: the erase
+ * timeout), see wait_or_hpi().
  */
-static int do_ffu_download(int dev_fd, __u8 *ext_csd, __u8 *fw_buf, off_t fw_size,
-				unsigned int chunk_size, enum ffu_download_mode ffu_mode)
+static int erase(struct mmc_dev *dev, const char *device, __u32 argin,
+		 __u32 start, __u32 end, unsigned int poll_ms,
+		 unsigned int timeout_ms)
 {
-	int ret;
-	__u8 num_of_cmds = 4;
-	off_t bytes_left, off;
-	unsigned int bytes_per_loop, retry = 3;
-	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+	int ret = 0;
+	__u8 ext_csd[512];
+	__u64 begin;
 
-	if (!fw_buf || !ext_csd) {
-		fprintf(stderr, "unexpected NULL pointer\n");
-		return -EINVAL;
-	}
 
-	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2) {
-		/* in FFU_OPT_MODE1 and FFU_OPT_MODE2, mmc_ioc_multi_cmd contains 2 commands */
-		num_of_cmds = 2;
-	} else if (ffu_mode == FFU_OPT_MODE3) {
-		num_of_cmds = 3; /* in FFU_OPT_MODE3, mmc_ioc_multi_cmd contains 3 commands */
-		chunk_size = 512; /* FFU_OPT_MODE3 uses CMD24 single-block write */
-	} else if (ffu_mode == FFU_OPT_MODE4) {
-		num_of_cmds = 1; /* in FFU_OPT_MODE4, it is single command mode  */
-		chunk_size = 512; /* FFU_OPT_MODE4 uses CMD24 single-block write */
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD\n");
+		exit(1);
+	}
+	if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x01) {
+	  fprintf(stderr, "High Capacity Erase Unit Size=%d bytes\n" \
+                          "High Capacity Erase Timeout=%d ms\n" \
+                          "High Capacity Write Protect Group Size=%d bytes\n",
+		           ext_csd[224]*0x80000,
+		           ext_csd[223]*300,
+                           ext_csd[221]*ext_csd[224]*0x80000);
+	}
+	fprintf(stderr, "Erase timeout for this range=%u ms\n",
+		mmc_erase_timeout(ext_csd, argin, start, end));
+
+	if (poll_ms) {
+		if (!timeout_ms)
+			timeout_ms = mmc_erase_timeout(ext_csd, argin, start,
+						       end);
+		signal(SIGINT, abort_handler);
+		signal(SIGTERM, abort_handler);
+
+		begin = get_time_ns() / 1000;
+		ret = mmc_erase_start(dev, argin, start, end);
+		if (!ret)
+			ret = wait_or_hpi(dev, ext_csd, device, "erase",
+					  poll_ms, timeout_ms, begin);
+	} else {
+		ret = mmc_erase(dev, argin, start, end);
 	}
+	if (ret == -EIO)
+		fprintf(stderr, "Erase rejected by the card (erase parameter or sequence error)\n");
+	else if (ret == -EINTR)
+		fprintf(stderr, "The range is only partially erased\n");
+	else if (ret)
+		fprintf(stderr, "Erase multi-cmd ioctl: %s\n", strerror(-ret));
 
-	/* allocate maximum required */
-	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
-				num_of_cmds * sizeof(struct mmc_ioc_cmd));
-	if (!multi_cmd) {
-		perror("failed to allocate memory");
-		return -ENOMEM;
+	return ret;
+}
+
+int do_erase(int nargs, char **argv)
+{
+	struct mmc_dev *dev;
+	int ret, opt;
+	char *print_str, *device;
+	__u8 ext_csd[512], checkup_mask = 0;
+	__u32 arg, start, end;
+	unsigned int poll_ms = 0, timeout = 0;
+
+	while ((opt = getopt(nargs, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			poll_ms = strtoul(optarg, NULL, 10);
+			if (!poll_ms) {
+				fprintf(stderr, "Invalid poll interval: %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		default:
+			goto usage;
+		}
 	}
 
-	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2 || ffu_mode == FFU_OPT_MODE4) {
-		/*
-		 * In FFU_OPT_MODE1, FFU_OPT_MODE2 and FFU_OPT_MODE4, the command to enter FFU
-		 * mode will be sent independently, separate from the firmware bundle download
-		 * command.
-		 */
-		ret = enter_ffu_mode(dev_fd);
-		if (ret)
-			goto out;
+	if (nargs - optind != 4 && nargs - optind != 5)
+		goto usage;
+	argv += optind - 1;
+	if (nargs - optind == 5) {
+		if (!poll_ms)
+			goto usage;
+		timeout = strtoul(argv[5], NULL, 10);
 	}
 
-do_retry:
-	bytes_left = fw_size;
-	off = 0;
-	multi_cmd->num_of_cmds = num_of_cmds;
+	if (strstr(argv[2], "0x") || strstr(argv[2], "0X"))
+		start = strtol(argv[2], NULL, 16);
+	else
+		start = strtol(argv[2], NULL, 10);
+
+	if (strstr(argv[3], "0x") || strstr(argv[3], "0X"))
+		end = strtol(argv[3], NULL, 16);
+	else
+		end = strtol(argv[3], NULL, 10);
 
-	while (bytes_left) {
-		bytes_per_loop = bytes_left < chunk_size ? bytes_left : chunk_size;
+	if (end < start) {
+		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
+			start, end);
+		exit(1);
+	}
 
-		/* prepare multi_cmd for FFU based on cmd to be used */
-		set_ffu_download_cmd(multi_cmd, ext_csd, bytes_per_loop, fw_buf, off, ffu_mode);
+	if (strcmp(argv[1], "legacy") == 0) {
+		arg = 0x00000000;
+		print_str = "Legacy Erase";
+	} else if (strcmp(argv[1], "discard") == 0) {
+		arg = 0x00000003;
+		print_str = "Discard";
+	} else if (strcmp(argv[1], "secure-erase") == 0) {
+		print_str = "Secure Erase";
+		checkup_mask = EXT_CSD_SEC_ER_EN;
+		arg = 0x80000000;
+	} else if (strcmp(argv[1], "secure-trim1") == 0) {
+		print_str = "Secure Trim Step 1";
+		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
+		arg = 0x80000001;
+	} else if (strcmp(argv[1], "secure-trim2") == 0) {
+		print_str = "Secure Trim Step 2";
+		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
+		arg = 0x80008000;
+	} else if (strcmp(argv[1], "trim") == 0) {
+		print_str = "Trim";
+		checkup_mask = EXT_CSD_SEC_GB_CL_EN;
+		arg = 0x00000001;
+	} else {
+		fprintf(stderr, "Unknown erase type: %s\n", argv[1]);
+		exit(1);
+	}
 
-		if (num_of_cmds > 1)
-			/* send ioctl with multi-cmd, download firmware bundle */
-			ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-		else
-			ret = ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[0]);
+	device = argv[4];
+	dev = open_dev(device);
 
+	if (checkup_mask) {
+		ret = read_extcsd(dev, ext_csd);
 		if (ret) {
-			perror("ioctl failed");
-			/*
-			 * In case multi-cmd ioctl failed before exiting from
-			 * ffu mode
-			 */
-			exit_ffu_mode(dev_fd);
+			fprintf(stderr, "Could not read EXT_CSD from %s\n",
+				device);
 			goto out;
 		}
-
-		ret = get_ffu_sectors_programmed(dev_fd, ext_csd);
-		if (ret <= 0) {
-			ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[3]);
-			/*
-			 * By spec, host should re-start download from the first sector if
-			 * programmed count is 0
-			 */
-			if (ret == 0 && retry > 0) {
-				retry--;
-				fprintf(stderr, "Programming failed. Retrying... (%d)\n", retry);
-				goto do_retry;
-			}
-			fprintf(stderr, "Programming failed! Aborting...\n");
+		if ((checkup_mask & ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT]) !=
+								checkup_mask) {
+			fprintf(stderr, "%s is not supported in %s\n",
+				print_str, device);
+			ret = -ENOTSUP;
 			goto out;
-		} else {
-			fprintf(stderr,
-				"Programmed %d/%jd bytes\r", ret * 512, (intmax_t)fw_size);
 		}
 
-		bytes_left -= bytes_per_loop;
-		off += bytes_per_loop;
-	}
-
-	if (ffu_mode == FFU_OPT_MODE1 || ffu_mode == FFU_OPT_MODE2 || ffu_mode == FFU_OPT_MODE4) {
-		/*
-		 * In FFU_OPT_MODE1, FFU_OPT_MODE2 and FFU_OPT_MODE4, the command to exit FFU mode
-		 * will be sent independently, separate from the firmware bundle download command.
-		 */
-		ret = exit_ffu_mode(dev_fd);
-		if (ret)
-			goto out;
 	}
+	printf("Executing %s from 0x%08x to 0x%08x\n", print_str, start, end);
 
-	ret = get_ffu_sectors_programmed(dev_fd, ext_csd);
+	ret = erase(dev, device, arg, start, end, poll_ms, timeout);
 out:
-	free(multi_cmd);
+	printf(" %s %s!\n\n", print_str, ret ? "Failed" : "Succeed");
+	close_dev(dev);
 	return ret;
+
+usage:
+	fprintf(stderr, "Usage: erase [-p <poll_ms>] <type> <start addr> <end addr> </path/to/mmcblkX> [timeout_ms]\n");
+	exit(1);
+}
+
+#define VERIFY_DEF_THREADS	4
+#define VERIFY_DEF_CHUNK_KIB	1024
+
+struct verify_ctx {
+	int fd;
+	__u8 pattern;
+	__u64 first_sect;
+	__u64 last_sect;
+	unsigned int chunk_sects;
+	__u64 *chunks;		/* sampled chunk indexes, NULL for a full pass */
+	__u64 nr_chunks;
+	__u64 next;		/* next task, advanced atomically */
+
+	__u64 bytes_read;	/* atomic */
+	int error;		/* atomic, the first error wins */
+
+	pthread_mutex_t lock;	/* protects the mismatch report */
+	__u64 bad_sects;
+	__u64 first_bad;
+};
+
+static void verify_set_error(struct verify_ctx *ctx, int error)
+{
+	__sync_bool_compare_and_swap(&ctx->error, 0, error);
 }
 
-static int do_ffu_install(int dev_fd, const char *device)
+static void *verify_worker(void *arg)
 {
-	int ret;
-	__u8 ext_csd[512];
-	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+	struct verify_ctx *ctx = arg;
+	__u8 *buf;
+	__u64 task, chunk, sect, i;
+	size_t len;
+	ssize_t r;
+
+	if (posix_memalign((void **)&buf, 4096,
+			   (size_t)ctx->chunk_sects * 512)) {
+		verify_set_error(ctx, -ENOMEM);
+		return NULL;
+	}
+
+	for (;;) {
+		task = __sync_fetch_and_add(&ctx->next, 1);
+		if (task >= ctx->nr_chunks ||
+		    __sync_fetch_and_add(&ctx->error, 0))
+			break;
 
-	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) + 2 * sizeof(struct mmc_ioc_cmd));
-	if (!multi_cmd) {
-		perror("failed to allocate memory");
-		return -ENOMEM;
+		chunk = ctx->chunks ? ctx->chunks[task] : task;
+		sect = ctx->first_sect + chunk * ctx->chunk_sects;
+		len = ctx->chunk_sects;
+		if (sect + len > ctx->last_sect + 1)
+			len = ctx->last_sect + 1 - sect;
+		len *= 512;
+
+		r = pread(ctx->fd, buf, len, sect * 512);
+		if (r != len) {
+			fprintf(stderr, "Read error at sector %llu: %s\n",
+				sect, r < 0 ? strerror(errno) : "short read");
+			verify_set_error(ctx, -EIO);
+			break;
+		}
+		__sync_fetch_and_add(&ctx->bytes_read, len);
+
+		/* Fast path: the whole chunk holds the expected pattern */
+		if (buf[0] == ctx->pattern && !memcmp(buf, buf + 1, len - 1))
+			continue;
+
+		pthread_mutex_lock(&ctx->lock);
+		for (i = 0; i < len; i++) {
+			if (buf[i] == ctx->pattern)
+				continue;
+			if (sect + i / 512 < ctx->first_bad)
+				ctx->first_bad = sect + i / 512;
+			ctx->bad_sects++;
+			/* Skip to the next sector */
+			i |= 511;
+		}
+		pthread_mutex_unlock(&ctx->lock);
 	}
 
-	/* Re-enter ffu mode and install the firmware */
-	multi_cmd->num_of_cmds = 2;
-	fill_switch_cmd(&multi_cmd->cmds[0], EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
-	fill_switch_cmd(&multi_cmd->cmds[1], EXT_CSD_MODE_OPERATION_CODES, EXT_CSD_FFU_INSTALL);
+	free(buf);
+	return NULL;
+}
 
-	/* send ioctl with multi-cmd */
-	ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-	if (ret) {
-		perror("Multi-cmd ioctl failed setting install mode");
-		fill_switch_cmd(&multi_cmd->cmds[1], EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
-		/* In case multi-cmd ioctl failed before exiting from ffu mode */
-		ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[1]);
-		goto out;
+/*
+ * Picks @nr distinct chunk indexes out of @total at random, sorted so the
+ * read-back stays mostly sequential.
+ */
+static __u64 *pick_samples(__u64 total, __u64 nr, unsigned int seed)
+{
+	__u64 *all, *samples, i, j, tmp;
+
+	all = malloc(total * sizeof(*all));
+	samples = malloc(nr * sizeof(*samples));
+	if (!all || !samples) {
+		free(all);
+		free(samples);
+		return NULL;
 	}
 
-	/* Check FFU install status */
-	ret = read_extcsd(dev_fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		goto out;
+	for (i = 0; i < total; i++)
+		all[i] = i;
+
+	srandom(seed);
+	for (i = 0; i < nr; i++) {
+		j = i + ((__u64)random() * (RAND_MAX + 1ull) + random()) %
+			(total - i);
+		tmp = all[i];
+		all[i] = all[j];
+		all[j] = tmp;
+		samples[i] = all[i];
 	}
+	free(all);
 
-	/* Return status */
-	ret = ext_csd[EXT_CSD_FFU_STATUS];
-out:
-	free(multi_cmd);
-	return ret;
+	qsort(samples, nr, sizeof(*samples), cmp_u64);
+
+	return samples;
 }
 
-static int __do_ffu(int nargs, char **argv, enum ffu_download_mode ffu_mode)
+int do_erase_verify(int nargs, char **argv)
 {
-	int dev_fd, img_fd;
-	int ret = -EINVAL;
-	unsigned int sect_size;
+	struct verify_ctx ctx = { .first_bad = ~0ull };
+	pthread_t *threads;
 	__u8 ext_csd[512];
-	__u8 *fw_buf = NULL;
-	off_t fw_size;
 	char *device;
-	unsigned int default_chunk = MMC_IOC_MAX_BYTES;
-
-	assert(nargs == 3 || nargs == 4);
-	if (nargs == 4) {
-		default_chunk = strtol(argv[3], NULL, 10);
-		if (default_chunk > MMC_IOC_MAX_BYTES || default_chunk % 512) {
-			fprintf(stderr, "Invalid chunk size");
-			exit(1);
+	unsigned int nr_threads = VERIFY_DEF_THREADS;
+	unsigned int chunk_kib = VERIFY_DEF_CHUNK_KIB;
+	unsigned int percent = 100, seed = 0, i;
+	__u64 start, end, dev_bytes, total_chunks, begin, elapsed;
+	struct mmc_dev *dev;
+	int opt, ret;
+
+	while ((opt = getopt(nargs, argv, "t:s:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			percent = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			chunk_kib = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
 		}
 	}
 
-	device = argv[2];
-	dev_fd = open(device, O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open failed");
+	if (nargs - optind != 3)
+		goto usage;
+	if (!nr_threads || !percent || percent > 100 || !chunk_kib ||
+	    chunk_kib % 4) {
+		fprintf(stderr, "Invalid threads, sample percentage or chunk size\n");
 		exit(1);
 	}
-	img_fd = open(argv[1], O_RDONLY);
-	if (img_fd < 0) {
-		perror("image open failed");
-		close(dev_fd);
+
+	start = strtoull(argv[optind], NULL, 0);
+	end = strtoull(argv[optind + 1], NULL, 0);
+	device = argv[optind + 2];
+	if (end < start) {
+		fprintf(stderr, "verify start [0x%08llx] > verify end [0x%08llx]\n",
+			start, end);
 		exit(1);
 	}
 
-	fw_size = lseek(img_fd, 0, SEEK_END);
-	if (fw_size == 0) {
-		fprintf(stderr, "Wrong firmware size");
-		goto out;
-	}
+	dev = open_dev(device);
 
-	ret = read_extcsd(dev_fd, ext_csd);
+	ret = read_extcsd(dev, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		goto out;
+		exit(1);
 	}
+	close_dev(dev);
 
-	/* Check if FFU is supported by eMMC device */
-	if (!ffu_is_supported(ext_csd, device)) {
-		ret = -ENOTSUP;
-		goto out;
+	/* Same addressing as the erase command: bytes on byte-addressed cards */
+	if (!is_blockaddresed(ext_csd)) {
+		start /= 512;
+		end /= 512;
+	}
+	ctx.first_sect = start;
+	ctx.last_sect = end;
+	ctx.pattern = ext_csd[EXT_CSD_ERASED_MEM_CONT] ? 0xff : 0x00;
+	ctx.chunk_sects = chunk_kib * 2;
+
+	ctx.fd = open(device, O_RDONLY | O_DIRECT);
+	if (ctx.fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	if (ioctl(ctx.fd, BLKGETSIZE64, &dev_bytes)) {
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+	if ((end + 1) * 512 > dev_bytes) {
+		fprintf(stderr, "verify end [0x%08llx] is beyond the end of %s\n",
+			end, device);
+		exit(1);
+	}
+
+	total_chunks = (end - start + ctx.chunk_sects) / ctx.chunk_sects;
+	ctx.nr_chunks = total_chunks;
+	if (percent < 100) {
+		ctx.nr_chunks = (total_chunks * percent + 99) / 100;
+		seed = time(NULL);
+		ctx.chunks = pick_samples(total_chunks, ctx.nr_chunks, seed);
+		if (!ctx.chunks) {
+			perror("Failed to allocate memory");
+			exit(1);
+		}
+	}
+
+	printf("Verifying sectors 0x%08llx-0x%08llx of %s against ERASED_MEM_CONT pattern 0x%02x\n",
+	       start, end, device, ctx.pattern);
+	if (ctx.chunks)
+		printf("Sampling %llu of %llu chunks of %u KiB (seed %u)\n",
+		       ctx.nr_chunks, total_chunks, chunk_kib, seed);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	begin = get_time_ns() / 1000;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, verify_worker, &ctx)) {
+			fprintf(stderr, "Could not create reader thread\n");
+			nr_threads = i;
+			verify_set_error(&ctx, -EAGAIN);
+			break;
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = get_time_ns() / 1000 - begin;
+
+	printf("Read %llu MiB in %llu.%03llu s (%.1f MiB/s) using %u threads\n",
+	       ctx.bytes_read >> 20, elapsed / 1000000, (elapsed / 1000) % 1000,
+	       elapsed ? ctx.bytes_read / (1048576.0 * elapsed / 1000000) : 0,
+	       nr_threads);
+
+	ret = ctx.error;
+	if (ctx.bad_sects) {
+		printf("%llu sectors do not match, first one at 0x%08llx\n",
+		       ctx.bad_sects, ctx.first_bad);
+		ret = -EIO;
+	}
+	printf(" Verify %s!\n", ret ? "Failed" : "Succeed");
+
+	pthread_mutex_destroy(&ctx.lock);
+	free(threads);
+	free(ctx.chunks);
+	close(ctx.fd);
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc erase verify [-t <threads>] [-s <percent>] [-b <chunk KiB>] <start addr> <end addr> </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+static bool ffu_is_supported(__u8 *ext_csd, char *device)
+{
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0) {
+		fprintf(stderr, "The FFU feature is only available on devices >= "
+			"MMC 5.0, not supported in %s\n", device);
+		return false;
+	}
+
+	if (!(ext_csd[EXT_CSD_SUPPORTED_MODES] & EXT_CSD_FFU)) {
+		fprintf(stderr, "FFU is not supported in %s\n", device);
+		return false;
+	}
+
+	if (ext_csd[EXT_CSD_FW_CONFIG] & EXT_CSD_UPDATE_DISABLE) {
+		fprintf(stderr, "Firmware update was disabled in %s\n", device);
+		return false;
+	}
+
+	return true;
+}
+
+static void ffu_progress(off_t done, off_t total, void *priv)
+{
+	if (!done)
+		fprintf(stderr, "Programming failed. Retrying...\n");
+	else
+		fprintf(stderr, "Programmed %jd/%jd bytes\r", (intmax_t)done,
+			(intmax_t)total);
+}
+
+static int __do_ffu(int nargs, char **argv, enum ffu_download_mode ffu_mode)
+{
+	struct mmc_dev *dev;
+	int img_fd;
+	int ret = -EINVAL;
+	unsigned int sect_size;
+	__u8 ext_csd[512];
+	__u8 *fw_buf = NULL;
+	off_t fw_size;
+	char *device;
+	unsigned int default_chunk = MMC_IOC_MAX_BYTES;
+
+	assert(nargs == 3 || nargs == 4);
+	if (nargs == 4) {
+		default_chunk = strtol(argv[3], NULL, 10);
+		if (default_chunk > MMC_IOC_MAX_BYTES || default_chunk % 512) {
+			fprintf(stderr, "Invalid chunk size");
+			exit(1);
+		}
+	}
+
+	device = argv[2];
+	dev = open_dev(device);
+	img_fd = open(argv[1], O_RDONLY);
+	if (img_fd < 0) {
+		perror("image open failed");
+		close_dev(dev);
+		exit(1);
+	}
+
+	fw_size = lseek(img_fd, 0, SEEK_END);
+	if (fw_size == 0) {
+		fprintf(stderr, "Wrong firmware size");
+		goto out;
+	}
+
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		goto out;
+	}
+
+	/* Check if FFU is supported by eMMC device */
+	if (!ffu_is_supported(ext_csd, device)) {
+		ret = -ENOTSUP;
+		goto out;
 	}
 
 	/* Ensure FW is multiple of native sector size */
@@ -3184,7 +5038,8 @@ static int __do_ffu(int nargs, char **argv, enum ffu_download_mode ffu_mode)
 	}
 
 	/* Download firmware bundle */
-	ret = do_ffu_download(dev_fd, ext_csd, fw_buf, fw_size, default_chunk, ffu_mode);
+	ret = mmc_ffu_download(dev, ext_csd, fw_buf, fw_size, default_chunk, ffu_mode,
+			       ffu_progress, NULL);
 	/* Check programmed sectors */
 	if (ret > 0 && (ret * 512) == fw_size) {
 		fprintf(stderr, "Programmed %jd/%jd bytes\n", (intmax_t)fw_size, (intmax_t)fw_size);
@@ -3210,8 +5065,11 @@ static int __do_ffu(int nargs, char **argv, enum ffu_download_mode ffu_mode)
 	}
 
 	fprintf(stderr, "Installing firmware on %s...\n", device);
-	ret = do_ffu_install(dev_fd, device);
-	if (ret)
+	ret = mmc_ffu_install(dev);
+	if (ret < 0)
+		fprintf(stderr, "%s: FFU install failed: %s\n", device,
+			strerror(-ret));
+	else if (ret)
 		fprintf(stderr, "%s: error %d during FFU install:\n", device, ret);
 	else
 		fprintf(stderr, "FFU finished successfully\n");
@@ -3220,7 +5078,7 @@ out:
 	if (fw_buf)
 		free(fw_buf);
 	close(img_fd);
-	close(dev_fd);
+	close_dev(dev);
 	return ret;
 }
 
@@ -3251,7 +5109,7 @@ int do_opt_ffu4(int nargs, char **argv)
 
 int do_general_cmd_read(int nargs, char **argv)
 {
-	int dev_fd;
+	struct mmc_dev *dev;
 	char *device;
 	char *endptr;
 	__u8 buf[512];
@@ -3265,11 +5123,7 @@ int do_general_cmd_read(int nargs, char **argv)
 	}
 
 	device = argv[1];
-	dev_fd = open(device, O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open failed");
-		exit(1);
-	}
+	dev = open_dev(device);
 
 	/* arg is specified */
 	if (nargs == 3) {
@@ -3289,7 +5143,7 @@ int do_general_cmd_read(int nargs, char **argv)
 	idata.blocks = 1;
 	mmc_ioc_cmd_set_data(idata, buf);
 
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &idata);
+	ret = mmc_cmd(dev, &idata);
 	if (ret) {
 		perror("ioctl");
 		goto out;
@@ -3302,20 +5156,332 @@ int do_general_cmd_read(int nargs, char **argv)
 			printf("\n");
 	}
 out:
-	close(dev_fd);
+	close_dev(dev);
 	return ret;
 }
 
-static void issue_cmd0(char *device, __u32 arg)
+struct raw_cmd {
+	char *data_file;
+	__u8 *buf;
+};
+
+struct raw_name {
+	const char *name;
+	__u32 flags;
+};
+
+static const struct raw_name raw_rsp[] = {
+	{ "none", MMC_RSP_NONE },
+	{ "r1", MMC_RSP_SPI_R1 | MMC_RSP_R1 },
+	{ "r1b", MMC_RSP_SPI_R1B | MMC_RSP_R1B },
+	{ "r2", MMC_RSP_R2 },
+	{ "r3", MMC_RSP_R3 },
+};
+
+static const struct raw_name raw_type[] = {
+	{ "ac", MMC_CMD_AC },
+	{ "adtc", MMC_CMD_ADTC },
+	{ "bc", MMC_CMD_BC },
+	{ "bcr", MMC_CMD_BCR },
+};
+
+static int raw_lookup(const struct raw_name *names, int n, const char *val)
 {
-	struct mmc_ioc_cmd idata;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(val, names[i].name))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Parses one command of a raw sequence, a list of words:
+ *   op=<opcode> arg=<arg> rsp=<none|r1|r1b|r2|r3> type=<ac|adtc|bc|bcr>
+ *   flags=<raw flags> blksz=<bytes> blocks=<n> write rel data=<file>
+ *   timeout=<ms> data_timeout=<ms>
+ */
+static int raw_parse_cmd(char *words, struct mmc_ioc_cmd *cmd,
+			 struct raw_cmd *raw)
+{
+	char *word, *val, *save, *end;
+	int rsp = -1, type = -1, has_flags = 0, has_op = 0, i;
+	unsigned long long num;
+
+	for (word = strtok_r(words, " \t\r\n", &save); word;
+	     word = strtok_r(NULL, " \t\r\n", &save)) {
+		if (!strcmp(word, "write")) {
+			cmd->write_flag |= 1;
+			continue;
+		}
+		if (!strcmp(word, "rel")) {
+			cmd->write_flag |= 1u << 31;
+			continue;
+		}
+
+		val = strchr(word, '=');
+		if (!val)
+			goto bad;
+		*val++ = '\0';
+
+		if (!strcmp(word, "rsp")) {
+			rsp = raw_lookup(raw_rsp, sizeof(raw_rsp) /
+					 sizeof(raw_rsp[0]), val);
+			if (rsp < 0)
+				goto bad;
+			continue;
+		}
+		if (!strcmp(word, "type")) {
+			type = raw_lookup(raw_type, sizeof(raw_type) /
+					  sizeof(raw_type[0]), val);
+			if (type < 0)
+				goto bad;
+			continue;
+		}
+		if (!strcmp(word, "data")) {
+			raw->data_file = strdup(val);
+			continue;
+		}
+
+		num = strtoull(val, &end, 0);
+		if (*end || num > UINT32_MAX)
+			goto bad;
+
+		if (!strcmp(word, "op")) {
+			cmd->opcode = num;
+			has_op = 1;
+		} else if (!strcmp(word, "arg")) {
+			cmd->arg = num;
+		} else if (!strcmp(word, "flags")) {
+			cmd->flags = num;
+			has_flags = 1;
+		} else if (!strcmp(word, "blksz")) {
+			cmd->blksz = num;
+		} else if (!strcmp(word, "blocks")) {
+			cmd->blocks = num;
+		} else if (!strcmp(word, "timeout")) {
+			cmd->cmd_timeout_ms = num;
+		} else if (!strcmp(word, "data_timeout")) {
+			/* data_timeout_ns is 32 bits, about 4.29 s */
+			if (num > UINT32_MAX / 1000000) {
+				fprintf(stderr, "data_timeout is at most %u ms\n",
+					UINT32_MAX / 1000000);
+				goto bad;
+			}
+			cmd->data_timeout_ns = num * 1000000;
+		} else {
+			goto bad;
+		}
+	}
+
+	if (!has_op) {
+		fprintf(stderr, "Missing op=<opcode>\n");
+		return -EINVAL;
+	}
+
+	if (cmd->blocks && !cmd->blksz)
+		cmd->blksz = 512;
+	if (!has_flags) {
+		i = rsp < 0 ? 1 : rsp;
+		cmd->flags = raw_rsp[i].flags;
+		i = type < 0 ? (cmd->blocks ? 1 : 0) : type;
+		cmd->flags |= raw_type[i].flags;
+	}
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Invalid word in raw command: %s%s%s\n", word,
+		val ? "=" : "", val ? val : "");
+	return -EINVAL;
+}
+
+static int raw_load_data(struct mmc_ioc_cmd *cmd, struct raw_cmd *raw)
+{
+	size_t len = (size_t)cmd->blksz * cmd->blocks;
 	int fd;
 
-	fd = open(device, O_RDWR);
+	if (!len)
+		return 0;
+	if (len > MMC_IOC_MAX_BYTES) {
+		fprintf(stderr, "CMD%u transfers %zu bytes, more than %ld\n",
+			cmd->opcode, len, MMC_IOC_MAX_BYTES);
+		return -EINVAL;
+	}
+
+	raw->buf = calloc(1, len);
+	if (!raw->buf)
+		return -ENOMEM;
+	mmc_ioc_cmd_set_data((*cmd), raw->buf);
+
+	if (!(cmd->write_flag & 1))
+		return 0;
+
+	if (!raw->data_file) {
+		fprintf(stderr, "CMD%u writes data but has no data=<file>\n",
+			cmd->opcode);
+		return -EINVAL;
+	}
+	fd = open(raw->data_file, O_RDONLY);
 	if (fd < 0) {
-		perror("open");
+		perror(raw->data_file);
+		return -errno;
+	}
+	if (read(fd, raw->buf, len) != len) {
+		fprintf(stderr, "%s: shorter than %zu bytes\n", raw->data_file,
+			len);
+		close(fd);
+		return -EINVAL;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static void raw_store_data(struct mmc_ioc_cmd *cmd, struct raw_cmd *raw)
+{
+	size_t len = (size_t)cmd->blksz * cmd->blocks, i;
+	int fd;
+
+	if (!len || (cmd->write_flag & 1))
+		return;
+
+	if (!raw->data_file) {
+		for (i = 0; i < len; i++)
+			printf("%02x%s", raw->buf[i],
+			       (i + 1) % 16 && i + 1 < len ? " " : "\n");
+		return;
+	}
+
+	fd = open(raw->data_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, raw->buf, len) != len)
+		perror(raw->data_file);
+	if (fd >= 0)
+		close(fd);
+}
+
+int do_raw(int nargs, char **argv)
+{
+	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+	struct raw_cmd raw[MMC_IOC_MAX_CMDS] = {};
+	__u64 t, tmin = UINT64_MAX, tmax = 0, tsum = 0;
+	unsigned int repeat = 1, n = 0, i, j;
+	char *line = NULL, *cmd, *save;
+	struct mmc_dev *dev;
+	size_t len = 0;
+	int opt, ret;
+	FILE *f;
+
+	while ((opt = getopt(nargs, argv, "r:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repeat = strtoul(optarg, NULL, 0);
+			if (!repeat)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 2)
+		goto usage;
+
+	if (!strcmp(argv[optind], "-")) {
+		f = stdin;
+	} else {
+		f = fopen(argv[optind], "r");
+		if (!f) {
+			perror(argv[optind]);
+			exit(1);
+		}
+	}
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   MMC_IOC_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+
+	/* One command per line or ;-separated, # starts a comment */
+	while (getline(&line, &len, f) != -1) {
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		for (cmd = strtok_r(line, ";", &save); cmd;
+		     cmd = strtok_r(NULL, ";", &save)) {
+			if (!cmd[strspn(cmd, " \t\r\n")])
+				continue;
+			if (n == MMC_IOC_MAX_CMDS) {
+				fprintf(stderr, "More than %d commands\n",
+					MMC_IOC_MAX_CMDS);
+				exit(1);
+			}
+			if (raw_parse_cmd(cmd, &multi_cmd->cmds[n], &raw[n]) ||
+			    raw_load_data(&multi_cmd->cmds[n], &raw[n]))
+				exit(1);
+			n++;
+		}
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	if (!n) {
+		fprintf(stderr, "No commands given\n");
 		exit(1);
 	}
+	multi_cmd->num_of_cmds = n;
+
+	dev = open_dev(argv[optind + 1]);
+
+	for (i = 0; i < repeat; i++) {
+		t = get_time_ns() / 1000;
+		ret = mmc_multi_cmd(dev, multi_cmd);
+		t = get_time_ns() / 1000 - t;
+		if (ret) {
+			fprintf(stderr, "multi-cmd ioctl: %s\n", strerror(-ret));
+			break;
+		}
+		tmin = t < tmin ? t : tmin;
+		tmax = t > tmax ? t : tmax;
+		tsum += t;
+	}
+
+	for (j = 0; j < n; j++) {
+		struct mmc_ioc_cmd *c = &multi_cmd->cmds[j];
+
+		printf("cmd %u: CMD%u arg 0x%08x resp 0x%08x 0x%08x 0x%08x 0x%08x\n",
+		       j, c->opcode, c->arg, c->response[0], c->response[1],
+		       c->response[2], c->response[3]);
+		if (!ret)
+			raw_store_data(c, &raw[j]);
+		free(raw[j].buf);
+		free(raw[j].data_file);
+	}
+
+	if (!ret && repeat == 1)
+		printf("latency: %llu us\n", (unsigned long long)tsum);
+	else if (!ret)
+		printf("latency: min %llu us, avg %llu us, max %llu us over %u runs\n",
+		       (unsigned long long)tmin,
+		       (unsigned long long)(tsum / repeat),
+		       (unsigned long long)tmax, repeat);
+
+	free(multi_cmd);
+	close_dev(dev);
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc raw [-r <repeat>] <sequence>|- <device>\n");
+	exit(1);
+}
+
+static void issue_cmd0(char *device, __u32 arg)
+{
+	struct mmc_ioc_cmd idata;
+	struct mmc_dev *dev;
+
+	dev = open_dev(device);
 
 	memset(&idata, 0, sizeof(idata));
 	idata.opcode = MMC_GO_IDLE_STATE;
@@ -3323,8 +5489,8 @@ static void issue_cmd0(char *device, __u32 arg)
 	idata.flags = MMC_RSP_NONE | MMC_CMD_BC;
 
 	/* No need to check for error, it is expected */
-	ioctl(fd, MMC_IOC_CMD, &idata);
-	close(fd);
+	mmc_cmd(dev, &idata);
+	close_dev(dev);
 }
 
 int do_softreset(int nargs, char **argv)
@@ -3357,65 +5523,21 @@ int do_preidle(int nargs, char **argv)
 	return 0;
 }
 
-int do_alt_boot_op(int nargs, char **argv)
+/*
+ * Runs one alternative boot operation transferring @blocks blocks of the
+ * boot stream into @buf. The card is reset by the operation.
+ */
+static int boot_op_read(struct mmc_dev *dev, __u8 *buf, unsigned int blocks,
+			__u64 *elapsed_us)
 {
-	int fd, ret, boot_data_fd;
-	char *device, *boot_data_file;
 	struct mmc_ioc_multi_cmd *mioc;
-	__u8 ext_csd[512];
-	__u8 *boot_buf;
-	unsigned int boot_blocks, ext_csd_boot_size;
-
-	if (nargs != 3) {
-		fprintf(stderr, "Usage: mmc boot_op <boot_data_file> </path/to/mmcblkX>\n");
-		exit(1);
-	}
-	boot_data_file = argv[1];
-	device = argv[2];
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open device");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		perror("read extcsd");
-		goto dev_fd_close;
-	}
-	if (!(ext_csd[EXT_CSD_BOOT_INFO] & EXT_CSD_BOOT_INFO_ALT)) {
-		ret = -EINVAL;
-		perror("Card does not support alternative boot mode");
-		goto dev_fd_close;
-	}
-	if (ext_csd[EXT_CSD_PART_CONFIG] & EXT_CSD_PART_CONFIG_ACC_ACK) {
-		ret = -EINVAL;
-		perror("Boot Ack must not be enabled");
-		goto dev_fd_close;
-	}
-	ext_csd_boot_size = ext_csd[EXT_CSD_BOOT_MULT] * 128 * 1024;
-	boot_blocks = ext_csd_boot_size / 512;
-	if (ext_csd_boot_size > MMC_IOC_MAX_BYTES) {
-		printf("Boot partition size is bigger than IOCTL limit, limiting to 512K\n");
-		boot_blocks = MMC_IOC_MAX_BYTES / 512;
-	}
-
-	boot_data_fd = open(boot_data_file, O_WRONLY | O_CREAT, 0644);
-	if (boot_data_fd < 0) {
-		perror("open boot data file");
-		ret = 1;
-		goto boot_data_close;
-	}
+	__u64 begin;
+	int ret;
 
-	boot_buf = calloc(1, sizeof(__u8) * boot_blocks * 512);
 	mioc = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
 			   2 * sizeof(struct mmc_ioc_cmd));
-	if (!mioc || !boot_buf) {
-		perror("Failed to allocate memory");
-		ret = -ENOMEM;
-		goto alloced_error;
-	}
+	if (!mioc)
+		return -ENOMEM;
 
 	mioc->num_of_cmds = 2;
 	mioc->cmds[0].opcode = MMC_GO_IDLE_STATE;
@@ -3428,17 +5550,177 @@ int do_alt_boot_op(int nargs, char **argv)
 	mioc->cmds[1].flags = MMC_RSP_NONE | MMC_CMD_ADTC;
 	mioc->cmds[1].write_flag = 0;
 	mioc->cmds[1].blksz = 512;
-	mioc->cmds[1].blocks = boot_blocks;
+	mioc->cmds[1].blocks = blocks;
 	/* Access time of boot part differs wildly, spec mandates 1s */
 	mioc->cmds[1].data_timeout_ns = 2 * 1000 * 1000 * 1000;
-	mmc_ioc_cmd_set_data(mioc->cmds[1], boot_buf);
+	mmc_ioc_cmd_set_data(mioc->cmds[1], buf);
+
+	begin = get_time_ns() / 1000;
+	ret = mmc_multi_cmd(dev, mioc);
+	if (elapsed_us)
+		*elapsed_us = get_time_ns() / 1000 - begin;
+
+	free(mioc);
+	return ret;
+}
+
+/*
+ * The boot stream is whatever the enabled boot partition holds, so the part
+ * beyond the ioctl limit can be read through that partition's block device.
+ */
+static int boot_read_tail(const char *device, __u8 *ext_csd, __u8 *buf,
+			  unsigned int offset, unsigned int len)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	switch ((ext_csd[EXT_CSD_PART_CONFIG] >> 3) & 0x7) {
+	case 1:
+		snprintf(path, sizeof(path), "%sboot0", device);
+		break;
+	case 2:
+		snprintf(path, sizeof(path), "%sboot1", device);
+		break;
+	case 7:
+		snprintf(path, sizeof(path), "%s", device);
+		break;
+	default:
+		fprintf(stderr, "Boot partition is not enabled\n");
+		return -EINVAL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -errno;
+	}
+
+	ret = pread(fd, buf, len, offset);
+	if (ret != len) {
+		fprintf(stderr, "Could not read %u bytes of boot data from %s\n",
+			len, path);
+		ret = -EIO;
+	} else {
+		ret = 0;
+	}
+
+	close(fd);
+	return ret;
+}
+
+int do_alt_boot_op(int nargs, char **argv)
+{
+	struct mmc_dev *dev;
+	int ret, boot_data_fd = -1, opt;
+	char *device, *boot_data_file;
+	__u8 ext_csd[512];
+	__u8 *boot_buf = NULL;
+	unsigned int boot_blocks, op_blocks, ext_csd_boot_size;
+	bool full = false, timing = false;
+	__u64 t_first, t_all;
+
+	while ((opt = getopt(nargs, argv, "ft")) != -1) {
+		switch (opt) {
+		case 'f':
+			full = true;
+			break;
+		case 't':
+			timing = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (nargs - optind != 2)
+		goto usage;
+	boot_data_file = argv[optind];
+	device = argv[optind + 1];
+
+	dev = open_dev(device);
+
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		perror("read extcsd");
+		goto dev_fd_close;
+	}
+	if (!(ext_csd[EXT_CSD_BOOT_INFO] & EXT_CSD_BOOT_INFO_ALT)) {
+		ret = -EINVAL;
+		perror("Card does not support alternative boot mode");
+		goto dev_fd_close;
+	}
+	if (ext_csd[EXT_CSD_PART_CONFIG] & EXT_CSD_PART_CONFIG_ACC_ACK) {
+		ret = -EINVAL;
+		perror("Boot Ack must not be enabled");
+		goto dev_fd_close;
+	}
+	ext_csd_boot_size = ext_csd[EXT_CSD_BOOT_MULT] * 128 * 1024;
+	boot_blocks = ext_csd_boot_size / 512;
+	op_blocks = boot_blocks;
+	if (ext_csd_boot_size > MMC_IOC_MAX_BYTES) {
+		op_blocks = MMC_IOC_MAX_BYTES / 512;
+		if (full)
+			printf("Boot partition size is bigger than IOCTL limit, reading beyond 512K from the boot partition\n");
+		else
+			printf("Boot partition size is bigger than IOCTL limit, limiting to 512K\n");
+	}
+	if (!full)
+		boot_blocks = op_blocks;
 
-	ret = ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	boot_data_fd = open(boot_data_file, O_WRONLY | O_CREAT, 0644);
+	if (boot_data_fd < 0) {
+		perror("open boot data file");
+		ret = 1;
+		goto dev_fd_close;
+	}
+
+	boot_buf = calloc(1, sizeof(__u8) * boot_blocks * 512);
+	if (!boot_buf) {
+		perror("Failed to allocate memory");
+		ret = -ENOMEM;
+		goto alloced_error;
+	}
+
+	/*
+	 * The boot operation resets the card, so read the tail while the
+	 * block device is still usable.
+	 */
+	if (boot_blocks > op_blocks) {
+		ret = boot_read_tail(device, ext_csd, boot_buf + op_blocks * 512,
+				     op_blocks * 512,
+				     (boot_blocks - op_blocks) * 512);
+		if (ret)
+			goto alloced_error;
+	}
+
+	/*
+	 * Boot ack is not available through the ioctl interface, so the time
+	 * to the first block stands in for the boot latency.
+	 */
+	if (timing) {
+		ret = boot_op_read(dev, boot_buf, 1, &t_first);
+		if (ret) {
+			perror("multi-cmd ioctl error\n");
+			goto alloced_error;
+		}
+	}
+
+	ret = boot_op_read(dev, boot_buf, op_blocks, &t_all);
 	if (ret) {
 		perror("multi-cmd ioctl error\n");
 		goto alloced_error;
 	}
 
+	if (timing) {
+		printf("First data latency: %llu us\n", t_first);
+		printf("Boot operation of %u KiB: %llu us", op_blocks / 2, t_all);
+		if (op_blocks > 1 && t_all > t_first)
+			printf(", %.1f MiB/s",
+			       (op_blocks - 1) * 512.0 / (t_all - t_first) *
+			       1000000 / 1048576);
+		printf("\n");
+	}
+
 	ret = DO_IO(write, boot_data_fd, boot_buf, boot_blocks * 512);
 	if (ret < 0) {
 		perror("Write error\n");
@@ -3447,15 +5729,1070 @@ int do_alt_boot_op(int nargs, char **argv)
 	ret = 0;
 
 alloced_error:
-	if (mioc)
-		free(mioc);
 	if (boot_buf)
 		free(boot_buf);
-boot_data_close:
 	close(boot_data_fd);
 dev_fd_close:
-	close(fd);
+	close_dev(dev);
 	if (ret)
 		exit(1);
 	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc boot_operation [-f] [-t] <boot_data_file> </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * Block I/O benchmarks. A job runs O_DIRECT reads and writes of one block
+ * size on the block device from @depth threads, each with one I/O in flight,
+ * so up to @depth requests reach the host driver, which queues them to the
+ * card as far as it allows (with CMDQ, up to CMDQ_DEPTH).
+ */
+#define BENCH_DEF_SECONDS	10
+
+struct bench_job {
+	int fd;
+	unsigned int bs;
+	__u64 start, size;	/* the area exercised, in bytes */
+	unsigned int write_pct;
+	bool seq;
+	unsigned int depth;
+	unsigned int seconds;
+	__u64 deadline;
+	__u64 next;		/* next sequential block, advanced atomically */
+	int error;
+};
+
+struct bench_worker {
+	struct bench_job *job;
+	pthread_t thread;
+	__u64 seed;
+	__u64 *lat_us;
+	__u64 nr, cap;
+	__u64 writes;
+};
+
+struct bench_result {
+	__u64 ios, writes, elapsed_us;
+	__u64 *lat_us;		/* sorted */
+};
+
+/* xorshift64* */
+static __u64 bench_rand(__u64 *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 2685821657736338717ull;
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bench_job *job = w->job;
+	__u64 blocks = job->size / job->bs, blk, t, v, *lat;
+	bool write;
+	__u8 *buf;
+	ssize_t r;
+	size_t i;
+
+	if (posix_memalign((void **)&buf, 4096, job->bs)) {
+		job->error = -ENOMEM;
+		return NULL;
+	}
+	/* Incompressible data */
+	for (i = 0; i < job->bs; i += sizeof(v)) {
+		v = bench_rand(&w->seed);
+		memcpy(buf + i, &v, sizeof(v));
+	}
+
+	while (!job->error && !abort_requested) {
+		if (job->seq)
+			blk = __sync_fetch_and_add(&job->next, 1) % blocks;
+		else
+			blk = bench_rand(&w->seed) % blocks;
+		write = bench_rand(&w->seed) % 100 < job->write_pct;
+
+		t = get_time_ns() / 1000;
+		if (t >= job->deadline)
+			break;
+		if (write)
+			r = pwrite(job->fd, buf, job->bs,
+				   job->start + blk * job->bs);
+		else
+			r = pread(job->fd, buf, job->bs,
+				  job->start + blk * job->bs);
+		t = get_time_ns() / 1000 - t;
+		if (r != job->bs) {
+			job->error = r < 0 ? -errno : -EIO;
+			break;
+		}
+
+		if (w->nr == w->cap) {
+			w->cap = w->cap ? w->cap * 2 : 4096;
+			lat = realloc(w->lat_us, w->cap * sizeof(*lat));
+			if (!lat) {
+				job->error = -ENOMEM;
+				break;
+			}
+			w->lat_us = lat;
+		}
+		w->lat_us[w->nr++] = t;
+		w->writes += write;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Runs @job and collects the sorted latencies of all its I/Os in @res */
+static int bench_run(struct bench_job *job, struct bench_result *res)
+{
+	struct bench_worker *workers;
+	unsigned int i, started;
+	__u64 begin, n = 0;
+
+	memset(res, 0, sizeof(*res));
+	workers = calloc(job->depth, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	job->next = 0;
+	job->error = 0;
+	begin = get_time_ns() / 1000;
+	job->deadline = begin + job->seconds * 1000000ull;
+	for (started = 0; started < job->depth; started++) {
+		workers[started].job = job;
+		workers[started].seed = begin * (started + 1) | 1;
+		if (pthread_create(&workers[started].thread, NULL,
+				   bench_worker, &workers[started])) {
+			job->error = -EAGAIN;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		res->ios += workers[i].nr;
+		res->writes += workers[i].writes;
+	}
+	res->elapsed_us = get_time_ns() / 1000 - begin;
+
+	if (!job->error && res->ios) {
+		res->lat_us = malloc(res->ios * sizeof(*res->lat_us));
+		if (res->lat_us) {
+			for (i = 0; i < started; i++) {
+				memcpy(res->lat_us + n, workers[i].lat_us,
+				       workers[i].nr * sizeof(*res->lat_us));
+				n += workers[i].nr;
+			}
+			qsort(res->lat_us, n, sizeof(*res->lat_us), cmp_u64);
+		} else {
+			job->error = -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		free(workers[i].lat_us);
+	free(workers);
+
+	return job->error;
+}
+
+/*
+ * Opens @device for a job on [@offset, @offset + @size) (the whole device
+ * for a 0 @size), and checks the area holds at least one block. A job that
+ * writes needs an explicit area, so that it never overwrites a whole disk,
+ * partition table included, by default.
+ */
+static void bench_open(const char *device, struct bench_job *job,
+		       __u64 offset, __u64 size)
+{
+	__u64 dev_bytes;
+
+	if (job->write_pct && !size) {
+		fprintf(stderr, "-w needs the area to overwrite, given with -s\n");
+		exit(1);
+	}
+
+	job->fd = open(device, (job->write_pct ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (job->fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	if (ioctl(job->fd, BLKGETSIZE64, &dev_bytes)) {
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+	if (!size && offset < dev_bytes)
+		size = dev_bytes - offset;
+	if (!job->bs || job->bs % 512 || offset % 4096 ||
+	    offset + size > dev_bytes || size < job->bs) {
+		fprintf(stderr, "Invalid block size or area for %s (%llu bytes)\n",
+			device, dev_bytes);
+		exit(1);
+	}
+	job->start = offset;
+	job->size = size - size % job->bs;
+}
+
+/*
+ * The kernel refuses MMC ioctls on a partition (EPERM), so fall back to
+ * the debugfs EXT_CSD of the card behind it.
+ */
+static int bench_read_extcsd(const char *device, __u8 *ext_csd)
+{
+	struct mmc_dev *dev;
+	int ret;
+
+	ret = mmc_dev_open(device, O_RDWR, &dev);
+	if (!ret) {
+		if (dev_trace)
+			mmc_dev_set_trace(dev, dev_trace, NULL);
+		ret = mmc_read_extcsd(dev, ext_csd);
+		mmc_dev_close(dev);
+	}
+	if (ret)
+		ret = read_extcsd_debugfs(device, ext_csd);
+
+	return ret;
+}
+
+/*
+ * CMDQ support from EXT_CSD (NULL if it could not be read); the kernel may
+ * still switch CMDQ off at runtime.
+ */
+static void bench_print_cmdq(const __u8 *ext_csd)
+{
+	if (!ext_csd)
+		printf("CMDQ:     unknown, could not read EXT_CSD\n");
+	else if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_1 ||
+		 !(ext_csd[EXT_CSD_CMDQ_SUPPORT] & 1))
+		printf("CMDQ:     not supported\n");
+	else
+		printf("CMDQ:     supported, depth %u, CMDQ_MODE_EN %u\n",
+		       (ext_csd[EXT_CSD_CMDQ_DEPTH] & 0x1f) + 1,
+		       ext_csd[EXT_CSD_CMDQ_MODE_EN] & 1);
+}
+
+int do_bench_qdepth(int nargs, char **argv)
+{
+	struct bench_job job = { .bs = 4096, .seconds = BENCH_DEF_SECONDS };
+	struct bench_result res;
+	unsigned int depths[32], ndepths = 0, i;
+	unsigned long kib, offset_kib = 0, size_kib = 0;
+	char def_list[] = "1,2,4,8,16,32";
+	char *device, *list = def_list, *tok, *end;
+	__u8 ext_csd[512];
+	int ret = 0, opt;
+
+	while ((opt = getopt(nargs, argv, "q:b:t:w:o:s:")) != -1) {
+		switch (opt) {
+		case 'q':
+			list = optarg;
+			break;
+		case 'b':
+			if (parse_kib(optarg, &kib))
+				goto usage;
+			job.bs = kib * 1024;
+			break;
+		case 't':
+			job.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			job.write_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (parse_kib(optarg, &offset_kib))
+				goto usage;
+			break;
+		case 's':
+			if (parse_kib(optarg, &size_kib))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 1 || !job.seconds || job.write_pct > 100)
+		goto usage;
+	device = argv[optind];
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (ndepths == sizeof(depths) / sizeof(depths[0]))
+			goto usage;
+		depths[ndepths] = strtoul(tok, &end, 0);
+		if (*end || !depths[ndepths] || depths[ndepths] > 256)
+			goto usage;
+		ndepths++;
+	}
+	if (!ndepths)
+		goto usage;
+
+	bench_print_cmdq(bench_read_extcsd(device, ext_csd) ? NULL : ext_csd);
+	bench_open(device, &job, offset_kib * 1024ull, size_kib * 1024ull);
+
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
+
+	printf("Random %u KiB I/O, %u%% writes, over %llu MiB at %llu MiB, %u s per depth\n",
+	       job.bs / 1024, job.write_pct, job.size >> 20, job.start >> 20,
+	       job.seconds);
+	printf("%5s %10s %9s %9s %9s %9s %9s\n", "depth", "IOPS", "MiB/s",
+	       "p50 us", "p99 us", "p99.9 us", "max us");
+
+	for (i = 0; i < ndepths && !abort_requested; i++) {
+		job.depth = depths[i];
+		ret = bench_run(&job, &res);
+		if (ret) {
+			fprintf(stderr, "I/O error on %s: %s\n", device,
+				strerror(-ret));
+			break;
+		}
+		if (!res.ios)
+			continue;
+		printf("%5u %10.1f %9.2f %9llu %9llu %9llu %9llu\n", job.depth,
+		       res.ios * 1e6 / res.elapsed_us,
+		       (double)res.ios * job.bs / res.elapsed_us * 1e6 / 1048576,
+		       percentile(res.lat_us, res.ios, 500),
+		       percentile(res.lat_us, res.ios, 990),
+		       percentile(res.lat_us, res.ios, 999),
+		       res.lat_us[res.ios - 1]);
+		fflush(stdout);
+		free(res.lat_us);
+	}
+
+	close(job.fd);
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc bench qdepth [-q <depth,...>] [-b <block KiB>] [-t <seconds>] [-w <write %%>] [-o <offset KiB>] [-s <size KiB>] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * Prints what identifies the part and the conditions of a benchmark run:
+ * CID, firmware version, bus mode, cache and CMDQ state.
+ */
+static void bench_print_tags(const char *device)
+{
+	char dir[PATH_MAX], buf[64];
+	struct host_ios ios;
+	__u8 ext_csd[512];
+	bool have_ext_csd;
+	__u32 cache_kib;
+	int i;
+
+	have_ext_csd = !bench_read_extcsd(device, ext_csd);
+
+	printf("Device:   %s\n", device);
+	if (!card_sysfs_dir(device, dir, sizeof(dir)) &&
+	    read_sysfs_attr(dir, "cid", buf, sizeof(buf)))
+		printf("CID:      %s\n", buf);
+
+	if (have_ext_csd) {
+		/* Same format as the kernel's fwrev attribute */
+		printf("Firmware: 0x");
+		for (i = 0; i < 8; i++)
+			printf("%02x", ext_csd[EXT_CSD_FIRMWARE_VERSION + i]);
+		printf(", EXT_CSD rev %u\n", ext_csd[EXT_CSD_REV]);
+	}
+
+	if (!read_host_ios(device, NULL, &ios))
+		printf("Bus:      %s, %u bits, %u kHz\n",
+		       ios.timing[0] ? ios.timing : "unknown timing", ios.width,
+		       ios.clock_hz / 1000);
+	else if (have_ext_csd)
+		printf("Bus:      HS_TIMING 0x%02x (no debugfs ios)\n",
+		       ext_csd[EXT_CSD_HS_TIMING]);
+
+	if (have_ext_csd) {
+		cache_kib = ext_csd[EXT_CSD_CACHE_SIZE_0] |
+			    ext_csd[EXT_CSD_CACHE_SIZE_1] << 8 |
+			    ext_csd[EXT_CSD_CACHE_SIZE_2] << 16 |
+			    ext_csd[EXT_CSD_CACHE_SIZE_3] << 24;
+		if (!cache_kib)
+			printf("Cache:    none\n");
+		else
+			printf("Cache:    %u KiB, %s\n", cache_kib,
+			       ext_csd[EXT_CSD_CACHE_CTRL] & 1 ? "on" : "off");
+	}
+	bench_print_cmdq(have_ext_csd ? ext_csd : NULL);
+}
+
+#define BENCH_SUITE_SECONDS	5
+
+int do_bench(int nargs, char **argv)
+{
+	static const struct {
+		const char *name;
+		bool seq;
+		unsigned int write_pct;
+	} tests[] = {
+		{ "seqread", true, 0 },
+		{ "randread", false, 0 },
+		{ "seqwrite", true, 100 },
+		{ "randwrite", false, 100 },
+	};
+	struct bench_job job = { .depth = 1, .seconds = BENCH_SUITE_SECONDS };
+	struct bench_result res;
+	struct lat_hist hist;
+	unsigned int sizes[16], nsizes = 0, t, i;
+	unsigned long kib, offset_kib = 0, size_kib = 0;
+	char def_list[] = "4,128,512";
+	char *device, *list = def_list, *tok;
+	bool writes = false;
+	__u64 n;
+	int ret = 0, opt;
+
+	while ((opt = getopt(nargs, argv, "b:t:q:wo:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			list = optarg;
+			break;
+		case 't':
+			job.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			job.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writes = true;
+			break;
+		case 'o':
+			if (parse_kib(optarg, &offset_kib))
+				goto usage;
+			break;
+		case 's':
+			if (parse_kib(optarg, &size_kib))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 1 || !job.seconds || !job.depth ||
+	    job.depth > 256)
+		goto usage;
+	device = argv[optind];
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (nsizes == sizeof(sizes) / sizeof(sizes[0]) ||
+		    parse_kib(tok, &kib) || !kib)
+			goto usage;
+		sizes[nsizes++] = kib * 1024;
+	}
+	if (!nsizes)
+		goto usage;
+
+	bench_print_tags(device);
+
+	/* The largest block size decides the alignment of the area */
+	job.write_pct = writes ? 100 : 0;
+	for (i = 0; i < nsizes; i++)
+		if (sizes[i] > job.bs)
+			job.bs = sizes[i];
+	bench_open(device, &job, offset_kib * 1024ull, size_kib * 1024ull);
+
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
+
+	printf("Area:     %llu MiB at %llu MiB, queue depth %u, %u s per test\n\n",
+	       job.size >> 20, job.start >> 20, job.depth, job.seconds);
+
+	for (t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		if (tests[t].write_pct && !writes)
+			continue;
+		for (i = 0; i < nsizes && !abort_requested; i++) {
+			job.bs = sizes[i];
+			job.seq = tests[t].seq;
+			job.write_pct = tests[t].write_pct;
+			ret = bench_run(&job, &res);
+			if (ret) {
+				fprintf(stderr, "I/O error on %s: %s\n", device,
+					strerror(-ret));
+				goto out;
+			}
+			if (!res.ios)
+				continue;
+
+			printf("%-9s %5u KiB: %9.2f MiB/s %10.1f IOPS, p50 %llu us, p99 %llu us, p99.9 %llu us\n",
+			       tests[t].name, job.bs / 1024,
+			       (double)res.ios * job.bs / res.elapsed_us * 1e6 / 1048576,
+			       res.ios * 1e6 / res.elapsed_us,
+			       percentile(res.lat_us, res.ios, 500),
+			       percentile(res.lat_us, res.ios, 990),
+			       percentile(res.lat_us, res.ios, 999));
+			memset(&hist, 0, sizeof(hist));
+			for (n = 0; n < res.ios; n++)
+				lat_hist_add(&hist, res.lat_us[n]);
+			lat_hist_print(stdout, &hist);
+			fflush(stdout);
+			free(res.lat_us);
+		}
+	}
+
+out:
+	close(job.fd);
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc bench [-b <block KiB,...>] [-t <seconds>] [-q <depth>] [-w] [-o <offset KiB>] [-s <size KiB>] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/* The commands bench cmd can send, with their usual argument and flags */
+static int bench_fill_cmd(struct mmc_ioc_cmd *cmd, unsigned int opcode,
+			  __u32 arg, bool have_arg, __u8 *buf)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opcode = opcode;
+
+	switch (opcode) {
+	case MMC_SEND_STATUS:
+		cmd->arg = have_arg ? arg : 1 << 16;
+		cmd->flags = MMC_RSP_R1 | MMC_CMD_AC;
+		break;
+	case MMC_SEND_EXT_CSD:
+		cmd->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+		cmd->blksz = 512;
+		cmd->blocks = 1;
+		mmc_ioc_cmd_set_data((*cmd), buf);
+		break;
+	case MMC_SWITCH:
+		/* A real switch, only with an explicit argument */
+		if (!have_arg)
+			return -EINVAL;
+		cmd->arg = arg;
+		cmd->write_flag = 1;
+		cmd->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void bench_cmd_report(const char *what, __u64 *ns, unsigned int n,
+			     unsigned int per_ioctl)
+{
+	__u64 sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+
+	printf("%-22s %8u %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       what, n, ns[0] / 1000.0, sum / 1000.0 / n,
+	       percentile(ns, n, 500) / 1000.0, percentile(ns, n, 900) / 1000.0,
+	       percentile(ns, n, 990) / 1000.0, ns[n - 1] / 1000.0);
+	if (per_ioctl > 1)
+		printf("%-22s %8s %10s %10.1f\n", "  per command", "", "",
+		       sum / 1000.0 / n / per_ioctl);
+}
+
+int do_bench_cmd(int nargs, char **argv)
+{
+	struct mmc_ioc_multi_cmd *multi = NULL;
+	struct mmc_ioc_cmd cmd;
+	unsigned int count = 1000, batch = 0, opcode, i, j, nbatches;
+	__u32 arg = 0;
+	bool have_arg = false;
+	__u8 *bufs;
+	__u64 *ns, t, single_mean = 0, multi_mean = 0;
+	struct mmc_dev *dev;
+	char *device, *end, label[32];
+	int ret = 0, opt;
+
+	while ((opt = getopt(nargs, argv, "n:m:a:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			arg = strtoul(optarg, NULL, 0);
+			have_arg = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 2 || !count || batch > MMC_IOC_MAX_CMDS)
+		goto usage;
+	opcode = strtoul(argv[optind], &end, 0);
+	device = argv[optind + 1];
+	if (*end || bench_fill_cmd(&cmd, opcode, arg, have_arg, NULL)) {
+		fprintf(stderr, "Only CMD%u, CMD%u and CMD%u (with -a) can be benchmarked\n",
+			MMC_SEND_STATUS, MMC_SEND_EXT_CSD, MMC_SWITCH);
+		exit(1);
+	}
+
+	ns = calloc(count, sizeof(*ns));
+	bufs = calloc(batch ? batch : 1, 512);
+	if (batch)
+		multi = calloc(1, sizeof(*multi) +
+				  batch * sizeof(struct mmc_ioc_cmd));
+	if (!ns || !bufs || (batch && !multi)) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+
+	dev = open_dev(device);
+
+	printf("%-22s %8s %10s %10s %10s %10s %10s %10s (us)\n", "ioctl",
+	       "count", "min", "mean", "p50", "p90", "p99", "max");
+
+	for (i = 0; i < count; i++) {
+		bench_fill_cmd(&cmd, opcode, arg, have_arg, bufs);
+		t = get_time_ns();
+		ret = mmc_cmd(dev, &cmd);
+		ns[i] = get_time_ns() - t;
+		if (ret)
+			goto err;
+		single_mean += ns[i];
+	}
+	single_mean /= count;
+	snprintf(label, sizeof(label), "CMD%u", opcode);
+	bench_cmd_report(label, ns, count, 1);
+
+	if (batch) {
+		nbatches = (count + batch - 1) / batch;
+		multi->num_of_cmds = batch;
+		for (i = 0; i < nbatches; i++) {
+			for (j = 0; j < batch; j++)
+				bench_fill_cmd(&multi->cmds[j], opcode, arg,
+					       have_arg, bufs + j * 512);
+			t = get_time_ns();
+			ret = mmc_multi_cmd(dev, multi);
+			ns[i] = get_time_ns() - t;
+			if (ret)
+				goto err;
+			multi_mean += ns[i];
+		}
+		multi_mean /= (__u64)nbatches * batch;
+		snprintf(label, sizeof(label), "%u x CMD%u multi", batch,
+			 opcode);
+		bench_cmd_report(label, ns, nbatches, batch);
+
+		printf("Batching by %u saves %.1f us (%.0f%%) per command\n",
+		       batch, ((double)single_mean - multi_mean) / 1000,
+		       100.0 * ((double)single_mean - multi_mean) / single_mean);
+	}
+
+	close_dev(dev);
+	free(multi);
+	free(bufs);
+	free(ns);
+	return 0;
+
+err:
+	fprintf(stderr, "CMD%u failed on %s: %s\n", opcode, device,
+		strerror(-ret));
+	exit(1);
+
+usage:
+	fprintf(stderr, "Usage: mmc bench cmd [-n <count>] [-m <batch>] [-a <arg>] <opcode> </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * Writes @blocks sectors at sector @sect with CMD23+CMD25, reliably with
+ * @rel, in pieces of at most @chunk sectors, and waits up to @busy_ms for
+ * the card to finish programming each, polling it every @poll_ms. A 0
+ * @poll_ms polls back to back, so the time taken returned in @ns ends when
+ * the card is done rather than at the next poll.
+ */
+static int bench_raw_write(struct mmc_dev *dev, __u32 sect, bool byte_addr,
+			   __u8 *buf, unsigned int blocks, unsigned int chunk,
+			   bool rel, unsigned int busy_ms, unsigned int poll_ms,
+			   __u64 *ns)
+{
+	struct {
+		struct mmc_ioc_multi_cmd multi;
+		struct mmc_ioc_cmd cmds[2];
+	} req;
+	unsigned int done, n;
+	__u32 response;
+	__u64 t;
+	int ret = 0;
+
+	t = get_time_ns();
+	for (done = 0; done < blocks && !ret; done += n) {
+		n = blocks - done < chunk ? blocks - done : chunk;
+
+		memset(&req, 0, sizeof(req));
+		req.multi.num_of_cmds = 2;
+		req.cmds[0].opcode = MMC_SET_BLOCK_COUNT;
+		req.cmds[0].arg = n | (rel ? 1u << 31 : 0);
+		req.cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+		req.cmds[1].opcode = MMC_WRITE_MULTIPLE_BLOCK;
+		req.cmds[1].arg = byte_addr ? (sect + done) * 512 : sect + done;
+		req.cmds[1].write_flag = 1;
+		req.cmds[1].blksz = 512;
+		req.cmds[1].blocks = n;
+		req.cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+		mmc_ioc_cmd_set_data(req.cmds[1], buf + done * 512);
+
+		ret = mmc_multi_cmd(dev, &req.multi);
+		if (!ret)
+			ret = mmc_wait_busy(dev, busy_ms, poll_ms, &response);
+	}
+	*ns = get_time_ns() - t;
+
+	return ret;
+}
+
+int do_bench_relwrite(int nargs, char **argv)
+{
+	unsigned int sizes[16], nsizes = 0, count = 256, i, n, mode;
+	unsigned int busy_ms = 10000, poll_ms = 0;
+	unsigned long kib, offset_kib = 0;
+	__u64 *ns, sum, seed, total[2] = {}, dev_bytes;
+	__u32 blocks, addr, max_blocks;
+	char def_list[] = "4,64,512";
+	char *device, *list = def_list, *tok;
+	__u8 ext_csd[512], *buf;
+	struct mmc_dev *dev;
+	bool byte_addr;
+	int ret, opt;
+
+	while ((opt = getopt(nargs, argv, "b:n:o:t:p:")) != -1) {
+		switch (opt) {
+		case 'b':
+			list = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (parse_kib(optarg, &offset_kib))
+				goto usage;
+			break;
+		case 't':
+			busy_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			poll_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 1 || !count || !busy_ms)
+		goto usage;
+	device = argv[optind];
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		/* One ioctl carries at most 512 KiB */
+		if (nsizes == sizeof(sizes) / sizeof(sizes[0]) ||
+		    parse_kib(tok, &kib) || !kib || kib > 512)
+			goto usage;
+		sizes[nsizes++] = kib * 2;
+	}
+	if (!nsizes)
+		goto usage;
+
+	dev = open_dev(device);
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	byte_addr = !is_blockaddresed(ext_csd);
+
+	/* Raw writes address the hardware partition @device stands for */
+	if (ioctl(mmc_dev_fd(dev), BLKGETSIZE64, &dev_bytes)) {
+		perror("BLKGETSIZE64");
+		exit(1);
+	}
+	for (i = 0; i < nsizes; i++) {
+		if ((offset_kib * 2 + (__u64)count * sizes[i]) * 512 > dev_bytes) {
+			fprintf(stderr, "%u writes of %u KiB at %lu KiB don't fit in %s\n",
+				count, sizes[i] / 2, offset_kib, device);
+			exit(1);
+		}
+	}
+
+	printf("WR_REL_PARAM 0x%02x (%s reliable write), WR_REL_SET 0x%02x\n",
+	       ext_csd[EXT_CSD_WR_REL_PARAM],
+	       ext_csd[EXT_CSD_WR_REL_PARAM] & EN_REL_WR ? "enhanced" : "legacy",
+	       ext_csd[EXT_CSD_WR_REL_SET]);
+	printf("Note: normal writes to a partition set in WR_REL_SET are reliable too\n");
+
+	/*
+	 * Legacy reliable writes are limited to REL_WR_SEC_C sectors, larger
+	 * ones are split as the kernel does
+	 */
+	max_blocks = ~0u;
+	if (!(ext_csd[EXT_CSD_WR_REL_PARAM] & EN_REL_WR)) {
+		max_blocks = ext_csd[EXT_CSD_REL_WR_SEC_C];
+		if (!max_blocks)
+			max_blocks = 1;
+		printf("Reliable writes are split in writes of %u sectors\n",
+		       max_blocks);
+	}
+
+	ns = calloc(count, sizeof(*ns));
+	if (!ns || posix_memalign((void **)&buf, 4096, 512 * 1024)) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+	/* Incompressible data */
+	seed = get_time_ns() | 1;
+	for (i = 0; i < 512 * 1024; i += sizeof(sum)) {
+		sum = bench_rand(&seed);
+		memcpy(buf + i, &sum, sizeof(sum));
+	}
+
+	printf("%9s %-9s %9s %10s %10s %10s %10s\n", "block", "mode", "MiB/s",
+	       "mean us", "p50 us", "p99 us", "max us");
+
+	for (i = 0; i < nsizes; i++) {
+		blocks = sizes[i];
+		for (mode = 0; mode < 2; mode++) {
+			/* Both modes write the same sequential range */
+			sum = 0;
+			for (n = 0; n < count; n++) {
+				addr = offset_kib * 2 + n * blocks;
+				ret = bench_raw_write(dev, addr, byte_addr, buf,
+						      blocks,
+						      mode ? max_blocks : blocks,
+						      mode, busy_ms, poll_ms,
+						      &ns[n]);
+				if (ret == -ETIMEDOUT) {
+					fprintf(stderr, "Write of %u sectors at %u still busy after %u ms, see -t\n",
+						blocks, addr, busy_ms);
+					exit(1);
+				}
+				if (ret) {
+					fprintf(stderr, "Write of %u sectors at %u failed: %s\n",
+						blocks, addr, strerror(-ret));
+					exit(1);
+				}
+				sum += ns[n];
+			}
+			qsort(ns, count, sizeof(*ns), cmp_u64);
+			total[mode] = sum;
+
+			printf("%5u KiB %-9s %9.2f %10.1f %10.1f %10.1f %10.1f",
+			       blocks / 2, mode ? "reliable" : "normal",
+			       (double)count * blocks * 512 / sum * 1e9 / 1048576,
+			       sum / 1000.0 / count,
+			       percentile(ns, count, 500) / 1000.0,
+			       percentile(ns, count, 990) / 1000.0,
+			       ns[count - 1] / 1000.0);
+			if (mode)
+				printf("  x%.2f", (double)total[1] / total[0]);
+			printf("\n");
+		}
+	}
+
+	close_dev(dev);
+	free(buf);
+	free(ns);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc bench relwrite [-b <block KiB,...>] [-n <count>] [-o <offset KiB>] [-t <busy_ms>] [-p <poll_ms>] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * The PWR_CL_* field that applies to the bus mode in @ios, as the kernel
+ * picks it: by supply voltage and clock, and for DDR modes the DDR field.
+ * Returns -1 if there is none, e.g. for an unknown supply voltage.
+ */
+static int power_class_field(const struct host_ios *ios)
+{
+	bool ddr = strstr(ios->timing, "DDR") || strstr(ios->timing, "HS400");
+
+	/* OCR bits: 7 is 1.65-1.95 V, 15 to 23 cover 2.7-3.6 V */
+	if (ios->vdd == 7) {
+		if (ios->clock_hz <= 26000000)
+			return EXT_CSD_PWR_CL_26_195;
+		if (ios->clock_hz <= 52000000)
+			return ddr ? EXT_CSD_PWR_CL_DDR_52_195 :
+				     EXT_CSD_PWR_CL_52_195;
+		if (ios->clock_hz <= 200000000)
+			return EXT_CSD_PWR_CL_200_195;
+	} else if (ios->vdd >= 15 && ios->vdd <= 23) {
+		if (ios->clock_hz <= 26000000)
+			return EXT_CSD_PWR_CL_26_360;
+		if (ios->clock_hz <= 52000000)
+			return ddr ? EXT_CSD_PWR_CL_DDR_52_360 :
+				     EXT_CSD_PWR_CL_52_360;
+		if (ios->clock_hz <= 200000000)
+			return ddr && ios->width == 8 ?
+				EXT_CSD_PWR_CL_DDR_200_360 :
+				EXT_CSD_PWR_CL_200_360;
+	}
+
+	return -1;
+}
+
+/* Sequential throughput of @job in MiB/s, 0 if interrupted */
+static double power_class_bench(const char *device, struct bench_job *job)
+{
+	struct bench_result res;
+	double mibs;
+	int ret;
+
+	ret = bench_run(job, &res);
+	if (ret) {
+		fprintf(stderr, "I/O error on %s: %s\n", device, strerror(-ret));
+		exit(1);
+	}
+	if (!res.ios || abort_requested)
+		return 0;
+
+	mibs = (double)res.ios * job->bs / res.elapsed_us * 1e6 / 1048576;
+	printf("%s %u KiB: %.2f MiB/s, p50 %llu us, p99 %llu us\n",
+	       job->write_pct ? "seqwrite" : "seqread", job->bs / 1024, mibs,
+	       percentile(res.lat_us, res.ios, 500),
+	       percentile(res.lat_us, res.ios, 990));
+	free(res.lat_us);
+
+	return mibs;
+}
+
+int do_power_class_set(int nargs, char **argv)
+{
+	struct bench_job job = { .bs = 512 * 1024, .seq = true, .depth = 1,
+				 .seconds = 3 };
+	char *device, *ios_path = NULL;
+	bool dry_run = false, writes = false;
+	unsigned long offset_kib = 0, size_kib = 0;
+	struct host_ios ios;
+	__u8 ext_csd[512], cur, cls;
+	struct mmc_dev *dev;
+	double before, after;
+	int field, ret, opt;
+
+	while ((opt = getopt(nargs, argv, "nt:wi:o:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = true;
+			break;
+		case 't':
+			job.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writes = true;
+			break;
+		case 'i':
+			ios_path = optarg;
+			break;
+		case 'o':
+			if (parse_kib(optarg, &offset_kib))
+				goto usage;
+			break;
+		case 's':
+			if (parse_kib(optarg, &size_kib))
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != nargs - 1 || !job.seconds)
+		goto usage;
+	device = argv[optind];
+
+	/* Never write over a whole disk, partition table included, by default */
+	if (writes && !size_kib) {
+		fprintf(stderr, "-w needs the area to overwrite, given with -s\n");
+		exit(1);
+	}
+
+	ret = read_host_ios(device, ios_path, &ios);
+	if (ret) {
+		fprintf(stderr, "Could not read the bus settings of %s from debugfs: %s\n",
+			device, strerror(-ret));
+		exit(1);
+	}
+
+	dev = open_dev(device);
+	ret = read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	close_dev(dev);
+
+	printf("Bus:         %s, %u bits, %u kHz, vdd %u\n",
+	       ios.timing[0] ? ios.timing : "unknown timing", ios.width,
+	       ios.clock_hz / 1000, ios.vdd);
+
+	if (ext_csd[EXT_CSD_REV] < 4) {
+		fprintf(stderr, "%s has no power classes (EXT_CSD rev %u)\n",
+			device, ext_csd[EXT_CSD_REV]);
+		exit(1);
+	}
+	if (ios.width < 4) {
+		printf("Power classes don't apply to a %u bit bus\n", ios.width);
+		return 0;
+	}
+	field = power_class_field(&ios);
+	if (field < 0) {
+		fprintf(stderr, "No power class for vdd %u at %u kHz\n",
+			ios.vdd, ios.clock_hz / 1000);
+		exit(1);
+	}
+
+	/* 8 bit classes in the high nibble, 4 bit ones in the low nibble */
+	cls = ext_csd[field];
+	cls = ios.width == 8 ? cls >> 4 : cls & 0x0f;
+	cur = ext_csd[EXT_CSD_POWER_CLASS] & 0x0f;
+	printf("PWR_CL:      [%d] 0x%02x, class %u for %u bits\n", field,
+	       ext_csd[field], cls, ios.width);
+	printf("POWER_CLASS: %u, target %u\n", cur, cls);
+
+	if (cur == cls) {
+		printf("%s already runs in power class %u\n", device, cls);
+		return 0;
+	}
+	if (dry_run)
+		return 0;
+
+	job.write_pct = writes ? 100 : 0;
+	bench_open(device, &job, (__u64)offset_kib * 1024,
+		   (__u64)size_kib * 1024);
+
+	signal(SIGINT, abort_handler);
+	signal(SIGTERM, abort_handler);
+
+	printf("\nBefore, power class %u:\n", cur);
+	before = power_class_bench(device, &job);
+	if (abort_requested)
+		exit(1);
+
+	dev = open_dev(device);
+	ret = write_extcsd_value(dev, EXT_CSD_POWER_CLASS, cls, 0);
+	close_dev(dev);
+	if (ret) {
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			cls, EXT_CSD_POWER_CLASS, device);
+		exit(1);
+	}
+
+	printf("After, power class %u:\n", cls);
+	after = power_class_bench(device, &job);
+	close(job.fd);
+
+	if (before && after)
+		printf("\nThroughput %+.1f%% (%.2f -> %.2f MiB/s)\n",
+		       (after - before) / before * 100, before, after);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc power_class set [-n] [-t <seconds>] [-w] [-o <offset KiB>] [-s <size KiB>] [-i <ios file>] </path/to/mmcblkX>\n");
+	exit(1);
 }
@@ -19,6 +19,7 @@
 
 /* mmc_cmds.c */
 int do_read_extcsd(int nargs, char **argv);
+int do_health_get(int nargs, char **argv);
 int do_write_extcsd(int nargs, char **argv);
 int do_writeprotect_boot_get(int nargs, char **argv);
 int do_writeprotect_boot_set(int nargs, char **argv);
@@ -26,21 +27,28 @@ int do_writeprotect_user_get(int nargs, char **argv);
 int do_writeprotect_user_set(int nargs, char **argv);
 int do_disable_512B_emulation(int nargs, char **argv);
 int do_write_boot_en(int nargs, char **argv);
+int do_boot_part_write(int nargs, char **argv);
 int do_boot_bus_conditions_set(int nargs, char **argv);
 int do_write_bkops_en(int nargs, char **argv);
+int do_bkops_daemon(int nargs, char **argv);
 int do_hwreset_en(int nargs, char **argv);
 int do_hwreset_dis(int nargs, char **argv);
 int do_sanitize(int nargs, char **argv);
+int do_hpi(int nargs, char **argv);
 int do_status_get(int nargs, char **argv);
 int do_create_gp_partition(int nargs, char **argv);
 int do_enh_area_set(int nargs, char **argv);
 int do_write_reliability_set(int nargs, char **argv);
+int do_layout_apply(int nargs, char **argv);
+int do_layout_plan(int nargs, char **argv);
 int do_rpmb_write_key(int nargs, char **argv);
 int do_rpmb_read_counter(int nargs, char **argv);
 int do_rpmb_read_block(int nargs, char **argv);
 int do_rpmb_write_block(int nargs, char **argv);
 int do_cache_en(int nargs, char **argv);
 int do_cache_dis(int nargs, char **argv);
+int do_cache_flush(int nargs, char **argv);
+int do_cache_daemon(int nargs, char **argv);
 int do_ffu(int nargs, char **argv);
 int do_opt_ffu1(int nargs, char **argv);
 int do_opt_ffu2(int nargs, char **argv);
@@ -48,9 +56,27 @@ int do_opt_ffu3(int nargs, char **argv);
 int do_opt_ffu4(int nargs, char **argv);
 int do_read_scr(int argc, char **argv);
 int do_read_cid(int argc, char **argv);
+int do_decode_regs(int argc, char **argv);
+int do_list_cards(int argc, char **argv);
 int do_read_csd(int argc, char **argv);
 int do_erase(int nargs, char **argv);
+int do_erase_verify(int nargs, char **argv);
+int do_bench_qdepth(int nargs, char **argv);
+int do_bench(int nargs, char **argv);
+int do_bench_cmd(int nargs, char **argv);
+int do_bench_relwrite(int nargs, char **argv);
+int do_power_class_set(int nargs, char **argv);
 int do_general_cmd_read(int nargs, char **argv);
+int do_raw(int nargs, char **argv);
 int do_softreset(int nargs, char **argv);
 int do_preidle(int nargs, char **argv);
 int do_alt_boot_op(int nargs, char **argv);
+
+/* Device handle cache, for batch mode */
+void dev_cache_enable(void);
+void dev_cache_flush(void);
+/* --poll */
+void dev_poll_busy(unsigned int poll_ms);
+
+/* --trace */
+void trace_enable(const char *path);
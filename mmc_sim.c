@@ -0,0 +1,829 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * mmc_sim - a simulated eMMC for running mmc-utils without hardware.
+ *
+ * Preloaded into mmc (LD_PRELOAD=./mmc_sim.so), it takes over opening
+ * $MMC_SIM_DEVICE (default /dev/mmcblk0) and its boot0, boot1 and rpmb
+ * partitions, and answers the MMC_IOC_CMD, MMC_IOC_MULTI_CMD and block
+ * size ioctls on them. Partition contents live in image files and the card
+ * state (EXT_CSD, RPMB key and counter, write protection) in a state file
+ * under $MMC_SIM_DIR (default /tmp/mmc_sim), so it persists across runs.
+ *
+ *   MMC_SIM_SIZE_MB	size of the user area, default 64
+ *   MMC_SIM_LATENCY	per command latencies, "<op>=<us>[+<us per block>],..."
+ *			where <op> is an opcode, or "6.<index>" for a CMD6
+ *			writing that EXT_CSD byte, e.g. "25=200+30,6.165=2000000"
+ *
+ * R1b commands sent without MMC_RSP_BUSY leave the card busy for their
+ * latency instead of blocking, until it elapses or an HPI is sent.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "mmc.h"
+#include "libmmc.h"
+#include "3rdparty/hmac_sha/hmac_sha2.h"
+
+#define SIM_STATE_MAGIC		0x4d4d4353	/* "MMCS" */
+#define SIM_MAX_WP_GROUPS	65536
+#define SIM_MAX_FDS		64
+#define SIM_BOOT_MULT		32		/* 4 MiB boot partitions */
+#define SIM_RPMB_MULT		1		/* 128 KiB RPMB */
+#define SIM_WP_GRP_BLKS		1024		/* 512 KiB groups */
+
+#define RPMB_RESULT_OK			0x0000
+#define RPMB_RESULT_AUTH_FAILURE	0x0002
+#define RPMB_RESULT_COUNTER_FAILURE	0x0003
+#define RPMB_RESULT_ADDR_FAILURE	0x0004
+#define RPMB_RESULT_WRITE_FAILURE	0x0005
+#define RPMB_RESULT_NO_KEY		0x0007
+
+enum sim_part {
+	PART_USER,
+	PART_BOOT0,
+	PART_BOOT1,
+	PART_RPMB,
+	PART_COUNT
+};
+
+static const char *part_suffix[PART_COUNT] = { "", "boot0", "boot1", "rpmb" };
+
+struct sim_state {
+	__u32 magic;
+	__u32 counter;
+	__u8 key_set;
+	__u8 key[32];
+	__u8 ext_csd[512];
+	__u8 wp[SIM_MAX_WP_GROUPS];	/* write protect type per group */
+};
+
+struct sim_latency {
+	unsigned int base_us;
+	unsigned int per_block_us;
+};
+
+static struct sim_state st;
+static struct sim_latency lat_op[64], lat_switch[256];
+static int fds[SIM_MAX_FDS] = { [0 ... SIM_MAX_FDS - 1] = -1 };
+static enum sim_part fd_part[SIM_MAX_FDS];
+static const char *sim_device, *sim_dir;
+static __u64 busy_until;
+static __u32 switch_error;
+
+/* Last RPMB request, answered by the following read */
+static struct rpmb_frame rpmb_req;
+static unsigned int rpmb_req_blocks;
+static __u16 rpmb_result;
+
+/* Erase sequence */
+static __u32 erase_start, erase_end;
+static int erase_seq;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+
+static __u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(__u64 us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static __u64 part_bytes(enum sim_part part)
+{
+	switch (part) {
+	case PART_BOOT0:
+	case PART_BOOT1:
+		return (__u64)st.ext_csd[EXT_CSD_BOOT_MULT] * 128 * 1024;
+	case PART_RPMB:
+		return (__u64)SIM_RPMB_MULT * 128 * 1024;
+	default:
+		return (__u64)(st.ext_csd[EXT_CSD_SEC_COUNT_0] |
+			       st.ext_csd[EXT_CSD_SEC_COUNT_1] << 8 |
+			       st.ext_csd[EXT_CSD_SEC_COUNT_2] << 16 |
+			       st.ext_csd[EXT_CSD_SEC_COUNT_3] << 24) * 512;
+	}
+}
+
+/* The sector a data address stands for, in bytes up to 2 GiB */
+static __u32 sector_of(__u32 arg)
+{
+	return part_bytes(PART_USER) > 2ull * 1024 * 1024 * 1024 ?
+	       arg : arg / 512;
+}
+
+static void path_of(char *buf, size_t len, const char *name)
+{
+	snprintf(buf, len, "%s/%s", sim_dir, name);
+}
+
+static void save_state(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	path_of(path, sizeof(path), "state");
+	fd = real_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, &st, sizeof(st)) != sizeof(st))
+		fprintf(stderr, "mmc_sim: could not save %s\n", path);
+	real_close(fd);
+}
+
+static void init_ext_csd(__u8 *ext_csd, unsigned long size_mb)
+{
+	__u32 sectors = size_mb * 2048;
+
+	memset(ext_csd, 0, 512);
+	ext_csd[EXT_CSD_S_CMD_SET] = 1;
+	ext_csd[EXT_CSD_HPI_FEATURE] = EXT_CSD_HPI_SUPP;
+	ext_csd[EXT_CSD_HPI_MGMT] = EXT_CSD_HPI_EN;	/* as the kernel does */
+	ext_csd[EXT_CSD_BKOPS_SUPPORT] = 1;
+	ext_csd[EXT_CSD_SUPPORTED_MODES] = EXT_CSD_FFU;
+	ext_csd[EXT_CSD_FFU_FEATURES] = 1;
+	ext_csd[EXT_CSD_PRE_EOL_INFO] = 1;
+	ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A] = 1;
+	ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B] = 1;
+	memcpy(&ext_csd[EXT_CSD_FIRMWARE_VERSION], "SIM00001", 8);
+	ext_csd[EXT_CSD_CACHE_SIZE_1] = 4;		/* 1 MiB */
+	ext_csd[EXT_CSD_GENERIC_CMD6_TIME] = 10;
+	ext_csd[EXT_CSD_REL_WR_SEC_C] = 1;
+	ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] = EXT_CSD_SEC_ER_EN |
+					       EXT_CSD_SEC_GB_CL_EN;
+	ext_csd[EXT_CSD_BOOT_MULT] = SIM_BOOT_MULT;
+	ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] = 1;
+	ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT] = 1;
+	ext_csd[EXT_CSD_HC_WP_GRP_SIZE] = SIM_WP_GRP_BLKS / 1024;
+	ext_csd[EXT_CSD_SEC_COUNT_0] = sectors;
+	ext_csd[EXT_CSD_SEC_COUNT_1] = sectors >> 8;
+	ext_csd[EXT_CSD_SEC_COUNT_2] = sectors >> 16;
+	ext_csd[EXT_CSD_SEC_COUNT_3] = sectors >> 24;
+	ext_csd[EXT_CSD_PART_SWITCH_TIME] = 10;
+	ext_csd[EXT_CSD_REV] = EXT_CSD_REV_V5_1;
+	ext_csd[EXT_CSD_RPMB_SIZE_MULT] = SIM_RPMB_MULT;
+	ext_csd[EXT_CSD_ERASE_GROUP_DEF] = 1;
+	ext_csd[EXT_CSD_PARTITIONING_SUPPORT] = 7;
+	ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_0] = sectors / 1024 / 2;
+	ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_1] = sectors / 1024 / 2 >> 8;
+	ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_2] = sectors / 1024 / 2 >> 16;
+}
+
+static void parse_latency(const char *spec)
+{
+	char *copy, *item, *save;
+
+	if (!spec)
+		return;
+
+	copy = strdup(spec);
+	for (item = strtok_r(copy, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		unsigned int op, idx, base, per_block = 0;
+		struct sim_latency *l;
+
+		if (sscanf(item, "6.%u=%u+%u", &idx, &base, &per_block) >= 2 &&
+		    idx < 256) {
+			l = &lat_switch[idx];
+		} else if (sscanf(item, "%u=%u+%u", &op, &base,
+				  &per_block) >= 2 && op < 64) {
+			l = &lat_op[op];
+		} else {
+			fprintf(stderr, "mmc_sim: bad latency \"%s\"\n", item);
+			continue;
+		}
+		l->base_us = base;
+		l->per_block_us = per_block;
+	}
+	free(copy);
+}
+
+static void sim_init(void)
+{
+	char path[PATH_MAX];
+	unsigned long size_mb;
+	int fd, i;
+
+	if (real_open)
+		return;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+
+	sim_device = getenv("MMC_SIM_DEVICE") ? : "/dev/mmcblk0";
+	sim_dir = getenv("MMC_SIM_DIR") ? : "/tmp/mmc_sim";
+	size_mb = getenv("MMC_SIM_SIZE_MB") ?
+		  strtoul(getenv("MMC_SIM_SIZE_MB"), NULL, 0) : 64;
+	if (!size_mb || size_mb * 2 > SIM_MAX_WP_GROUPS)
+		size_mb = 64;
+	parse_latency(getenv("MMC_SIM_LATENCY"));
+
+	mkdir(sim_dir, 0755);
+	path_of(path, sizeof(path), "state");
+	fd = real_open(path, O_RDONLY);
+	if (fd < 0 || read(fd, &st, sizeof(st)) != sizeof(st) ||
+	    st.magic != SIM_STATE_MAGIC) {
+		memset(&st, 0, sizeof(st));
+		st.magic = SIM_STATE_MAGIC;
+		init_ext_csd(st.ext_csd, size_mb);
+		save_state();
+	}
+	if (fd >= 0)
+		real_close(fd);
+
+	for (i = 0; i < PART_COUNT; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s.img",
+			 i == PART_USER ? "user" : part_suffix[i]);
+		path_of(path, sizeof(path), name);
+		fd = real_open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+			continue;
+		if (ftruncate(fd, part_bytes(i)))
+			fprintf(stderr, "mmc_sim: could not size %s\n", path);
+		real_close(fd);
+	}
+}
+
+/* Returns the partition @path names, or -1 if it isn't the simulated card */
+static int sim_part_of(const char *path)
+{
+	size_t len = strlen(sim_device);
+	int i;
+
+	if (strncmp(path, sim_device, len))
+		return -1;
+
+	for (i = 0; i < PART_COUNT; i++)
+		if (!strcmp(path + len, part_suffix[i]))
+			return i;
+
+	return -1;
+}
+
+static int sim_open(const char *path, int flags, mode_t mode)
+{
+	char img[PATH_MAX], name[32];
+	int part, fd;
+
+	sim_init();
+
+	part = sim_part_of(path);
+	if (part < 0)
+		return real_open(path, flags, mode);
+
+	snprintf(name, sizeof(name), "%s.img",
+		 part == PART_USER ? "user" : part_suffix[part]);
+	path_of(img, sizeof(img), name);
+	/* The images may live on a filesystem without O_DIRECT support */
+	fd = real_open(img, flags & ~(O_DIRECT | O_CREAT | O_TRUNC), 0);
+	if (fd >= 0 && fd < SIM_MAX_FDS) {
+		fds[fd] = fd;
+		fd_part[fd] = part;
+	}
+
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return sim_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+	__attribute__((alias("open")));
+
+int __open_2(const char *path, int flags)
+{
+	return sim_open(path, flags, 0);
+}
+
+int __open64_2(const char *path, int flags)
+	__attribute__((alias("__open_2")));
+
+int close(int fd)
+{
+	sim_init();
+
+	if (fd >= 0 && fd < SIM_MAX_FDS)
+		fds[fd] = -1;
+
+	return real_close(fd);
+}
+
+static __u32 r1_status(void)
+{
+	__u32 state = R1_STATE_TRAN, status;
+
+	if (busy_until && now_us() < busy_until)
+		state = R1_STATE_PRG;
+	else
+		busy_until = 0;
+
+	status = state << 9;
+	if (state == R1_STATE_TRAN)
+		status |= R1_READY_FOR_DATA;
+	status |= switch_error;
+	switch_error = 0;
+
+	return status;
+}
+
+static void rpmb_mac(const struct rpmb_frame *frames, unsigned int n,
+		     __u8 *mac)
+{
+	hmac_sha256_ctx ctx;
+	unsigned int i;
+
+	hmac_sha256_init(&ctx, st.key, sizeof(st.key));
+	for (i = 0; i < n; i++)
+		hmac_sha256_update(&ctx, frames[i].data, sizeof(frames[i]) -
+				   offsetof(struct rpmb_frame, data));
+	hmac_sha256_final(&ctx, mac, 32);
+}
+
+static int rpmb_pio(int fd, void *buf, size_t len, off_t off, int wr)
+{
+	ssize_t n = wr ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+
+	return n == len ? 0 : -EIO;
+}
+
+static void rpmb_request(int fd, struct rpmb_frame *frames, unsigned int n)
+{
+	__u8 mac[32];
+	__u16 type = be16toh(frames[0].req_resp);
+	__u16 addr = be16toh(frames[0].addr);
+	unsigned int i;
+
+	if (type == MMC_RPMB_READ_RESP)
+		return;
+
+	rpmb_req = frames[0];
+	rpmb_req_blocks = n;
+	rpmb_result = RPMB_RESULT_OK;
+
+	switch (type) {
+	case MMC_RPMB_WRITE_KEY:
+		if (st.key_set) {
+			rpmb_result = RPMB_RESULT_WRITE_FAILURE;
+			break;
+		}
+		memcpy(st.key, frames[0].key_mac, sizeof(st.key));
+		st.key_set = 1;
+		save_state();
+		break;
+	case MMC_RPMB_WRITE:
+		if (!st.key_set) {
+			rpmb_result = RPMB_RESULT_NO_KEY;
+			break;
+		}
+		rpmb_mac(frames, n, mac);
+		if (memcmp(mac, frames[n - 1].key_mac, sizeof(mac))) {
+			rpmb_result = RPMB_RESULT_AUTH_FAILURE;
+			break;
+		}
+		if (be32toh(frames[0].write_counter) != st.counter) {
+			rpmb_result = RPMB_RESULT_COUNTER_FAILURE;
+			break;
+		}
+		if ((addr + n) * 256 > part_bytes(PART_RPMB)) {
+			rpmb_result = RPMB_RESULT_ADDR_FAILURE;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			if (rpmb_pio(fd, frames[i].data, 256,
+				     (off_t)(addr + i) * 256, 1))
+				rpmb_result = RPMB_RESULT_WRITE_FAILURE;
+		st.counter++;
+		save_state();
+		break;
+	case MMC_RPMB_READ_CNT:
+	case MMC_RPMB_READ:
+		if (!st.key_set)
+			rpmb_result = RPMB_RESULT_NO_KEY;
+		break;
+	}
+}
+
+static void rpmb_response(int fd, struct rpmb_frame *frames, unsigned int n)
+{
+	__u16 type = be16toh(rpmb_req.req_resp);
+	__u16 addr = be16toh(rpmb_req.addr);
+	unsigned int i;
+
+	memset(frames, 0, n * sizeof(*frames));
+	for (i = 0; i < n; i++) {
+		frames[i].req_resp = htobe16(type << 8);
+		frames[i].result = htobe16(rpmb_result);
+		frames[i].write_counter = htobe32(st.counter);
+		frames[i].addr = htobe16(addr);
+		memcpy(frames[i].nonce, rpmb_req.nonce, sizeof(frames[i].nonce));
+	}
+
+	if (type == MMC_RPMB_READ && rpmb_result == RPMB_RESULT_OK) {
+		if ((addr + n) * 256 > part_bytes(PART_RPMB)) {
+			frames[n - 1].result = htobe16(RPMB_RESULT_ADDR_FAILURE);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			frames[i].block_count = htobe16(n);
+			rpmb_pio(fd, frames[i].data, 256,
+				 (off_t)(addr + i) * 256, 0);
+		}
+	}
+
+	if (st.key_set && rpmb_result != RPMB_RESULT_NO_KEY)
+		rpmb_mac(frames, n, frames[n - 1].key_mac);
+}
+
+static int wp_group_of(__u32 blk)
+{
+	__u32 grp = blk / SIM_WP_GRP_BLKS;
+
+	return grp < SIM_MAX_WP_GROUPS ? grp : SIM_MAX_WP_GROUPS - 1;
+}
+
+static int range_protected(__u32 blk, __u32 blocks)
+{
+	__u32 b;
+
+	for (b = blk; b < blk + blocks; b += SIM_WP_GRP_BLKS)
+		if (st.wp[wp_group_of(b)])
+			return 1;
+
+	return blocks && st.wp[wp_group_of(blk + blocks - 1)];
+}
+
+static void erase_range(int fd, __u32 start, __u32 end, __u32 *resp)
+{
+	__u8 pattern = st.ext_csd[EXT_CSD_ERASED_MEM_CONT] ? 0xff : 0;
+	__u8 chunk[64 * 1024];
+	__u64 off, stop;
+	__u32 b;
+
+	for (b = start; b <= end; b++) {
+		if (st.wp[wp_group_of(b)]) {
+			*resp |= R1_WP_ERASE_SKIP;
+			continue;
+		}
+		off = (__u64)b * 512;
+		stop = off + 512;
+		/* Extend to the end of the range or the next protected group */
+		while (b < end && !st.wp[wp_group_of(b + 1)]) {
+			b++;
+			stop += 512;
+		}
+		if (!pattern && !fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+					   FALLOC_FL_KEEP_SIZE, off,
+					   stop - off))
+			continue;
+		memset(chunk, pattern, sizeof(chunk));
+		for (; off < stop; off += sizeof(chunk))
+			if (pwrite(fd, chunk, stop - off < sizeof(chunk) ?
+				   stop - off : sizeof(chunk), off) < 0)
+				break;
+	}
+}
+
+static void do_switch(struct mmc_ioc_cmd *cmd)
+{
+	__u8 index = cmd->arg >> 16, value = cmd->arg >> 8;
+
+	if ((cmd->arg >> 24) != MMC_SWITCH_MODE_WRITE_BYTE || index >= 192) {
+		switch_error = R1_SWITCH_ERROR;
+		return;
+	}
+
+	if (index == EXT_CSD_MODE_OPERATION_CODES &&
+	    value == EXT_CSD_FFU_INSTALL &&
+	    st.ext_csd[EXT_CSD_MODE_CONFIG] == EXT_CSD_FFU_MODE) {
+		/* Install: bump the firmware version, clear the download */
+		st.ext_csd[EXT_CSD_FIRMWARE_VERSION + 7]++;
+		memset(&st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0], 0, 4);
+		st.ext_csd[EXT_CSD_FFU_STATUS] = 0;
+		st.ext_csd[EXT_CSD_MODE_CONFIG] = EXT_CSD_NORMAL_MODE;
+	} else if (index == EXT_CSD_BKOPS_START) {
+		/* Self clearing, and there is nothing left to do */
+		st.ext_csd[EXT_CSD_BKOPS_STATUS] = 0;
+	} else if (index == EXT_CSD_SANITIZE_START ||
+		   index == EXT_CSD_FLUSH_CACHE) {
+		/* Self clearing */
+	} else {
+		st.ext_csd[index] = value;
+	}
+	save_state();
+}
+
+static void ffu_program(__u32 blocks, __u32 blksz)
+{
+	__u32 sectors;
+
+	sectors = st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0] |
+		  st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_1] << 8 |
+		  st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_2] << 16 |
+		  st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_3] << 24;
+	sectors += (__u64)blocks * blksz / 512;
+	st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0] = sectors;
+	st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_1] = sectors >> 8;
+	st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_2] = sectors >> 16;
+	st.ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_3] = sectors >> 24;
+	save_state();
+}
+
+static int is_ffu_write(struct mmc_ioc_cmd *cmd)
+{
+	__u32 ffu_arg = st.ext_csd[EXT_CSD_FFU_ARG_0] |
+			st.ext_csd[EXT_CSD_FFU_ARG_1] << 8 |
+			st.ext_csd[EXT_CSD_FFU_ARG_2] << 16 |
+			st.ext_csd[EXT_CSD_FFU_ARG_3] << 24;
+
+	return st.ext_csd[EXT_CSD_MODE_CONFIG] == EXT_CSD_FFU_MODE &&
+	       cmd->arg == ffu_arg;
+}
+
+/* Reads the boot stream of the partition enabled in PART_CONFIG */
+static int boot_stream(struct mmc_ioc_cmd *cmd, void *data)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+	size_t len = (size_t)cmd->blksz * cmd->blocks;
+
+	switch ((st.ext_csd[EXT_CSD_PART_CONFIG] >> 3) & 7) {
+	case 1:
+		path_of(path, sizeof(path), "boot0.img");
+		break;
+	case 2:
+		path_of(path, sizeof(path), "boot1.img");
+		break;
+	case 7:
+		path_of(path, sizeof(path), "user.img");
+		break;
+	default:
+		return -ETIMEDOUT;
+	}
+
+	fd = real_open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (pread(fd, data, len, 0) != len)
+		ret = -EIO;
+	real_close(fd);
+
+	return ret;
+}
+
+static int sim_cmd(int fd, struct mmc_ioc_cmd *cmd)
+{
+	void *data = (void *)(uintptr_t)cmd->data_ptr;
+	enum sim_part part = fd_part[fd];
+	size_t len = (size_t)cmd->blksz * cmd->blocks;
+	struct sim_latency *l = &lat_op[cmd->opcode & 63];
+	__u32 sect = sector_of(cmd->arg), resp = 0;
+	__u64 delay;
+	int ret = 0;
+
+	if (cmd->opcode == MMC_SWITCH)
+		l = &lat_switch[(cmd->arg >> 16) & 0xff];
+	delay = l->base_us + (__u64)l->per_block_us * cmd->blocks;
+
+	switch (cmd->opcode) {
+	case MMC_GO_IDLE_STATE:
+		if (cmd->arg == MMC_BOOT_INITIATION_ARG)
+			ret = boot_stream(cmd, data);
+		st.ext_csd[EXT_CSD_MODE_CONFIG] = EXT_CSD_NORMAL_MODE;
+		break;
+	case MMC_SWITCH:
+		do_switch(cmd);
+		resp = r1_status();
+		break;
+	case MMC_SEND_EXT_CSD:
+		if (len < 512)
+			return -EINVAL;
+		memcpy(data, st.ext_csd, 512);
+		resp = r1_status();
+		break;
+	case MMC_STOP_TRANSMISSION:
+	case MMC_SEND_STATUS:
+		/* Either is an HPI with bit 0 of the argument set */
+		if (cmd->arg & 1)
+			busy_until = 0;
+		resp = r1_status();
+		break;
+	case MMC_SET_BLOCK_COUNT:
+		resp = r1_status();
+		break;
+	case MMC_WRITE_BLOCK:
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		resp = r1_status();
+		if (part == PART_RPMB) {
+			if (len % 512)
+				return -EINVAL;
+			rpmb_request(fd, data, len / 512);
+		} else if (is_ffu_write(cmd)) {
+			ffu_program(cmd->blocks, cmd->blksz);
+		} else if (part == PART_USER &&
+			   range_protected(sect, cmd->blocks)) {
+			resp |= R1_WP_VIOLATION;
+			ret = -EIO;
+		} else if ((__u64)sect * 512 + len > part_bytes(part)) {
+			resp |= R1_OUT_OF_RANGE;
+			ret = -EIO;
+		} else if (pwrite(fd, data, len, (off_t)sect * 512) != len) {
+			ret = -EIO;
+		} else if (!st.ext_csd[EXT_CSD_BKOPS_STATUS]) {
+			/* Writes leave work for background operations */
+			st.ext_csd[EXT_CSD_BKOPS_STATUS] = 1;
+			save_state();
+		}
+		break;
+	case MMC_READ_SINGLE_BLOCK:
+	case MMC_READ_MULTIPLE_BLOCK:
+		resp = r1_status();
+		if (part == PART_RPMB) {
+			if (len % 512)
+				return -EINVAL;
+			rpmb_response(fd, data, len / 512);
+		} else if ((__u64)sect * 512 + len > part_bytes(part)) {
+			resp |= R1_OUT_OF_RANGE;
+			ret = -EIO;
+		} else if (pread(fd, data, len, (off_t)sect * 512) != len) {
+			ret = -EIO;
+		}
+		break;
+	case MMC_SET_WRITE_PROT:
+	case MMC_CLEAR_WRITE_PROT:
+		resp = r1_status();
+		if (cmd->opcode == MMC_CLEAR_WRITE_PROT)
+			st.wp[wp_group_of(sect)] = 0;
+		else if (st.ext_csd[EXT_CSD_USER_WP] & USER_WP_US_PERM_WP_EN)
+			st.wp[wp_group_of(sect)] = 3;
+		else if (st.ext_csd[EXT_CSD_USER_WP] & USER_WP_US_PWR_WP_EN)
+			st.wp[wp_group_of(sect)] = 2;
+		else
+			st.wp[wp_group_of(sect)] = 1;
+		save_state();
+		break;
+	case MMC_SEND_WRITE_PROT_TYPE: {
+		__u64 bits = 0;
+		int g, i;
+
+		if (len < 8)
+			return -EINVAL;
+		for (i = 0, g = wp_group_of(sect);
+		     i < 32 && g + i < SIM_MAX_WP_GROUPS; i++)
+			bits |= (__u64)(st.wp[g + i] & 3) << (i * 2);
+		for (i = 0; i < 8; i++)
+			((__u8 *)data)[7 - i] = bits >> (i * 8);
+		resp = r1_status();
+		break;
+	}
+	case MMC_ERASE_GROUP_START:
+		erase_start = sect;
+		erase_seq = 1;
+		resp = r1_status();
+		break;
+	case MMC_ERASE_GROUP_END:
+		erase_end = sect;
+		resp = r1_status();
+		if (erase_seq != 1)
+			break;
+		erase_seq = 2;
+		if (erase_end < erase_start ||
+		    (__u64)erase_end * 512 >= part_bytes(part))
+			resp |= R1_ERASE_PARAM;
+		break;
+	case MMC_ERASE:
+		resp = r1_status();
+		if (erase_seq != 2) {
+			resp |= R1_ERASE_SEQ_ERROR;
+		} else if (erase_end >= erase_start &&
+			   (__u64)erase_end * 512 < part_bytes(part)) {
+			erase_range(fd, erase_start, erase_end, &resp);
+			delay += (__u64)lat_op[MMC_ERASE].per_block_us *
+				 (erase_end - erase_start + 1);
+		}
+		erase_seq = 0;
+		break;
+	case MMC_GEN_CMD:
+		if (len)
+			memset(data, 0x5a, len);
+		resp = r1_status();
+		break;
+	default:
+		resp = r1_status();
+		break;
+	}
+
+	cmd->response[0] = resp;
+
+	/* An R1b command the caller polls for leaves the card busy */
+	if ((cmd->opcode == MMC_SWITCH || cmd->opcode == MMC_ERASE) &&
+	    !(cmd->flags & MMC_RSP_BUSY) && delay)
+		busy_until = now_us() + delay;
+	else if (delay)
+		sleep_us(delay);
+
+	return ret;
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	struct mmc_ioc_multi_cmd *multi;
+	void *argp;
+	va_list ap;
+	__u64 i;
+	int ret;
+
+	va_start(ap, req);
+	argp = va_arg(ap, void *);
+	va_end(ap);
+
+	sim_init();
+
+	if (fd < 0 || fd >= SIM_MAX_FDS || fds[fd] != fd)
+		return real_ioctl(fd, req, argp);
+
+	switch (req) {
+	case MMC_IOC_CMD:
+		ret = sim_cmd(fd, argp);
+		break;
+	case MMC_IOC_MULTI_CMD:
+		multi = argp;
+		ret = 0;
+		for (i = 0; i < multi->num_of_cmds && !ret; i++)
+			ret = sim_cmd(fd, &multi->cmds[i]);
+		break;
+	case BLKGETSIZE:
+		*(unsigned long *)argp = part_bytes(fd_part[fd]) / 512;
+		return 0;
+	case BLKGETSIZE64:
+		*(__u64 *)argp = part_bytes(fd_part[fd]);
+		return 0;
+	case BLKFLSBUF:
+		return 0;
+	default:
+		return real_ioctl(fd, req, argp);
+	}
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Smoke test of mmc against the simulated eMMC of mmc_sim.c, run by
+# "make check". Each step runs one mmc command on a fresh simulated card and
+# checks its exit status, and the output for a pattern when one is given.
+#
+# Usage: tests/sim-smoke.sh [mmc binary] [mmc_sim.so]
+
+MMC=${1:-./mmc}
+SIM=${2:-./mmc_sim.so}
+DEV=/dev/mmcsim0
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+MMC_SIM_DEVICE=$DEV
+export MMC_SIM_DIR MMC_SIM_SIZE_MB MMC_SIM_DEVICE
+
+pass=0
+fail=0
+
+# check <pattern> <mmc arguments...>, an empty pattern only checks the status
+check()
+{
+	pattern=$1
+	shift
+	out=$(LD_PRELOAD=$SIM "$MMC" "$@" </dev/null 2>&1)
+	status=$?
+	if [ $status -ne 0 ]; then
+		echo "FAIL: mmc $* (exit status $status)"
+	elif [ -n "$pattern" ] && ! printf '%s\n' "$out" | grep -q -- "$pattern"; then
+		echo "FAIL: mmc $* (no \"$pattern\" in output)"
+	else
+		echo "ok:   mmc $*"
+		pass=$((pass + 1))
+		return
+	fi
+	printf '%s\n' "$out" | sed 's/^/      /'
+	fail=$((fail + 1))
+}
+
+# A byte addressed card of 64 MiB, and a sector addressed one of 4 GiB, the
+# images are sparse
+for MMC_SIM_SIZE_MB in 64 4096; do
+	echo "$MMC_SIM_SIZE_MB MiB card:"
+	MMC_SIM_DIR=$TMP/$MMC_SIM_SIZE_MB
+	mkdir "$MMC_SIM_DIR" || exit 1
+
+	check "Extended CSD rev 1.8" extcsd read $DEV
+	check "DEVICE STATE: TRANS" status get $DEV
+	check "No Write Protection" writeprotect user get $DEV
+	check "" cache enable $DEV
+	check "cache flushed" cache flush $DEV
+	check "card ready" hpi $DEV
+	check "sanitize completed" sanitize -p 10 $DEV
+	check "" erase legacy 0 1023 $DEV
+	check "Verify Succeed" erase verify 0 1023 $DEV
+	echo "op=13" > "$MMC_SIM_DIR/seq"
+	check "resp 0x00000900" raw "$MMC_SIM_DIR/seq" $DEV
+	check "CMD13" bench cmd -n 100 13 $DEV
+	check "seqread" bench -t 1 -b 4 $DEV
+	# Global options, separated from their value, keep the program name intact
+	check "	mmc extcsd read" --trace "$MMC_SIM_DIR/trace" --poll 5 help
+	check "cache flushed" --trace "$MMC_SIM_DIR/trace" --poll 5 cache flush $DEV
+done
+
+echo "$pass passed, $fail failed"
+[ $fail -eq 0 ]